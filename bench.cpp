@@ -0,0 +1,1148 @@
+#include "definition_index.h"
+#include "event_parser.h"
+#include "insn_matcher.h"
+#include "iterator_expander.h"
+#include "lexer.h"
+#include "md_generator.h"
+#include "parser.h"
+#include "simd_scan.h"
+
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace cl = llvm::cl;
+
+cl::list<std::string> inputFileNames(cl::Positional, cl::desc("<md-files>"),
+                                     cl::ZeroOrMore);
+cl::opt<unsigned> iterations("iterations",
+                             cl::desc("number of passes over the corpus"),
+                             cl::init(20));
+cl::opt<unsigned>
+    maxThreads("max-threads",
+               cl::desc("largest thread count for the scaling benchmarks, "
+                        "0 for the number of hardware threads"),
+               cl::init(0));
+cl::opt<bool> jsonOutput("json", cl::desc("print the results as JSON"));
+cl::opt<uint64_t>
+    generateSize("generate",
+                 cl::desc("benchmark a synthetic corpus of about this many "
+                          "bytes instead of <md-files>"),
+                 cl::init(0));
+cl::opt<unsigned>
+    generateDepth("generate-depth",
+                  cl::desc("deepest nesting of the synthetic RTL templates"),
+                  cl::init(6));
+cl::opt<double> generateCodeRatio(
+    "generate-code-ratio",
+    cl::desc("share of the synthetic insns and expands with a code block"),
+    cl::init(0.3));
+cl::opt<unsigned>
+    generateFanout("generate-fanout",
+                   cl::desc("files included by each synthetic file"),
+                   cl::init(0));
+cl::opt<unsigned>
+    generateIncludeDepth("generate-include-depth",
+                         cl::desc("levels of synthetic included files"),
+                         cl::init(2));
+cl::opt<uint64_t> generateSeed("generate-seed",
+                               cl::desc("seed of the synthetic corpus"),
+                               cl::init(1));
+cl::opt<unsigned> checkScanners(
+    "check-scanners",
+    cl::desc("instead of benchmarking, lex this many random code blocks one "
+             "character at a time and with the scanners of every instruction "
+             "set the host supports, and fail if they disagree"),
+    cl::init(0));
+cl::opt<std::string>
+    generateDir("generate-dir",
+                cl::desc("where to write the synthetic corpus, by default a "
+                         "temporary directory removed afterwards"));
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Corpus {
+  // parsed with what they include
+  std::vector<std::string> mainFiles;
+  // every file of the include trees once, for the benchmarks that don't
+  // follow includes
+  std::vector<std::unique_ptr<llvm::MemoryBuffer>> buffers;
+  uint64_t totalBytes = 0;
+  // of one parse of the main files, a file counts once per include
+  uint64_t parsedBytes = 0;
+  uint64_t numForms = 0;
+  uint64_t numNodes = 0;
+};
+
+uint64_t countNodes(const grp::CST *node) {
+  uint64_t result = 1;
+  if (node->getKind() == grp::CST_Kind::Expression) {
+    auto *expr = static_cast<const grp::ExpressionCST *>(node);
+    for (const grp::CST *subform : expr->getSubforms()) {
+      result += countNodes(subform);
+    }
+  } else if (node->getKind() == grp::CST_Kind::Vector) {
+    auto *vec = static_cast<const grp::VectorCST *>(node);
+    for (const grp::CST *member : vec->getMembers()) {
+      result += countNodes(member);
+    }
+  }
+  return result;
+}
+
+// parse every main file once, to find the files it includes and count the
+// forms and nodes
+bool loadCorpus(Corpus &corpus) {
+  llvm::StringMap<uint64_t> fileSizes;
+  for (const auto &fileName : corpus.mainFiles) {
+    grp::ParserContext context(
+        grp::ParserOption::createDefaultOption(fileName));
+    grp::CSTParser parser(context);
+    while (auto *form = parser.parseTopCST()) {
+      ++corpus.numForms;
+      corpus.numNodes += countNodes(form);
+    }
+    std::vector<const grp::CSTParser::ParsedFile *> worklist{
+        parser.getMainFile()};
+    while (!worklist.empty()) {
+      const grp::CSTParser::ParsedFile *file = worklist.back();
+      worklist.pop_back();
+      for (const auto &item : file->items) {
+        if (item.included) {
+          worklist.push_back(item.included);
+        }
+      }
+      if (file->isChunk()) {
+        continue;
+      }
+      auto inserted = fileSizes.try_emplace(file->path, 0);
+      if (inserted.second) {
+        auto buffer = llvm::MemoryBuffer::getFile(file->path);
+        if (!buffer) {
+          llvm::errs() << "cannot read " << file->path << ": "
+                       << buffer.getError().message() << "\n";
+          return false;
+        }
+        inserted.first->second = (*buffer)->getBufferSize();
+        corpus.totalBytes += (*buffer)->getBufferSize();
+        corpus.buffers.push_back(std::move(*buffer));
+      }
+      corpus.parsedBytes += inserted.first->second;
+    }
+  }
+  return true;
+}
+
+// the metrics of a benchmark, e.g. {"MB/s", 12.3}; a line of text each or,
+// with -json, an object of the "results" array
+struct Result {
+  std::string name;
+  std::vector<std::pair<std::string, double>> metrics;
+};
+std::vector<Result> results;
+
+void report(std::string name,
+            std::vector<std::pair<std::string, double>> metrics) {
+  if (!jsonOutput) {
+    llvm::outs() << name << ":";
+    bool first = true;
+    for (const auto &metric : metrics) {
+      llvm::outs() << (first ? " " : ", ");
+      first = false;
+      llvm::StringRef unit = metric.first;
+      if (unit == "MB/s") {
+        llvm::outs() << llvm::format("%.1f MB/s", metric.second);
+      } else if (unit == "bytes allocated") {
+        llvm::outs() << llvm::format("%.1f MB allocated",
+                                     metric.second / (1024 * 1024));
+      } else if (unit.endswith("/s")) {
+        llvm::outs() << llvm::format("%.2f M", metric.second / 1e6) << unit;
+      } else {
+        llvm::outs() << llvm::format("%.0f ", metric.second) << unit;
+      }
+    }
+    llvm::outs() << "\n";
+  }
+  results.push_back({std::move(name), std::move(metrics)});
+}
+
+void printJSON(const Corpus &corpus) {
+  llvm::json::OStream json(llvm::outs(), 2);
+  json.object([&] {
+    json.attributeObject("corpus", [&] {
+      json.attribute("files", static_cast<int64_t>(corpus.buffers.size()));
+      json.attribute("bytes", static_cast<int64_t>(corpus.totalBytes));
+      json.attribute("parsed bytes", static_cast<int64_t>(corpus.parsedBytes));
+      json.attribute("forms", static_cast<int64_t>(corpus.numForms));
+      json.attribute("nodes", static_cast<int64_t>(corpus.numNodes));
+    });
+    json.attribute("iterations", static_cast<int64_t>(iterations));
+    json.attributeArray("results", [&] {
+      for (const Result &result : results) {
+        json.object([&] {
+          json.attribute("name", result.name);
+          for (const auto &metric : result.metrics) {
+            json.attribute(metric.first, metric.second);
+          }
+        });
+      }
+    });
+  });
+  llvm::outs() << "\n";
+}
+
+// per second of `seconds` for `iterations` passes over `count` things
+double getRate(double count, std::chrono::duration<double> seconds) {
+  return count * iterations / seconds.count();
+}
+
+double getMBRate(uint64_t bytes, std::chrono::duration<double> seconds) {
+  return getRate(bytes / (1024.0 * 1024), seconds);
+}
+
+// lex every buffer of the corpus till the end of stream, return the number of
+// tokens seen
+uint64_t lexCorpus(const Corpus &corpus, grp::IdentifierInterner &ii) {
+  uint64_t tokens = 0;
+  for (const auto &buffer : corpus.buffers) {
+    grp::Lexer lexer(*buffer, ii, grp::SourceLocation());
+    while (!lexer.lex().isEOS()) {
+      ++tokens;
+    }
+  }
+  return tokens;
+}
+
+void benchLexer(const Corpus &corpus) {
+  auto hostISA = grp::simd::getHostISA();
+  for (int i = 0; i <= static_cast<int>(hostISA); ++i) {
+    auto isa = static_cast<grp::simd::ISA>(i);
+    grp::simd::setActiveISA(isa);
+    grp::IdentifierInterner ii;
+    uint64_t tokens = 0;
+    auto start = Clock::now();
+    for (unsigned iter = 0; iter < iterations; ++iter) {
+      tokens += lexCorpus(corpus, ii);
+    }
+    std::chrono::duration<double> seconds = Clock::now() - start;
+    report(std::string("lex/") + grp::simd::getISAName(isa),
+           {{"MB/s", getMBRate(corpus.totalBytes, seconds)},
+            {"tokens/s", getRate(tokens / iterations, seconds)}});
+  }
+  grp::simd::setActiveISA(hostISA);
+}
+
+// find the top-level form boundaries of the corpus, as done before splitting
+// big files into chunks
+void benchFormScan(const Corpus &corpus) {
+  auto hostISA = grp::simd::getHostISA();
+  for (int i = 0; i <= static_cast<int>(hostISA); ++i) {
+    auto isa = static_cast<grp::simd::ISA>(i);
+    grp::simd::setActiveISA(isa);
+    grp::IdentifierInterner ii;
+    uint64_t forms = 0;
+    auto start = Clock::now();
+    for (unsigned iter = 0; iter < iterations; ++iter) {
+      for (const auto &buffer : corpus.buffers) {
+        grp::Lexer scanner(*buffer, ii, grp::SourceLocation());
+        uint32_t begin, end;
+        while (scanner.scanTopLevelForm(begin, end)) {
+          ++forms;
+        }
+      }
+    }
+    std::chrono::duration<double> seconds = Clock::now() - start;
+    report(std::string("prescan/") + grp::simd::getISAName(isa),
+           {{"MB/s", getMBRate(corpus.totalBytes, seconds)},
+            {"forms/s", getRate(forms / iterations, seconds)}});
+  }
+  grp::simd::setActiveISA(hostISA);
+}
+
+// materialize every number literal of the corpus, either always through
+// APInt or through the inline int64_t path with APInt only on overflow
+void benchNumbers(const Corpus &corpus) {
+  grp::IdentifierInterner ii;
+  std::vector<std::pair<const grp::Lexer *, grp::Token>> numbers;
+  std::vector<std::unique_ptr<grp::Lexer>> lexers;
+  for (const auto &buffer : corpus.buffers) {
+    lexers.push_back(
+        std::make_unique<grp::Lexer>(*buffer, ii, grp::SourceLocation()));
+    for (auto tok = lexers.back()->lex(); !tok.isEOS();
+         tok = lexers.back()->lex()) {
+      if (tok.isNumber()) {
+        numbers.emplace_back(lexers.back().get(), tok);
+      }
+    }
+  }
+  if (numbers.empty()) {
+    return;
+  }
+  for (bool useInline : {false, true}) {
+    uint64_t checksum = 0;
+    auto start = Clock::now();
+    for (unsigned iter = 0; iter < iterations; ++iter) {
+      for (const auto &number : numbers) {
+        int64_t value;
+        if (useInline && number.first->getSmallNumber(number.second, value)) {
+          checksum += value;
+        } else {
+          checksum += number.first->getNumber(number.second)
+                          .sextOrTrunc(64)
+                          .getSExtValue();
+        }
+      }
+    }
+    std::chrono::duration<double> seconds = Clock::now() - start;
+    report(std::string("numbers/") + (useInline ? "inline" : "apint"),
+           {{"numbers/s", getRate(numbers.size(), seconds)},
+            {"checksum", static_cast<double>(checksum % 1000000)}});
+  }
+}
+
+unsigned getMaxThreads() {
+  if (maxThreads) {
+    return maxThreads;
+  }
+  return std::max(1u, std::thread::hardware_concurrency());
+}
+
+// parse every main file (and what it includes) from scratch, with the
+// recursive and the iterative parser, once per way of feeding tokens to
+// the latter, with a warm CSTCache, with one ParserContext per file for
+// all the passes, sharing the included files, and on all the threads
+void benchParser(const Corpus &corpus) {
+  using TokenMode = grp::ParserOption::TokenMode;
+  struct ParserMode {
+    const char *name;
+    void (*configure)(grp::ParserOption &option);
+    bool cached;
+  };
+  ParserMode modes[] = {
+      {"recursive", [](grp::ParserOption &o) { o.recursiveParser = true; }},
+      {"live", [](grp::ParserOption &) {}},
+      {"pretokenized",
+       [](grp::ParserOption &o) { o.tokenMode = TokenMode::Pretokenized; }},
+      {"pipelined",
+       [](grp::ParserOption &o) { o.tokenMode = TokenMode::Pipelined; }},
+      {"hash-consing", [](grp::ParserOption &o) { o.hashConsing = true; }},
+      {"cached", [](grp::ParserOption &) {}, true},
+      {"shared-includes",
+       [](grp::ParserOption &o) { o.shareIncludes = true; }},
+      {"parallel",
+       [](grp::ParserOption &o) { o.numThreads = getMaxThreads(); }},
+  };
+  llvm::SmallString<128> cacheDir;
+  for (const auto &mode : modes) {
+    // by main file, kept for all the passes with ParserOption::shareIncludes
+    std::vector<std::unique_ptr<grp::ParserContext>> contexts(
+        corpus.mainFiles.size());
+    auto parseCorpus = [&](uint64_t &forms, size_t *bytesAllocated) {
+      for (size_t i = 0; i < corpus.mainFiles.size(); ++i) {
+        auto option =
+            grp::ParserOption::createDefaultOption(corpus.mainFiles[i]);
+        mode.configure(option);
+        if (mode.cached) {
+          option.cacheDir = std::string(cacheDir.str());
+        }
+        if (!contexts[i] || !option.shareIncludes) {
+          contexts[i].reset();
+          contexts[i] = std::make_unique<grp::ParserContext>(option);
+        }
+        grp::ParserContext &context = *contexts[i];
+        grp::CSTParser parser(context);
+        while (parser.parseTopCST()) {
+          ++forms;
+        }
+        if (bytesAllocated) {
+          *bytesAllocated += context.getBytesAllocated();
+        }
+      }
+    };
+    uint64_t forms = 0;
+    if (mode.cached) {
+      if (llvm::sys::fs::createUniqueDirectory("grp-bench", cacheDir)) {
+        llvm::errs() << "parse/" << mode.name << ": no cache directory\n";
+        continue;
+      }
+      // write the caches
+      parseCorpus(forms, nullptr);
+      forms = 0;
+    }
+    // arena bytes of one pass over the corpus
+    size_t bytesAllocated = 0;
+    auto start = Clock::now();
+    for (unsigned iter = 0; iter < iterations; ++iter) {
+      parseCorpus(forms, iter == 0 ? &bytesAllocated : nullptr);
+    }
+    std::chrono::duration<double> seconds = Clock::now() - start;
+    report(std::string("parse/") + mode.name,
+           {{"MB/s", getMBRate(corpus.parsedBytes, seconds)},
+            {"forms/s", getRate(forms / iterations, seconds)},
+            {"nodes/s", getRate(corpus.numNodes, seconds)},
+            {"bytes allocated", static_cast<double>(bytesAllocated)}});
+    if (mode.cached) {
+      llvm::sys::fs::remove_directories(cacheDir);
+    }
+  }
+}
+
+// counts every event
+struct CountingHandler : grp::FormHandler {
+  uint64_t events = 0;
+  grp::EventAction count() {
+    ++events;
+    return grp::EventAction::Continue;
+  }
+  grp::EventAction beginExpression(grp::SourceLocation, grp::IDTy,
+                                   grp::IDTy) override {
+    return count();
+  }
+  grp::EventAction beginVector(grp::SourceLocation) override {
+    return count();
+  }
+  void end() override { ++events; }
+  grp::EventAction identifier(grp::SourceLocation, grp::IDTy) override {
+    return count();
+  }
+  grp::EventAction string(grp::SourceLocation, llvm::StringRef) override {
+    return count();
+  }
+  grp::EventAction codeString(grp::SourceLocation, llvm::StringRef) override {
+    return count();
+  }
+  grp::EventAction integer(grp::SourceLocation, int64_t) override {
+    return count();
+  }
+  grp::EventAction wideInteger(grp::SourceLocation,
+                               const llvm::APInt &) override {
+    return count();
+  }
+};
+
+// the names of the define_insns, skipping everything else
+struct InsnNameHandler : grp::FormHandler {
+  uint64_t insns = 0;
+  uint64_t nameBytes = 0;
+  unsigned depth = 0;
+  bool wantName = false;
+  grp::EventAction beginExpression(grp::SourceLocation, grp::IDTy leadID,
+                                   grp::IDTy) override {
+    if (depth++ ||
+        leadID != grp::getKeywordID(grp::RTLCode::DEFINE_INSN)) {
+      return grp::EventAction::SkipSubtree;
+    }
+    ++insns;
+    wantName = true;
+    return grp::EventAction::Continue;
+  }
+  grp::EventAction beginVector(grp::SourceLocation) override {
+    ++depth;
+    return grp::EventAction::SkipSubtree;
+  }
+  void end() override { --depth; }
+  grp::EventAction string(grp::SourceLocation,
+                          llvm::StringRef literal) override {
+    if (wantName) {
+      nameBytes += literal.size();
+      wantName = false;
+    }
+    return grp::EventAction::SkipSubtree;
+  }
+};
+
+// the same scans over the CST, then with a FormHandler: every event, and the
+// define_insn names only
+void benchEvents(const Corpus &corpus) {
+  uint64_t insns = 0;
+  auto start = Clock::now();
+  for (unsigned iter = 0; iter < iterations; ++iter) {
+    for (const auto &fileName : corpus.mainFiles) {
+      grp::ParserContext context(
+          grp::ParserOption::createDefaultOption(fileName));
+      grp::CSTParser parser(context);
+      while (auto *form = parser.parseTopCST()) {
+        insns += form->getLeadID() ==
+                 grp::getKeywordID(grp::RTLCode::DEFINE_INSN);
+      }
+    }
+  }
+  std::chrono::duration<double> seconds = Clock::now() - start;
+  report("events/cst-insns",
+         {{"MB/s", getMBRate(corpus.parsedBytes, seconds)},
+          {"insns", static_cast<double>(insns / iterations)}});
+  CountingHandler counter;
+  InsnNameHandler names;
+  for (grp::FormHandler *handler :
+       std::initializer_list<grp::FormHandler *>{&counter, &names}) {
+    start = Clock::now();
+    for (unsigned iter = 0; iter < iterations; ++iter) {
+      for (const auto &fileName : corpus.mainFiles) {
+        grp::ParserContext context(
+            grp::ParserOption::createDefaultOption(fileName));
+        grp::EventParser parser(context);
+        parser.parse(*handler);
+      }
+    }
+    seconds = Clock::now() - start;
+    if (handler == &counter) {
+      report("events/all",
+             {{"MB/s", getMBRate(corpus.parsedBytes, seconds)},
+              {"events/s", getRate(counter.events / iterations, seconds)}});
+    } else {
+      report("events/insn-names",
+             {{"MB/s", getMBRate(corpus.parsedBytes, seconds)},
+              {"insns", static_cast<double>(names.insns / iterations)}});
+    }
+  }
+}
+
+// Builds RTL an insn pattern matches: operands become registers of their
+// mode (or scratches), operators plus, everything else is copied.
+class RTLInstantiator {
+  llvm::BumpPtrAllocator &alloc;
+  // by operand number, of the pattern being instantiated
+  std::vector<grp::CST *> operands;
+  grp::IdentifierCST *getKeyword(grp::RTLCode code) {
+    return new (alloc.Allocate<grp::IdentifierCST>())
+        grp::IdentifierCST(grp::SourceLocation(), grp::getKeywordID(code));
+  }
+  grp::CST *createExpression(grp::IDTy mode,
+                             llvm::ArrayRef<grp::CST *> subforms) {
+    return grp::ExpressionCST::create(alloc, grp::SourceLocation(), mode,
+                                      subforms);
+  }
+  grp::CST *createVector(llvm::ArrayRef<grp::CST *> members) {
+    return grp::VectorCST::create(alloc, grp::SourceLocation(), members);
+  }
+  grp::CST *&getOperand(unsigned number) {
+    if (number >= operands.size()) {
+      operands.resize(number + 1);
+    }
+    return operands[number];
+  }
+  bool instantiateAll(llvm::ArrayRef<grp::CST *> patterns,
+                      std::vector<grp::CST *> &result) {
+    for (grp::CST *pattern : patterns) {
+      grp::CST *instance = instantiate(pattern);
+      if (!instance) {
+        return false;
+      }
+      result.push_back(instance);
+    }
+    return true;
+  }
+
+public:
+  explicit RTLInstantiator(llvm::BumpPtrAllocator &alloc) : alloc(alloc) {}
+  // null for the patterns it doesn't handle
+  grp::CST *instantiate(grp::CST *pattern) {
+    if (pattern->getKind() == grp::CST_Kind::Vector) {
+      std::vector<grp::CST *> members;
+      if (!instantiateAll(
+              static_cast<grp::VectorCST *>(pattern)->getMembers(), members)) {
+        return nullptr;
+      }
+      return createVector(members);
+    }
+    if (pattern->getKind() != grp::CST_Kind::Expression) {
+      return pattern;
+    }
+    auto *expr = static_cast<grp::ExpressionCST *>(pattern);
+    auto sub = expr->getSubforms();
+    grp::IDTy lead = expr->getLeadID();
+    if (!grp::isRTLCodeID(lead) ||
+        grp::getRTXClass(grp::getRTLCode(lead)) != grp::RTXClass::RTX_MATCH) {
+      std::vector<grp::CST *> subforms{sub.front()};
+      if (!instantiateAll(sub.drop_front(), subforms)) {
+        return nullptr;
+      }
+      return createExpression(expr->getMachineMode(), subforms);
+    }
+    if (sub.size() < 2 || sub[1]->getKind() != grp::CST_Kind::Int) {
+      return nullptr;
+    }
+    unsigned number = static_cast<grp::IntCST *>(sub[1])
+                          ->getValue()
+                          .getSExtValue();
+    if (number >= 1024) {
+      return nullptr;
+    }
+    std::vector<grp::CST *> subforms;
+    switch (grp::getRTLCode(lead)) {
+    case grp::RTLCode::MATCH_OPERAND:
+    case grp::RTLCode::MATCH_DUP: {
+      grp::CST *&operand = getOperand(number);
+      if (!operand) {
+        grp::CST *reg[] = {getKeyword(grp::RTLCode::REG), sub[1]};
+        operand = createExpression(expr->getMachineMode(), reg);
+      }
+      return operand;
+    }
+    case grp::RTLCode::MATCH_SCRATCH: {
+      grp::CST *scratch[] = {getKeyword(grp::RTLCode::SCRATCH)};
+      return getOperand(number) =
+                 createExpression(expr->getMachineMode(), scratch);
+    }
+    case grp::RTLCode::MATCH_OPERATOR:
+    case grp::RTLCode::MATCH_PARALLEL: {
+      if (sub.back()->getKind() != grp::CST_Kind::Vector) {
+        return nullptr;
+      }
+      bool isOperator = grp::getRTLCode(lead) == grp::RTLCode::MATCH_OPERATOR;
+      std::vector<grp::CST *> members;
+      if (!instantiateAll(
+              static_cast<grp::VectorCST *>(sub.back())->getMembers(),
+              members)) {
+        return nullptr;
+      }
+      if (isOperator) {
+        subforms.push_back(getKeyword(grp::RTLCode::PLUS));
+        subforms.insert(subforms.end(), members.begin(), members.end());
+        return getOperand(number) =
+                   createExpression(expr->getMachineMode(), subforms);
+      }
+      grp::CST *parallel[] = {getKeyword(grp::RTLCode::PARALLEL),
+                              createVector(members)};
+      return getOperand(number) =
+                 createExpression(grp::IdentifierInterner::InvalidID,
+                                  parallel);
+    }
+    default:
+      // match_op_dup, match_par_dup: not worth it
+      return nullptr;
+    }
+  }
+  // an rtx matching the pattern of a define_insn
+  grp::CST *instantiateInsn(const grp::ExpressionCST *defineInsn) {
+    operands.clear();
+    auto sub = defineInsn->getSubforms();
+    auto *templ = static_cast<grp::VectorCST *>(sub[2]);
+    if (templ->getMembers().size() == 1) {
+      return instantiate(templ->getMembers()[0]);
+    }
+    grp::CST *vector = instantiate(templ);
+    if (!vector) {
+      return nullptr;
+    }
+    grp::CST *parallel[] = {getKeyword(grp::RTLCode::PARALLEL), vector};
+    return createExpression(grp::IdentifierInterner::InvalidID, parallel);
+  }
+};
+
+// predicates only check that the mode of an operand is the mode asked for,
+// like GCC's do first
+struct ModePredicates : grp::MatchPredicates {
+  bool testPredicate(llvm::StringRef, grp::IDTy mode,
+                     const grp::CST *operand) override {
+    if (!mode || operand->getKind() != grp::CST_Kind::Expression) {
+      return true;
+    }
+    grp::IDTy operandMode =
+        static_cast<const grp::ExpressionCST *>(operand)->getMachineMode();
+    return !operandMode || operandMode == mode;
+  }
+};
+
+// match an rtx made up from each define_insn against all of them, by trying
+// the insns in turn and with the decision tree of an InsnMatcher
+void benchMatcher(const Corpus &corpus) {
+  uint64_t numInsns = 0, numQueries = 0, numNodes = 0, mismatches = 0;
+  std::chrono::duration<double> buildSeconds{}, linearSeconds{},
+      treeSeconds{};
+  ModePredicates predicates;
+  grp::InsnMatcher::Operands linearOperands, treeOperands;
+  for (const auto &fileName : corpus.mainFiles) {
+    grp::ParserContext context(
+        grp::ParserOption::createDefaultOption(fileName));
+    grp::CSTParser parser(context);
+    std::vector<const grp::ExpressionCST *> forms;
+    while (auto *form = parser.parseTopCST()) {
+      forms.push_back(form);
+    }
+    auto start = Clock::now();
+    grp::InsnMatcher matcher;
+    for (const auto *form : forms) {
+      matcher.addInsn(form);
+    }
+    buildSeconds += Clock::now() - start;
+    numInsns += matcher.getNumInsns();
+    numNodes += matcher.getNumNodes();
+    llvm::BumpPtrAllocator alloc;
+    RTLInstantiator instantiator(alloc);
+    std::vector<const grp::CST *> queries;
+    for (size_t i = 0; i < matcher.getNumInsns(); ++i) {
+      if (auto *rtl = instantiator.instantiateInsn(matcher.getInsn(i).form)) {
+        queries.push_back(rtl);
+      }
+    }
+    numQueries += queries.size();
+    // both must find the same insn with the same operands, untimed
+    auto trimmed = [](grp::InsnMatcher::Operands &operands) {
+      while (!operands.empty() && !operands.back()) {
+        operands.pop_back();
+      }
+      return operands;
+    };
+    for (const grp::CST *rtl : queries) {
+      if (matcher.matchLinear(rtl, predicates, linearOperands) !=
+              matcher.match(rtl, predicates, treeOperands) ||
+          trimmed(linearOperands) != trimmed(treeOperands)) {
+        ++mismatches;
+      }
+    }
+    start = Clock::now();
+    for (unsigned iter = 0; iter < iterations; ++iter) {
+      for (const grp::CST *rtl : queries) {
+        matcher.matchLinear(rtl, predicates, linearOperands);
+      }
+    }
+    linearSeconds += Clock::now() - start;
+    start = Clock::now();
+    for (unsigned iter = 0; iter < iterations; ++iter) {
+      for (const grp::CST *rtl : queries) {
+        matcher.match(rtl, predicates, treeOperands);
+      }
+    }
+    treeSeconds += Clock::now() - start;
+  }
+  if (mismatches) {
+    llvm::errs() << "match: the decision tree disagrees with linear matching "
+                 << mismatches << " times!\n";
+  }
+  report("match/build", {{"insns", static_cast<double>(numInsns)},
+                         {"nodes", static_cast<double>(numNodes)},
+                         {"insns/s", numInsns / buildSeconds.count()}});
+  report("match/linear",
+         {{"matches/s", getRate(numQueries, linearSeconds)}});
+  report("match/decision-tree",
+         {{"matches/s", getRate(numQueries, treeSeconds)}});
+}
+
+// parse every main file and expand its iterators as a stream, sequentially
+// and on all the threads; the parse alone for reference
+void benchExpansion(const Corpus &corpus) {
+  std::vector<unsigned> threadCounts{1};
+  if (getMaxThreads() > 1) {
+    threadCounts.push_back(getMaxThreads());
+  }
+  uint64_t numForms = 0;
+  auto start = Clock::now();
+  for (unsigned iter = 0; iter < iterations; ++iter) {
+    for (const auto &fileName : corpus.mainFiles) {
+      grp::ParserContext context(
+          grp::ParserOption::createDefaultOption(fileName));
+      grp::CSTParser parser(context);
+      while (parser.parseTopCST()) {
+        numForms += !iter;
+      }
+    }
+  }
+  std::chrono::duration<double> seconds = Clock::now() - start;
+  report("expand/parse-only", {{"forms/s", getRate(numForms, seconds)}});
+  for (unsigned numThreads : threadCounts) {
+    uint64_t numVariants = 0;
+    start = Clock::now();
+    for (unsigned iter = 0; iter < iterations; ++iter) {
+      for (const auto &fileName : corpus.mainFiles) {
+        grp::ParserContext context(
+            grp::ParserOption::createDefaultOption(fileName));
+        grp::CSTParser parser(context);
+        grp::IteratorExpander expander(context);
+        grp::ExpansionStream stream(expander, parser, numThreads);
+        while (stream.next()) {
+          numVariants += !iter;
+        }
+      }
+    }
+    seconds = Clock::now() - start;
+    report("expand/threads=" + std::to_string(numThreads),
+           {{"variants", static_cast<double>(numVariants)},
+            {"variants/s", getRate(numVariants, seconds)}});
+  }
+}
+
+// whether `id` appears in `node`, as an identifier or a mode
+bool usesID(const grp::CST *node, grp::IDTy id) {
+  switch (node->getKind()) {
+  case grp::CST_Kind::Identifier:
+    return static_cast<const grp::IdentifierCST *>(node)->getID() == id;
+  case grp::CST_Kind::Expression: {
+    auto *expr = static_cast<const grp::ExpressionCST *>(node);
+    if (expr->getMachineMode() == id) {
+      return true;
+    }
+    return llvm::any_of(expr->getSubforms(), [&](const grp::CST *subform) {
+      return usesID(subform, id);
+    });
+  }
+  case grp::CST_Kind::Vector:
+    return llvm::any_of(
+        static_cast<const grp::VectorCST *>(node)->getMembers(),
+        [&](const grp::CST *member) { return usesID(member, id); });
+  default:
+    return false;
+  }
+}
+
+// the name of a form as DefinitionIndex::getFormsNamed takes it, empty if
+// unnamed
+llvm::StringRef getFormName(const grp::ExpressionCST *form,
+                            const grp::IdentifierInterner &ii) {
+  auto sub = form->getSubforms();
+  if (form->getLeadID() == grp::IdentifierInterner::InvalidID ||
+      sub.size() < 2) {
+    return "";
+  }
+  if (sub[1]->getKind() == grp::CST_Kind::String) {
+    return static_cast<const grp::StringCST *>(sub[1])->getStr();
+  }
+  if (sub[1]->getKind() == grp::CST_Kind::Identifier) {
+    return ii.getName(static_cast<const grp::IdentifierCST *>(sub[1])->getID());
+  }
+  return "";
+}
+
+// look up every named form by its name, and the define_insns and
+// define_splits of each mode, with a DefinitionIndex and by rescanning the
+// forms
+void benchIndex(const Corpus &corpus) {
+  using FormNumber = grp::DefinitionIndex::FormNumber;
+  uint64_t numForms = 0, numQueries = 0, numFound = 0, mismatches = 0;
+  std::chrono::duration<double> buildSeconds{}, linearSeconds{},
+      indexSeconds{};
+  llvm::SmallVector<FormNumber, 64> linearResult, indexResult;
+  for (const auto &fileName : corpus.mainFiles) {
+    grp::ParserContext context(
+        grp::ParserOption::createDefaultOption(fileName));
+    grp::CSTParser parser(context);
+    std::vector<grp::ExpressionCST *> forms;
+    while (auto *form = parser.parseTopCST()) {
+      forms.push_back(form);
+    }
+    numForms += forms.size();
+    grp::IdentifierInterner &ii = context.getIdentifierInterner();
+    grp::DefinitionIndex index(ii, context.getStringPool());
+    auto start = Clock::now();
+    for (unsigned iter = 0; iter < iterations; ++iter) {
+      index.clear();
+      for (grp::ExpressionCST *form : forms) {
+        index.add(form);
+      }
+    }
+    buildSeconds += Clock::now() - start;
+
+    std::vector<std::pair<grp::IDTy, llvm::StringRef>> names;
+    for (const grp::ExpressionCST *form : forms) {
+      llvm::StringRef name = getFormName(form, ii);
+      if (!name.empty()) {
+        names.push_back({form->getLeadID(), name});
+      }
+    }
+    std::vector<std::pair<grp::IDTy, grp::IDTy>> uses;
+    for (grp::IDTy mode = grp::keyword::FirstMachineModeID;
+         mode < grp::keyword::EndID; ++mode) {
+      for (auto code :
+           {grp::RTLCode::DEFINE_INSN, grp::RTLCode::DEFINE_SPLIT}) {
+        uses.push_back({grp::getKeywordID(code), mode});
+      }
+    }
+    numQueries += names.size() + uses.size();
+    auto linearNamed = [&](grp::IDTy lead, llvm::StringRef name) {
+      linearResult.clear();
+      for (size_t i = 0; i < forms.size(); ++i) {
+        if (forms[i]->getLeadID() == lead &&
+            getFormName(forms[i], ii) == name) {
+          linearResult.push_back(i);
+        }
+      }
+    };
+    auto linearUsing = [&](grp::IDTy lead, grp::IDTy id) {
+      linearResult.clear();
+      for (size_t i = 0; i < forms.size(); ++i) {
+        if (forms[i]->getLeadID() == lead && usesID(forms[i], id)) {
+          linearResult.push_back(i);
+        }
+      }
+    };
+    auto indexUsing = [&](grp::IDTy lead, grp::IDTy id) {
+      grp::DefinitionIndex::intersect(index.getFormsWithLead(lead),
+                                      index.getFormsUsing(id), indexResult);
+    };
+    // both must find the same forms, untimed
+    for (const auto &name : names) {
+      linearNamed(name.first, name.second);
+      auto found = index.getFormsNamed(name.first, name.second);
+      if (llvm::makeArrayRef(linearResult) != found) {
+        ++mismatches;
+      }
+    }
+    for (const auto &use : uses) {
+      linearUsing(use.first, use.second);
+      indexUsing(use.first, use.second);
+      if (linearResult != indexResult) {
+        ++mismatches;
+      }
+    }
+    start = Clock::now();
+    for (unsigned iter = 0; iter < iterations; ++iter) {
+      for (const auto &name : names) {
+        linearNamed(name.first, name.second);
+      }
+      for (const auto &use : uses) {
+        linearUsing(use.first, use.second);
+      }
+    }
+    linearSeconds += Clock::now() - start;
+    start = Clock::now();
+    for (unsigned iter = 0; iter < iterations; ++iter) {
+      for (const auto &name : names) {
+        numFound += index.getFormsNamed(name.first, name.second).size();
+      }
+      for (const auto &use : uses) {
+        indexUsing(use.first, use.second);
+        numFound += indexResult.size();
+      }
+    }
+    indexSeconds += Clock::now() - start;
+  }
+  if (mismatches) {
+    llvm::errs() << "index: the index disagrees with rescanning the forms "
+                 << mismatches << " times!\n";
+  }
+  report("index/build", {{"forms/s", getRate(numForms, buildSeconds)}});
+  report("index/linear", {{"queries/s", getRate(numQueries, linearSeconds)}});
+  report("index/lookup",
+         {{"queries", static_cast<double>(numQueries)},
+          {"forms found", static_cast<double>(numFound / iterations)},
+          {"queries/s", getRate(numQueries, indexSeconds)}});
+}
+
+// every thread interns every identifier of the corpus, starting at different
+// points so that they race for the same inserts
+void benchInterner(const Corpus &corpus) {
+  grp::IdentifierInterner corpusII;
+  std::vector<llvm::StringRef> names;
+  for (const auto &buffer : corpus.buffers) {
+    grp::Lexer lexer(*buffer, corpusII, grp::SourceLocation());
+    for (auto tok = lexer.lex(); !tok.isEOS(); tok = lexer.lex()) {
+      if (tok.isIdentifier()) {
+        names.push_back(corpusII.getName(tok.getID()));
+      }
+    }
+  }
+  if (names.empty()) {
+    return;
+  }
+  for (unsigned numThreads = 1;; numThreads *= 2) {
+    numThreads = std::min(numThreads, getMaxThreads());
+    grp::IdentifierInterner ii;
+    std::vector<uint64_t> checksums(numThreads);
+    std::vector<std::thread> threads;
+    auto start = Clock::now();
+    for (unsigned t = 0; t < numThreads; ++t) {
+      threads.emplace_back([&, t] {
+        size_t first = names.size() * t / numThreads;
+        uint64_t checksum = 0;
+        for (unsigned iter = 0; iter < iterations; ++iter) {
+          for (size_t i = 0; i < names.size(); ++i) {
+            checksum += ii.get(names[(first + i) % names.size()]);
+          }
+        }
+        checksums[t] = checksum;
+      });
+    }
+    for (auto &thread : threads) {
+      thread.join();
+    }
+    std::chrono::duration<double> seconds = Clock::now() - start;
+    bool consistent = std::all_of(
+        checksums.begin(), checksums.end(),
+        [&](uint64_t checksum) { return checksum == checksums[0]; });
+    if (!consistent) {
+      llvm::errs() << "intern/" << numThreads
+                   << "-threads: threads disagree on IDs!\n";
+    }
+    report("intern/" + std::to_string(numThreads) + "-threads",
+           {{"lookups/s", getRate(names.size() * numThreads, seconds)}});
+    if (numThreads == getMaxThreads()) {
+      break;
+    }
+  }
+}
+
+
+// a random C code block for checkScanners(), with the constructs the code
+// string scan has to get right: nested braces, strings and chars with
+// escapes, comments, line continuations; runs of plain characters of every
+// length so that blocks start and end at every offset of a vector
+std::string makeCodeBlock(std::mt19937_64 &random) {
+  static const char *const pieces[] = {
+      "{", "}", "\"}\"", "\"\\\"{\"", "'}'", "'\\''", "'\\\\'", "/* } */",
+      "/* * / { */", "// }\n", "\\\n", "\\ \n", "*", "/", "\\", "\n", "\t",
+      "\"a\\\\\"", "'\"'", "\"//\"", "\"/*\""};
+  static const char plain[] = "abcxyz_019 ;()[]<>=+-.,#";
+  std::string result(random() % 40, ' ');
+  result += '{';
+  unsigned depth = 1;
+  unsigned numPieces = random() % 24;
+  for (unsigned i = 0; i < numPieces; ++i) {
+    size_t runLength = random() % 4 ? random() % 8 : random() % 80;
+    for (size_t j = 0; j < runLength; ++j) {
+      result += plain[random() % (sizeof(plain) - 1)];
+    }
+    if (random() % 8 == 0) {
+      // anything at all, the scans must agree on garbage too
+      result += static_cast<char>(random());
+      continue;
+    }
+    llvm::StringRef piece = pieces[random() % llvm::array_lengthof(pieces)];
+    // keep most blocks closed
+    if (piece == "}" && depth == 1 && random() % 4) {
+      piece = "{";
+    }
+    depth += piece == "{";
+    depth -= piece == "}" && depth > 1;
+    result += piece;
+  }
+  result.append(depth, '}');
+  result += random() % 2 ? " \"\")" : "";
+  return result;
+}
+
+// compare the code string scan, one character at a time and fast-forwarded
+// on each instruction set, and the raw scanners of simd_scan.h across the
+// instruction sets, on random code blocks; return the number of
+// disagreements
+uint64_t checkScannersOnRandomBlocks() {
+  auto hostISA = grp::simd::getHostISA();
+  std::mt19937_64 random(generateSeed);
+  grp::IdentifierInterner ii;
+  uint64_t mismatches = 0;
+  for (unsigned n = 0; n < checkScanners; ++n) {
+    std::string block = makeCodeBlock(random);
+    auto buffer = llvm::MemoryBuffer::getMemBuffer(block, "block", false);
+    uint32_t open = block.find('{');
+    grp::Lexer reference(*buffer, ii, grp::SourceLocation());
+    uint32_t expectedClose = reference.scanCodeStringAt(open, false);
+    // the raw scanners from a few places of the block
+    uint32_t starts[] = {0, open,
+                         static_cast<uint32_t>(random() % block.size()),
+                         static_cast<uint32_t>(random() % block.size())};
+    using ScanResults = std::vector<uintptr_t>;
+    ScanResults expectedScans;
+    for (int i = 0; i <= static_cast<int>(hostISA); ++i) {
+      auto isa = static_cast<grp::simd::ISA>(i);
+      grp::simd::setActiveISA(isa);
+      grp::Lexer lexer(*buffer, ii, grp::SourceLocation());
+      uint32_t close = lexer.scanCodeStringAt(open, true);
+      ScanResults scans;
+      const char *end = block.data() + block.size();
+      for (uint32_t start : starts) {
+        const char *pos = block.data() + start;
+        for (auto *scan :
+             {grp::simd::skipWhiteSpaceRun, grp::simd::skipIdentifierRun,
+              grp::simd::skipCodeRun, grp::simd::skipFormRun}) {
+          scans.push_back(scan(pos, end) - block.data());
+        }
+        std::vector<uint32_t> newLines;
+        grp::simd::collectNewLines(pos, end, newLines);
+        scans.insert(scans.end(), newLines.begin(), newLines.end());
+        scans.push_back(newLines.size());
+      }
+      if (!i) {
+        expectedScans = scans;
+      }
+      if (close != expectedClose || scans != expectedScans) {
+        if (!mismatches) {
+          llvm::errs() << "check-scanners: " << grp::simd::getISAName(isa)
+                       << " disagrees on block " << n << ":\n"
+                       << block << "\n";
+        }
+        ++mismatches;
+      }
+    }
+  }
+  grp::simd::setActiveISA(hostISA);
+  return mismatches;
+}
+} // namespace
+
+int main(int argc, const char *argv[]) {
+  cl::ParseCommandLineOptions(argc, argv);
+  if (checkScanners) {
+    uint64_t mismatches = checkScannersOnRandomBlocks();
+    llvm::outs() << "check-scanners: " << checkScanners << " blocks, scalar";
+    for (int i = 1; i <= static_cast<int>(grp::simd::getHostISA()); ++i) {
+      llvm::outs() << ", "
+                   << grp::simd::getISAName(static_cast<grp::simd::ISA>(i));
+    }
+    llvm::outs() << ": " << mismatches << " mismatches\n";
+    return mismatches ? 1 : 0;
+  }
+  Corpus corpus;
+  llvm::SmallString<128> tempDir;
+  if (generateSize) {
+    grp::MDGeneratorOption option;
+    option.size = generateSize;
+    option.maxDepth = generateDepth;
+    option.codeRatio = generateCodeRatio;
+    option.includeFanout = generateFanout;
+    option.includeDepth = generateIncludeDepth;
+    option.seed = generateSeed;
+    llvm::SmallString<128> dir(generateDir);
+    if (dir.empty()) {
+      if (auto ec = llvm::sys::fs::createUniqueDirectory("grp-bench", dir)) {
+        llvm::errs() << "cannot create a directory: " << ec.message() << "\n";
+        return 1;
+      }
+      tempDir = dir;
+    } else if (auto ec = llvm::sys::fs::create_directories(dir)) {
+      llvm::errs() << "cannot create " << dir << ": " << ec.message() << "\n";
+      return 1;
+    }
+    std::string mainFile;
+    if (auto ec = grp::generateMD(dir, option, mainFile)) {
+      llvm::errs() << "cannot write the corpus: " << ec.message() << "\n";
+      return 1;
+    }
+    corpus.mainFiles.push_back(mainFile);
+  }
+  corpus.mainFiles.insert(corpus.mainFiles.end(), inputFileNames.begin(),
+                          inputFileNames.end());
+  if (corpus.mainFiles.empty()) {
+    llvm::errs() << "no input: pass <md-files> or -generate\n";
+    return 1;
+  }
+  if (!loadCorpus(corpus)) {
+    return 1;
+  }
+  benchLexer(corpus);
+  benchFormScan(corpus);
+  benchParser(corpus);
+  benchEvents(corpus);
+  benchNumbers(corpus);
+  benchMatcher(corpus);
+  benchExpansion(corpus);
+  benchIndex(corpus);
+  benchInterner(corpus);
+  if (jsonOutput) {
+    printJSON(corpus);
+  }
+  if (!tempDir.empty()) {
+    llvm::sys::fs::remove_directories(tempDir);
+  }
+}
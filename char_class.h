@@ -0,0 +1,71 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+namespace grp {
+
+// character classes used by the lexer, a character may belong to several
+enum CharClass : uint8_t {
+  CC_Space = 1 << 0,
+  CC_IdentifierStart = 1 << 1,
+  CC_IdentifierCont = 1 << 2,
+  CC_Digit = 1 << 3,
+  CC_NumberStart = 1 << 4,
+  CC_HexDigit = 1 << 5,
+};
+
+namespace detail {
+constexpr std::array<uint8_t, 256> makeCharClassTable() {
+  std::array<uint8_t, 256> table{};
+  // same set as isspace() in the "C" locale
+  for (char c : {' ', '\t', '\n', '\v', '\f', '\r'}) {
+    table[static_cast<unsigned char>(c)] |= CC_Space;
+  }
+  for (unsigned c = 'a'; c <= 'z'; ++c) {
+    table[c] |= CC_IdentifierStart | CC_IdentifierCont;
+    table[c - 'a' + 'A'] |= CC_IdentifierStart | CC_IdentifierCont;
+  }
+  for (char c : {'?', '<', '_', '$'}) {
+    table[static_cast<unsigned char>(c)] |=
+        CC_IdentifierStart | CC_IdentifierCont;
+  }
+  for (char c : {'*', '>'}) {
+    table[static_cast<unsigned char>(c)] |= CC_IdentifierCont;
+  }
+  for (unsigned c = '0'; c <= '9'; ++c) {
+    table[c] |= CC_Digit | CC_HexDigit | CC_NumberStart | CC_IdentifierCont;
+  }
+  for (unsigned c = 'a'; c <= 'f'; ++c) {
+    table[c] |= CC_HexDigit;
+    table[c - 'a' + 'A'] |= CC_HexDigit;
+  }
+  table[static_cast<unsigned char>('-')] |= CC_NumberStart;
+  return table;
+}
+} // namespace detail
+
+inline constexpr std::array<uint8_t, 256> charClassTable =
+    detail::makeCharClassTable();
+
+inline bool hasCharClass(char c, CharClass cc) {
+  return charClassTable[static_cast<unsigned char>(c)] & cc;
+}
+
+inline bool isWhileSpace(char c) { return hasCharClass(c, CC_Space); }
+
+inline bool canStartIdentifier(char c) {
+  return hasCharClass(c, CC_IdentifierStart);
+}
+
+inline bool canContIdentifier(char c) {
+  return hasCharClass(c, CC_IdentifierCont);
+}
+
+inline bool isDigit(char c) { return hasCharClass(c, CC_Digit); }
+
+inline bool isHexDigit(char c) { return hasCharClass(c, CC_HexDigit); }
+
+inline bool canStartNumber(char c) { return hasCharClass(c, CC_NumberStart); }
+
+} // namespace grp
@@ -1,10 +1,14 @@
 #pragma once
 
+#include "keywords.h"
 #include "lexer.h"
-#include "machine_mode.h"
 
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/Support/Allocator.h"
+#include "llvm/Support/TrailingObjects.h"
+
+#include <cstddef>
 #include <memory>
-#include <vector>
 
 namespace grp {
 
@@ -19,6 +23,7 @@ enum class CST_Kind {
   Vector,
   EndOfStream,
 };
+constexpr size_t NumCSTKinds = static_cast<size_t>(CST_Kind::EndOfStream) + 1;
 
 class CST {
   CST_Kind kind;
@@ -27,7 +32,7 @@ class CST {
 public:
   CST(CST_Kind kind, const SourceLocation &loc) : kind(kind), loc(loc) {}
   CST_Kind getKind() const { return kind; }
-  const SourceLocation &getLoc() const { return loc; }
+  SourceLocation getLoc() const { return loc; }
   bool isInvalid() const { return kind == CST_Kind::Invalid; }
 };
 
@@ -45,49 +50,126 @@ public:
   IDTy getID() const { return id; }
 };
 
-class ExpressionCST : public CST {
+// subforms are allocated right after the node in the same arena
+class ExpressionCST final
+    : public CST,
+      private llvm::TrailingObjects<ExpressionCST, CST *> {
+  friend TrailingObjects;
+  // ID of the identifier after the ':', InvalidID if there is none
   IDTy machineMode;
-  std::vector<CST *> subforms;
+  unsigned numSubforms;
 
-public:
   ExpressionCST(const SourceLocation &loc, IDTy machineMode,
-                std::vector<CST *> &&subforms)
+                llvm::ArrayRef<CST *> subforms)
       : CST(CST_Kind::Expression, loc), machineMode(machineMode),
-        subforms(std::move(subforms)) {}
+        numSubforms(subforms.size()) {
+    std::uninitialized_copy(subforms.begin(), subforms.end(),
+                            getTrailingObjects<CST *>());
+  }
+
+public:
+  // `alloc` is usually a BumpPtrAllocator, see CSTCache for another one
+  template <typename AllocatorTy>
+  static ExpressionCST *create(AllocatorTy &alloc, const SourceLocation &loc,
+                               IDTy machineMode,
+                               llvm::ArrayRef<CST *> subforms) {
+    void *ptr = alloc.Allocate(totalSizeToAlloc<CST *>(subforms.size()),
+                               alignof(ExpressionCST));
+    return new (ptr) ExpressionCST(loc, machineMode, subforms);
+  }
   IDTy getLeadID() const {
-    if (subforms.empty() || subforms[0]->getKind() != CST_Kind::Identifier) {
+    if (!numSubforms || getSubforms()[0]->getKind() != CST_Kind::Identifier) {
       return IdentifierInterner::InvalidID;
     }
-    return static_cast<IdentifierCST *>(subforms[0])->getID();
+    return static_cast<IdentifierCST *>(getSubforms()[0])->getID();
   }
   IDTy getMachineMode() const { return machineMode; }
-  llvm::ArrayRef<CST *> getSubforms() const { return subforms; }
+  // MachineMode::Invalid for modes unknown to machine_mode.def
+  MachineMode getKnownMachineMode() const {
+    return grp::getMachineMode(machineMode);
+  }
+  llvm::ArrayRef<CST *> getSubforms() const {
+    return llvm::makeArrayRef(getTrailingObjects<CST *>(), numSubforms);
+  }
+};
+
+// Almost every integer in RTL fits in 64 bits, those are stored inline;
+// wider ones keep their words in the arena.
+class IntegerValue {
+  // 0 if the value is stored inline
+  unsigned wideBits;
+  union {
+    int64_t inlineValue;
+    const uint64_t *wideWords;
+  };
+
+public:
+  explicit IntegerValue(int64_t value) : wideBits(0), inlineValue(value) {}
+  IntegerValue(llvm::BumpPtrAllocator &alloc, const llvm::APInt &value)
+      : wideBits(value.getBitWidth()) {
+    assert(wideBits && "APInt can't be 0-bit wide");
+    unsigned numWords = value.getNumWords();
+    uint64_t *words = alloc.Allocate<uint64_t>(numWords);
+    std::copy_n(value.getRawData(), numWords, words);
+    wideWords = words;
+  }
+  // a wide value whose words are kept elsewhere, e.g. in a CSTCache
+  IntegerValue(unsigned bitWidth, const uint64_t *words)
+      : wideBits(bitWidth), wideWords(words) {
+    assert(wideBits && "APInt can't be 0-bit wide");
+  }
+  bool isWide() const { return wideBits != 0; }
+  // move the words of a wide value by `delta` bytes, for a CSTCache mapped
+  // elsewhere than where it was written
+  void relocate(std::ptrdiff_t delta) {
+    if (isWide()) {
+      wideWords = reinterpret_cast<const uint64_t *>(
+          reinterpret_cast<uintptr_t>(wideWords) + delta);
+    }
+  }
+  int64_t getSExtValue() const {
+    assert(!isWide());
+    return inlineValue;
+  }
+  llvm::APInt getAPInt() const {
+    if (!isWide()) {
+      return llvm::APInt(64, inlineValue, /*isSigned=*/true);
+    }
+    return llvm::APInt(
+        wideBits,
+        llvm::makeArrayRef(wideWords, llvm::APInt::getNumWords(wideBits)));
+  }
 };
 
 class IntCST : public CST {
-  llvm::APInt value;
+  IntegerValue value;
 
 public:
-  IntCST(const SourceLocation &loc, llvm::APInt &&value)
-      : CST(CST_Kind::Int, loc), value(std::move(value)) {}
-  const llvm::APInt &getValue() const { return value; }
+  IntCST(const SourceLocation &loc, const IntegerValue &value)
+      : CST(CST_Kind::Int, loc), value(value) {}
+  const IntegerValue &getValue() const { return value; }
 };
 
 class HostIntCST : public CST {
-  llvm::APInt value;
+  IntegerValue value;
 
 public:
-  HostIntCST(const SourceLocation &loc, llvm::APInt &&value)
-      : CST(CST_Kind::HostInt, loc), value(std::move(value)) {}
-  const llvm::APInt &getValue() const { return value; }
+  HostIntCST(const SourceLocation &loc, const IntegerValue &value)
+      : CST(CST_Kind::HostInt, loc), value(value) {}
+  const IntegerValue &getValue() const { return value; }
 };
 
+// the contents live in the StringPool, escapes processed, and not in the
+// source buffer
 class StringCST : public CST {
+  IDTy id;
   llvm::StringRef str;
 
 public:
-  StringCST(const SourceLocation &loc, llvm::StringRef str)
-      : CST(CST_Kind::String, loc), str(str) {}
+  StringCST(const SourceLocation &loc, IDTy id, llvm::StringRef str)
+      : CST(CST_Kind::String, loc), id(id), str(str) {}
+  // StringPool ID, equal strings have equal IDs
+  IDTy getID() const { return id; }
   llvm::StringRef getStr() const { return str; }
 };
 
@@ -100,12 +182,29 @@ public:
   llvm::StringRef getStr() const { return str; }
 };
 
-class VectorCST : public CST {
-  std::vector<CST *> members;
+// members are allocated right after the node in the same arena
+class VectorCST final : public CST,
+                        private llvm::TrailingObjects<VectorCST, CST *> {
+  friend TrailingObjects;
+  unsigned numMembers;
+
+  VectorCST(const SourceLocation &loc, llvm::ArrayRef<CST *> members)
+      : CST(CST_Kind::Vector, loc), numMembers(members.size()) {
+    std::uninitialized_copy(members.begin(), members.end(),
+                            getTrailingObjects<CST *>());
+  }
 
 public:
-  VectorCST(const SourceLocation &loc, std::vector<CST *> &&members)
-      : CST(CST_Kind::Vector, loc), members(std::move(members)) {}
+  template <typename AllocatorTy>
+  static VectorCST *create(AllocatorTy &alloc, const SourceLocation &loc,
+                           llvm::ArrayRef<CST *> members) {
+    void *ptr = alloc.Allocate(totalSizeToAlloc<CST *>(members.size()),
+                               alignof(VectorCST));
+    return new (ptr) VectorCST(loc, members);
+  }
+  llvm::ArrayRef<CST *> getMembers() const {
+    return llvm::makeArrayRef(getTrailingObjects<CST *>(), numMembers);
+  }
 };
 
 } // namespace grp
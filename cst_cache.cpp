@@ -0,0 +1,717 @@
+#include "cst_cache.h"
+#include "definition_index.h"
+#include "parser.h"
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/xxhash.h"
+
+#include <cstring>
+#include <vector>
+
+#ifdef LLVM_ON_UNIX
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace grp {
+namespace {
+
+constexpr char Magic[8] = {'G', 'R', 'P', 'C', 'S', 'T', '\0', '\0'};
+constexpr uint32_t Version = 3;
+
+// changes with the layout of the nodes
+constexpr uint32_t getLayoutID() {
+  uint32_t result = 0;
+  for (size_t size :
+       {sizeof(void *), sizeof(CST), sizeof(IdentifierCST),
+        sizeof(ExpressionCST), sizeof(IntCST), sizeof(HostIntCST),
+        sizeof(StringCST), sizeof(CodeStringCST), sizeof(VectorCST)}) {
+    result = result * 31 + static_cast<uint32_t>(size);
+  }
+  return result;
+}
+
+// `size` elements at `offset` bytes from the start of the file
+struct Section {
+  uint64_t offset;
+  uint64_t size;
+};
+
+// characters in the chars section
+struct TextRecord {
+  uint64_t offset;
+  uint64_t length;
+};
+
+struct FileRecord {
+  TextRecord name;
+  uint64_t hash;
+  uint64_t size;
+};
+
+// a buffer of the SourceLocationTable, its newline offsets are
+// [firstNewLine, firstNewLine + numNewLines) of the newLines section
+struct LocRecord {
+  // raw encoding of the location of the first character
+  uint32_t start;
+  uint32_t size;
+  uint32_t fileID;
+  uint32_t numNewLines;
+  uint64_t firstNewLine;
+};
+
+struct Header {
+  char magic[8];
+  uint32_t version;
+  uint32_t layoutID;
+  // the address the pointers of the file are for
+  uint64_t base;
+  uint64_t fileSize;
+  Section chars;       // char
+  Section words;       // uint64_t, of wide integers
+  Section files;       // FileRecord, by SourceMgr buffer ID
+  Section locs;        // LocRecord, in location order
+  Section newLines;    // uint32_t
+  Section identifiers; // TextRecord, by ID
+  Section strings;     // TextRecord, by ID
+  Section nodes;       // bytes
+  Section forms;       // ExpressionCST *
+  // offset 0 if no DefinitionIndex was saved
+  Section index;       // CSTCache::IndexRecord
+  Section postings;    // uint32_t, form numbers
+};
+
+// an address nothing else is likely to use, 4 GiB for each cache
+uint64_t getPreferredBase(llvm::StringRef path) {
+  return 0x200000000000ull + ((llvm::xxHash64(path) & 0xfff) << 32);
+}
+
+// bump allocation at the end of the nodes section, for ExpressionCST::create
+// and VectorCST::create
+class NodeArena {
+  std::vector<char> bytes;
+  uint64_t lastOffset = 0;
+
+public:
+  void reserve(size_t size) { bytes.reserve(size); }
+  // the pointer is only good until the next call
+  void *Allocate(size_t size, size_t alignment) {
+    lastOffset = llvm::alignTo(bytes.size(), alignment);
+    bytes.resize(lastOffset + size);
+    return bytes.data() + lastOffset;
+  }
+  // offset of the last allocation
+  uint64_t getLastOffset() const { return lastOffset; }
+  llvm::ArrayRef<char> getBytes() const { return bytes; }
+};
+
+template <typename T>
+llvm::ArrayRef<T> getSection(const char *start, const Section &section) {
+  return llvm::makeArrayRef(reinterpret_cast<const T *>(start + section.offset),
+                            section.size);
+}
+
+// subforms of an expression, members of a vector
+llvm::ArrayRef<CST *> getChildren(const CST *node) {
+  if (node->getKind() == CST_Kind::Expression) {
+    return static_cast<const ExpressionCST *>(node)->getSubforms();
+  }
+  if (node->getKind() == CST_Kind::Vector) {
+    return static_cast<const VectorCST *>(node)->getMembers();
+  }
+  return llvm::None;
+}
+
+const IntegerValue *getIntegerValue(const CST *node) {
+  if (node->getKind() == CST_Kind::Int) {
+    return &static_cast<const IntCST *>(node)->getValue();
+  }
+  if (node->getKind() == CST_Kind::HostInt) {
+    return &static_cast<const HostIntCST *>(node)->getValue();
+  }
+  return nullptr;
+}
+
+template <typename T> T *relocate(T *pointer, std::ptrdiff_t delta) {
+  return reinterpret_cast<T *>(reinterpret_cast<uintptr_t>(pointer) + delta);
+}
+
+// add `delta` to the pointers of the nodes of `forms` and to `forms`, for a
+// file mapped `delta` bytes away from its base; shared nodes are fixed once
+void relocateNodes(llvm::MutableArrayRef<ExpressionCST *> forms,
+                   std::ptrdiff_t delta, bool mayShare) {
+  llvm::DenseSet<const CST *> relocated;
+  std::vector<CST *> stack;
+  for (ExpressionCST *&form : forms) {
+    form = relocate(form, delta);
+    stack.push_back(form);
+  }
+  while (!stack.empty()) {
+    CST *node = stack.back();
+    stack.pop_back();
+    if (mayShare && !relocated.insert(node).second) {
+      continue;
+    }
+    SourceLocation loc = node->getLoc();
+    switch (node->getKind()) {
+    case CST_Kind::Expression:
+    case CST_Kind::Vector: {
+      llvm::ArrayRef<CST *> children = getChildren(node);
+      auto **slots = const_cast<CST **>(children.data());
+      for (size_t i = 0; i < children.size(); ++i) {
+        slots[i] = relocate(slots[i], delta);
+        stack.push_back(slots[i]);
+      }
+      break;
+    }
+    case CST_Kind::Int: {
+      IntegerValue value = static_cast<IntCST *>(node)->getValue();
+      value.relocate(delta);
+      new (node) IntCST(loc, value);
+      break;
+    }
+    case CST_Kind::HostInt: {
+      IntegerValue value = static_cast<HostIntCST *>(node)->getValue();
+      value.relocate(delta);
+      new (node) HostIntCST(loc, value);
+      break;
+    }
+    case CST_Kind::String: {
+      auto *str = static_cast<StringCST *>(node);
+      llvm::StringRef text = str->getStr();
+      new (node) StringCST(loc, str->getID(),
+                           llvm::StringRef(relocate(text.data(), delta),
+                                           text.size()));
+      break;
+    }
+    case CST_Kind::CodeString: {
+      llvm::StringRef text = static_cast<CodeStringCST *>(node)->getStr();
+      new (node) CodeStringCST(
+          loc, llvm::StringRef(relocate(text.data(), delta), text.size()));
+      break;
+    }
+    default:
+      break;
+    }
+  }
+}
+
+} // namespace
+
+// an array of form numbers of a DefinitionIndex, [first, first + size) of the
+// postings section
+struct CSTCache::IndexRecord {
+  uint32_t table;
+  uint32_t size;
+  uint64_t key;
+  uint64_t secondKey;
+  uint64_t first;
+};
+
+namespace {
+
+class Writer {
+  uint64_t base;
+  // the forms are trees unless hash-consed, then subtrees may be shared
+  bool mayShare;
+  std::string chars;
+  llvm::StringMap<uint64_t> textOffsets;
+  std::vector<uint64_t> words;
+  size_t numWords = 0;
+  std::vector<FileRecord> files;
+  std::vector<LocRecord> locs;
+  std::vector<uint32_t> newLines;
+  std::vector<TextRecord> identifiers;
+  std::vector<TextRecord> strings;
+  // enough for all the nodes
+  size_t nodeBytesBound = 0;
+  NodeArena arena;
+  // if mayShare, the mapped address of every node built so far; a map is
+  // too slow for trees of millions of nodes, and not needed for them
+  llvm::DenseMap<const CST *, CST *> built;
+  std::vector<CST *> mappedForms;
+  std::vector<CSTCache::IndexRecord> indexRecords;
+  std::vector<uint32_t> postings;
+  Header header;
+
+  TextRecord addText(llvm::StringRef text);
+  template <typename T> T *getPointer(uint64_t offset) const {
+    return reinterpret_cast<T *>(base + offset);
+  }
+  llvm::StringRef getText(TextRecord text) const {
+    return llvm::StringRef(getPointer<char>(header.chars.offset + text.offset),
+                           text.length);
+  }
+  IntegerValue getMappedValue(const IntegerValue &value);
+  void layout(Section &section, size_t count, size_t elementSize,
+              uint64_t &cursor);
+  // collect what has to be laid out before the nodes
+  void scanNodes(llvm::ArrayRef<ExpressionCST *> forms);
+  // return the address `node` will have once mapped
+  CST *buildNode(const CST *node, llvm::ArrayRef<CST *> mappedChildren);
+  bool buildNodes(llvm::ArrayRef<ExpressionCST *> forms);
+
+public:
+  Writer(uint64_t base, bool mayShare) : base(base), mayShare(mayShare) {}
+  bool write(llvm::StringRef path, llvm::ArrayRef<ExpressionCST *> forms,
+             ParserContext &context, const llvm::SourceMgr &srcMgr,
+             SourceLocationTable &locTable, const DefinitionIndex *index);
+};
+
+TextRecord Writer::addText(llvm::StringRef text) {
+  auto inserted = textOffsets.try_emplace(text, chars.size());
+  if (inserted.second) {
+    chars.append(text.begin(), text.end());
+  }
+  return {inserted.first->second, text.size()};
+}
+
+IntegerValue Writer::getMappedValue(const IntegerValue &value) {
+  if (!value.isWide()) {
+    return value;
+  }
+  llvm::APInt apInt = value.getAPInt();
+  uint64_t offset = header.words.offset + words.size() * sizeof(uint64_t);
+  words.insert(words.end(), apInt.getRawData(),
+               apInt.getRawData() + apInt.getNumWords());
+  return IntegerValue(apInt.getBitWidth(), getPointer<uint64_t>(offset));
+}
+
+void Writer::layout(Section &section, size_t count, size_t elementSize,
+                    uint64_t &cursor) {
+  section.offset = llvm::alignTo(cursor, 8);
+  section.size = count;
+  cursor = section.offset + count * elementSize;
+}
+
+void Writer::scanNodes(llvm::ArrayRef<ExpressionCST *> forms) {
+  llvm::DenseSet<const CST *> scanned;
+  std::vector<const CST *> stack(forms.begin(), forms.end());
+  while (!stack.empty()) {
+    const CST *node = stack.back();
+    stack.pop_back();
+    if (mayShare && !scanned.insert(node).second) {
+      continue;
+    }
+    llvm::ArrayRef<CST *> children = getChildren(node);
+    stack.insert(stack.end(), children.begin(), children.end());
+    // no node is bigger than a StringCST plus its children
+    nodeBytesBound += sizeof(StringCST) + children.size() * sizeof(CST *);
+    if (node->getKind() == CST_Kind::String) {
+      addText(static_cast<const StringCST *>(node)->getStr());
+    } else if (node->getKind() == CST_Kind::CodeString) {
+      addText(static_cast<const CodeStringCST *>(node)->getStr());
+    } else if (const IntegerValue *value = getIntegerValue(node)) {
+      if (value->isWide()) {
+        numWords += value->getAPInt().getNumWords();
+      }
+    }
+  }
+}
+
+CST *Writer::buildNode(const CST *node, llvm::ArrayRef<CST *> mappedChildren) {
+  SourceLocation loc = node->getLoc();
+  switch (node->getKind()) {
+  case CST_Kind::Identifier:
+    new (arena.Allocate(sizeof(IdentifierCST), alignof(IdentifierCST)))
+        IdentifierCST(loc, static_cast<const IdentifierCST *>(node)->getID());
+    break;
+  case CST_Kind::Int: {
+    IntegerValue value = getMappedValue(*getIntegerValue(node));
+    new (arena.Allocate(sizeof(IntCST), alignof(IntCST))) IntCST(loc, value);
+    break;
+  }
+  case CST_Kind::HostInt: {
+    IntegerValue value = getMappedValue(*getIntegerValue(node));
+    new (arena.Allocate(sizeof(HostIntCST), alignof(HostIntCST)))
+        HostIntCST(loc, value);
+    break;
+  }
+  case CST_Kind::String: {
+    auto str = static_cast<const StringCST *>(node);
+    new (arena.Allocate(sizeof(StringCST), alignof(StringCST)))
+        StringCST(loc, str->getID(), getText(addText(str->getStr())));
+    break;
+  }
+  case CST_Kind::CodeString: {
+    auto str = static_cast<const CodeStringCST *>(node)->getStr();
+    new (arena.Allocate(sizeof(CodeStringCST), alignof(CodeStringCST)))
+        CodeStringCST(loc, getText(addText(str)));
+    break;
+  }
+  case CST_Kind::Expression:
+    ExpressionCST::create(
+        arena, loc, static_cast<const ExpressionCST *>(node)->getMachineMode(),
+        mappedChildren);
+    break;
+  case CST_Kind::Vector:
+    VectorCST::create(arena, loc, mappedChildren);
+    break;
+  default:
+    // TODO: diag, nothing else is produced by the parser
+    return nullptr;
+  }
+  return getPointer<CST>(header.nodes.offset + arena.getLastOffset());
+}
+
+bool Writer::buildNodes(llvm::ArrayRef<ExpressionCST *> forms) {
+  arena.reserve(nodeBytesBound);
+  // a node and whether its children are being built
+  std::vector<std::pair<const CST *, bool>> stack;
+  // mapped addresses of the children built so far, in order
+  std::vector<CST *> values;
+  for (const CST *form : forms) {
+    stack.push_back({form, false});
+    while (!stack.empty()) {
+      auto &top = stack.back();
+      const CST *node = top.first;
+      llvm::ArrayRef<CST *> children = getChildren(node);
+      if (!top.second) {
+        if (mayShare) {
+          auto iter = built.find(node);
+          if (iter != built.end()) {
+            values.push_back(iter->second);
+            stack.pop_back();
+            continue;
+          }
+        }
+        if (!children.empty()) {
+          top.second = true;
+          for (const CST *child : llvm::reverse(children)) {
+            stack.push_back({child, false});
+          }
+          continue;
+        }
+      }
+      stack.pop_back();
+      auto mappedChildren =
+          llvm::makeArrayRef(values).take_back(children.size());
+      CST *mapped = buildNode(node, mappedChildren);
+      if (!mapped) {
+        return false;
+      }
+      values.resize(values.size() - children.size());
+      values.push_back(mapped);
+      if (mayShare) {
+        built[node] = mapped;
+      }
+    }
+    mappedForms.push_back(values.back());
+    values.pop_back();
+  }
+  return true;
+}
+
+bool Writer::write(llvm::StringRef path, llvm::ArrayRef<ExpressionCST *> forms,
+                   ParserContext &context, const llvm::SourceMgr &srcMgr,
+                   SourceLocationTable &locTable,
+                   const DefinitionIndex *index) {
+  for (unsigned id = 1; id <= srcMgr.getNumBuffers(); ++id) {
+    const llvm::MemoryBuffer *buffer = srcMgr.getMemoryBuffer(id);
+    files.push_back({addText(buffer->getBufferIdentifier()),
+                     llvm::xxHash64(buffer->getBuffer()),
+                     buffer->getBufferSize()});
+  }
+  locTable.forEachBuffer([&](SourceLocation start, uint32_t size,
+                             unsigned fileID,
+                             llvm::ArrayRef<uint32_t> newLineOffsets) {
+    locs.push_back({start.getRawEncoding(), size, fileID,
+                    static_cast<uint32_t>(newLineOffsets.size()),
+                    newLines.size()});
+    newLines.insert(newLines.end(), newLineOffsets.begin(),
+                    newLineOffsets.end());
+  });
+  IdentifierInterner &ii = context.getIdentifierInterner();
+  for (size_t i = 0; i < ii.getNumIdentifiers(); ++i) {
+    identifiers.push_back(addText(ii.getName(keyword::EndID + i)));
+  }
+  StringPool &sp = context.getStringPool();
+  for (size_t i = 0; i < sp.getNumStrings(); ++i) {
+    strings.push_back(addText(sp.getString(StringPool::InvalidID + 1 + i)));
+  }
+  scanNodes(forms);
+  // an index of only some of the forms would be wrong for a hit
+  if (index && index->getNumForms() == forms.size()) {
+    index->forEachPostings([&](DefinitionIndex::Table table, IDTy key,
+                               IDTy secondKey,
+                               llvm::ArrayRef<uint32_t> numbers) {
+      indexRecords.push_back({static_cast<uint32_t>(table),
+                              static_cast<uint32_t>(numbers.size()), key,
+                              secondKey, postings.size()});
+      postings.insert(postings.end(), numbers.begin(), numbers.end());
+    });
+  }
+
+  std::memset(&header, 0, sizeof(header));
+  std::memcpy(header.magic, Magic, sizeof(Magic));
+  header.version = Version;
+  header.layoutID = getLayoutID();
+  header.base = base;
+  uint64_t cursor = sizeof(Header);
+  layout(header.chars, chars.size(), 1, cursor);
+  layout(header.words, numWords, sizeof(uint64_t), cursor);
+  layout(header.files, files.size(), sizeof(FileRecord), cursor);
+  layout(header.locs, locs.size(), sizeof(LocRecord), cursor);
+  layout(header.newLines, newLines.size(), sizeof(uint32_t), cursor);
+  layout(header.identifiers, identifiers.size(), sizeof(TextRecord), cursor);
+  layout(header.strings, strings.size(), sizeof(TextRecord), cursor);
+  header.nodes.offset = llvm::alignTo(cursor, 8);
+  // build the nodes as they will be once mapped
+  if (!buildNodes(forms)) {
+    return false;
+  }
+  llvm::ArrayRef<char> nodeBytes = arena.getBytes();
+  header.nodes.size = nodeBytes.size();
+  cursor = header.nodes.offset + nodeBytes.size();
+  layout(header.forms, forms.size(), sizeof(ExpressionCST *), cursor);
+  if (!indexRecords.empty()) {
+    layout(header.index, indexRecords.size(), sizeof(CSTCache::IndexRecord),
+           cursor);
+    layout(header.postings, postings.size(), sizeof(uint32_t), cursor);
+  }
+  header.fileSize = cursor;
+  if (header.fileSize > (uint64_t(1) << 32)) {
+    return false;
+  }
+
+  // write to a temporary file first, readers never see half a cache
+  llvm::StringRef dir = llvm::sys::path::parent_path(path);
+  if (llvm::sys::fs::create_directories(dir)) {
+    return false;
+  }
+  int fd;
+  llvm::SmallString<128> tempPath;
+  if (llvm::sys::fs::createUniqueFile(path + ".tmp%%%%%%", fd, tempPath)) {
+    return false;
+  }
+  {
+    llvm::raw_fd_ostream os(fd, /*shouldClose=*/true);
+    auto writeSection = [&](const Section &section, const void *data,
+                            size_t elementSize) {
+      os.write_zeros(section.offset - os.tell());
+      os.write(static_cast<const char *>(data), section.size * elementSize);
+    };
+    os.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    writeSection(header.chars, chars.data(), 1);
+    writeSection(header.words, words.data(), sizeof(uint64_t));
+    writeSection(header.files, files.data(), sizeof(FileRecord));
+    writeSection(header.locs, locs.data(), sizeof(LocRecord));
+    writeSection(header.newLines, newLines.data(), sizeof(uint32_t));
+    writeSection(header.identifiers, identifiers.data(), sizeof(TextRecord));
+    writeSection(header.strings, strings.data(), sizeof(TextRecord));
+    writeSection(header.nodes, nodeBytes.data(), 1);
+    writeSection(header.forms, mappedForms.data(), sizeof(ExpressionCST *));
+    if (!indexRecords.empty()) {
+      writeSection(header.index, indexRecords.data(),
+                   sizeof(CSTCache::IndexRecord));
+      writeSection(header.postings, postings.data(), sizeof(uint32_t));
+    }
+    os.close();
+    if (os.has_error()) {
+      os.clear_error();
+      llvm::sys::fs::remove(tempPath);
+      return false;
+    }
+  }
+  if (llvm::sys::fs::rename(tempPath, path)) {
+    llvm::sys::fs::remove(tempPath);
+    return false;
+  }
+  return true;
+}
+
+} // namespace
+
+CSTCache::~CSTCache() {
+#ifdef LLVM_ON_UNIX
+  ::munmap(mapping, mappingSize);
+#endif
+}
+
+std::string CSTCache::getCachePath(const ParserContext &context,
+                                   const llvm::MemoryBuffer &mainBuffer) {
+  const ParserOption &option = context.getOption();
+  // everything that changes the nodes, the included files are checked when
+  // the cache is loaded
+  std::string key;
+  llvm::raw_string_ostream os(key);
+  os << Version << '\0' << mainBuffer.getBufferIdentifier() << '\0'
+     << llvm::xxHash64(mainBuffer.getBuffer()) << '\0'
+     << option.hashConsing << '\0';
+  for (const std::string &includePath : option.includePaths) {
+    os << includePath << '\0';
+  }
+  std::string fileName;
+  llvm::raw_string_ostream(fileName)
+      << llvm::format_hex_no_prefix(llvm::xxHash64(os.str()), 16)
+      << ".grpcst";
+  llvm::SmallString<128> path(option.cacheDir);
+  llvm::sys::path::append(path, fileName);
+  return std::string(path.str());
+}
+
+std::unique_ptr<CSTCache> CSTCache::load(llvm::StringRef path,
+                                         ParserContext &context,
+                                         llvm::SourceMgr &srcMgr,
+                                         SourceLocationTable &locTable) {
+#ifdef LLVM_ON_UNIX
+  int fd = ::open(path.str().c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return nullptr;
+  }
+  Header header;
+  struct stat status;
+  if (::pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+      std::memcmp(header.magic, Magic, sizeof(Magic)) ||
+      header.version != Version || header.layoutID != getLayoutID() ||
+      ::fstat(fd, &status) || uint64_t(status.st_size) != header.fileSize) {
+    ::close(fd);
+    return nullptr;
+  }
+  void *mapping =
+      ::mmap(reinterpret_cast<void *>(header.base), header.fileSize,
+             PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (mapping == MAP_FAILED) {
+    return nullptr;
+  }
+  std::unique_ptr<CSTCache> cache(new CSTCache(mapping, header.fileSize));
+  const char *start = static_cast<const char *>(mapping);
+  auto getText = [&](TextRecord text) {
+    return llvm::StringRef(start + header.chars.offset + text.offset,
+                           text.length);
+  };
+  auto files = getSection<FileRecord>(start, header.files);
+  auto locs = getSection<LocRecord>(start, header.locs);
+  auto newLines = getSection<uint32_t>(start, header.newLines);
+  auto identifiers = getSection<TextRecord>(start, header.identifiers);
+  auto strings = getSection<TextRecord>(start, header.strings);
+
+  // all the files the forms were parsed from must be unchanged
+  if (files.empty() || srcMgr.getNumBuffers() != 1) {
+    return nullptr;
+  }
+  const llvm::MemoryBuffer &mainBuffer = *srcMgr.getMemoryBuffer(1);
+  if (files[0].size != mainBuffer.getBufferSize() ||
+      files[0].hash != llvm::xxHash64(mainBuffer.getBuffer())) {
+    return nullptr;
+  }
+  std::vector<std::unique_ptr<llvm::MemoryBuffer>> buffers;
+  // files included more than once are only read and hashed once
+  llvm::StringMap<std::pair<const llvm::MemoryBuffer *, uint64_t>> seen;
+  for (const FileRecord &file : files.drop_front()) {
+    auto iter = seen.find(getText(file.name));
+    if (iter != seen.end()) {
+      if (iter->second.second != file.hash) {
+        return nullptr;
+      }
+      buffers.push_back(llvm::MemoryBuffer::getMemBuffer(
+          iter->second.first->getMemBufferRef(), false));
+      continue;
+    }
+    auto result = context.readFile(getText(file.name));
+    if (!result || (*result)->getBufferSize() != file.size ||
+        llvm::xxHash64((*result)->getBuffer()) != file.hash) {
+      return nullptr;
+    }
+    seen[getText(file.name)] = {result->get(), file.hash};
+    buffers.push_back(std::move(*result));
+  }
+
+  // IDs in the nodes only hold if the names come out in the same order, that
+  // is if they are new and distinct; a miss must leave the context alone
+  IdentifierInterner &ii = context.getIdentifierInterner();
+  StringPool &sp = context.getStringPool();
+  if (ii.getNumIdentifiers() || sp.getNumStrings()) {
+    return nullptr;
+  }
+  llvm::StringSet<> names;
+  for (const TextRecord &identifier : identifiers) {
+    if (ii.lookup(getText(identifier)) ||
+        !names.insert(getText(identifier)).second) {
+      return nullptr;
+    }
+  }
+  names.clear();
+  for (const TextRecord &str : strings) {
+    if (!names.insert(getText(str)).second) {
+      return nullptr;
+    }
+  }
+
+  if (reinterpret_cast<uint64_t>(mapping) != header.base) {
+    if (::mprotect(mapping, header.fileSize, PROT_READ | PROT_WRITE)) {
+      return nullptr;
+    }
+    relocateNodes(llvm::makeMutableArrayRef(
+                      reinterpret_cast<ExpressionCST **>(
+                          static_cast<char *>(mapping) + header.forms.offset),
+                      header.forms.size),
+                  reinterpret_cast<uint64_t>(mapping) - header.base,
+                  context.getOption().hashConsing);
+  }
+  // now they get the IDs of the nodes
+  for (const TextRecord &identifier : identifiers) {
+    ii.get(getText(identifier));
+  }
+  for (const TextRecord &str : strings) {
+    sp.get(getText(str));
+  }
+
+  for (auto &buffer : buffers) {
+    srcMgr.AddNewSourceBuffer(std::move(buffer), llvm::SMLoc());
+  }
+  for (const LocRecord &loc : locs) {
+    locTable.addIndexedBuffer(
+        SourceLocation::getFromRawEncoding(loc.start), loc.size, loc.fileID,
+        newLines.slice(loc.firstNewLine, loc.numNewLines));
+  }
+  cache->forms = getSection<ExpressionCST *>(start, header.forms);
+  if (header.index.offset) {
+    cache->indexRecords = getSection<IndexRecord>(start, header.index);
+    cache->postings = getSection<uint32_t>(start, header.postings);
+  }
+  return cache;
+#else
+  return nullptr;
+#endif
+}
+
+bool CSTCache::write(llvm::StringRef path,
+                     llvm::ArrayRef<ExpressionCST *> forms,
+                     ParserContext &context, const llvm::SourceMgr &srcMgr,
+                     SourceLocationTable &locTable,
+                     const DefinitionIndex *index) {
+#ifdef LLVM_ON_UNIX
+  return Writer(getPreferredBase(path), context.getOption().hashConsing)
+      .write(path, forms, context, srcMgr, locTable, index);
+#else
+  return false;
+#endif
+}
+
+bool CSTCache::loadIndex(DefinitionIndex &index) const {
+  if (indexRecords.empty()) {
+    return false;
+  }
+  index.restore(forms);
+  for (const IndexRecord &record : indexRecords) {
+    index.addPostings(static_cast<DefinitionIndex::Table>(record.table),
+                      record.key, record.secondKey,
+                      postings.slice(record.first, record.size));
+  }
+  return true;
+}
+
+} // namespace grp
@@ -0,0 +1,84 @@
+#pragma once
+
+#include "cst.h"
+#include "source_location.h"
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/SourceMgr.h"
+
+#include <cstddef>
+#include <memory>
+#include <string>
+
+namespace grp {
+
+class DefinitionIndex;
+class ParserContext;
+
+// The result of parsing a whole include tree, saved to a file which later runs
+// map instead of parsing again.
+//
+// The file holds the identifiers and strings in ID order, the source files
+// with a hash of their contents, the location table with its newline indices
+// and the CST nodes, laid out as they are in memory. Pointers between nodes
+// (and to strings and wide integers) are absolute, for an address picked when
+// the file is written: a hit maps the file there and hands out the nodes as
+// they are, nothing is lexed or copied. If that address is taken, the file is
+// mapped elsewhere and its pointers are fixed up first.
+//
+// Only a fresh ParserContext can use a cache, interning the names again must
+// give the IDs stored in the nodes; they are checked before any is interned.
+//
+// A DefinitionIndex of the forms may be saved with them, its arrays of form
+// numbers are used from the mapping as they are.
+class CSTCache {
+public:
+  // a saved array of a DefinitionIndex
+  struct IndexRecord;
+
+private:
+  void *mapping;
+  size_t mappingSize;
+  llvm::ArrayRef<ExpressionCST *> forms;
+  // empty if no index was saved
+  llvm::ArrayRef<IndexRecord> indexRecords;
+  llvm::ArrayRef<uint32_t> postings;
+
+  CSTCache(void *mapping, size_t mappingSize)
+      : mapping(mapping), mappingSize(mappingSize) {}
+
+public:
+  ~CSTCache();
+  CSTCache(const CSTCache &) = delete;
+  CSTCache &operator=(const CSTCache &) = delete;
+
+  // the file in ParserOption::cacheDir for parsing `mainBuffer` with the
+  // options of `context`
+  static std::string getCachePath(const ParserContext &context,
+                                  const llvm::MemoryBuffer &mainBuffer);
+  // map the cache at `path` if it's there and all the files it was parsed
+  // from are unchanged, nullptr otherwise. On a hit, the included files are
+  // added to `srcMgr`, which must only have the main file, and their
+  // locations to the empty `locTable`.
+  static std::unique_ptr<CSTCache> load(llvm::StringRef path,
+                                        ParserContext &context,
+                                        llvm::SourceMgr &srcMgr,
+                                        SourceLocationTable &locTable);
+  // save the top-level `forms`, parsed from the buffers of `srcMgr`, and
+  // `index` if it indexes all of them; return false if the cache couldn't be
+  // written
+  static bool write(llvm::StringRef path,
+                    llvm::ArrayRef<ExpressionCST *> forms,
+                    ParserContext &context, const llvm::SourceMgr &srcMgr,
+                    SourceLocationTable &locTable,
+                    const DefinitionIndex *index = nullptr);
+
+  llvm::ArrayRef<ExpressionCST *> getForms() const { return forms; }
+  // fill `index` with the forms and the saved index; false if none was
+  // saved, `index` is left alone then
+  bool loadIndex(DefinitionIndex &index) const;
+};
+
+} // namespace grp
@@ -0,0 +1,94 @@
+#include "cst_uniquer.h"
+
+#include "llvm/ADT/Hashing.h"
+
+#include <cassert>
+
+namespace grp {
+
+uint64_t CSTKey::getHash() const {
+  return llvm::hash_combine(
+      static_cast<unsigned>(kind), value, llvm::hash_value(str),
+      llvm::hash_combine_range(children.begin(), children.end()));
+}
+
+bool CSTKey::matches(const CST *node) const {
+  if (node->getKind() != kind) {
+    return false;
+  }
+  switch (kind) {
+  case CST_Kind::Identifier:
+    return static_cast<const IdentifierCST *>(node)->getID() == value;
+  case CST_Kind::Int: {
+    const IntegerValue &intValue =
+        static_cast<const IntCST *>(node)->getValue();
+    return !intValue.isWide() &&
+           static_cast<uint64_t>(intValue.getSExtValue()) == value;
+  }
+  case CST_Kind::String:
+    return static_cast<const StringCST *>(node)->getID() == value;
+  case CST_Kind::CodeString:
+    return static_cast<const CodeStringCST *>(node)->getStr() == str;
+  case CST_Kind::Expression: {
+    auto expr = static_cast<const ExpressionCST *>(node);
+    // children are canonical, comparing pointers is enough
+    return expr->getMachineMode() == value && expr->getSubforms() == children;
+  }
+  case CST_Kind::Vector:
+    return static_cast<const VectorCST *>(node)->getMembers() == children;
+  default:
+    return false;
+  }
+}
+
+CSTUniquer::CSTUniquer() : shards(new Shard[NumShards]) {}
+
+void CSTUniquer::grow(Shard &shard) {
+  std::vector<Slot> newSlots(shard.slots.empty() ? 256
+                                                 : shard.slots.size() * 2);
+  size_t mask = newSlots.size() - 1;
+  for (const Slot &slot : shard.slots) {
+    if (!slot.node) {
+      continue;
+    }
+    size_t i = slot.hash & mask;
+    while (newSlots[i].node) {
+      i = (i + 1) & mask;
+    }
+    newSlots[i] = slot;
+  }
+  shard.slots = std::move(newSlots);
+}
+
+CST *CSTUniquer::getOrCreate(const CSTKey &key,
+                             llvm::function_ref<CST *()> create) {
+  uint64_t hash = key.getHash();
+  Shard &shard = shards[hash >> (64 - LogNumShards)];
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  if ((shard.numNodes + 1) * 2 > shard.slots.size()) {
+    grow(shard);
+  }
+  size_t mask = shard.slots.size() - 1;
+  size_t i = hash & mask;
+  for (; shard.slots[i].node; i = (i + 1) & mask) {
+    if (shard.slots[i].hash == hash && key.matches(shard.slots[i].node)) {
+      return shard.slots[i].node;
+    }
+  }
+  CST *node = create();
+  assert(key.matches(node) && "created node doesn't match its key");
+  shard.slots[i] = {hash, node};
+  ++shard.numNodes;
+  return node;
+}
+
+size_t CSTUniquer::getNumNodes() const {
+  size_t result = 0;
+  for (unsigned i = 0; i < NumShards; ++i) {
+    std::lock_guard<std::mutex> lock(shards[i].mutex);
+    result += shards[i].numNodes;
+  }
+  return result;
+}
+
+} // namespace grp
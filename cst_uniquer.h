@@ -0,0 +1,68 @@
+#pragma once
+
+#include "cst.h"
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/StringRef.h"
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace grp {
+
+// What a CST node is made of, minus its location. Children are already
+// canonical, so two nodes are structurally equal iff their keys are.
+struct CSTKey {
+  CST_Kind kind;
+  // identifier or string ID, machine mode of an expression or inline
+  // integer value
+  uint64_t value = 0;
+  // characters of a code string
+  llvm::StringRef str;
+  // subforms of an expression, members of a vector
+  llvm::ArrayRef<CST *> children;
+
+  uint64_t getHash() const;
+  bool matches(const CST *node) const;
+};
+
+// Hash-consing table: maps each structurally distinct subtree to the one node
+// standing for all its copies, so that equality of canonical nodes is pointer
+// equality. A canonical node keeps the location of the first copy parsed.
+//
+// Shared by all the FormParsers of a CSTParser, which may run on several
+// threads at once; the table is split into shards by hash, each with a lock.
+class CSTUniquer {
+  struct Slot {
+    uint64_t hash;
+    CST *node;
+  };
+  // open addressing with linear probing, grown when half full
+  struct alignas(64) Shard {
+    std::mutex mutex;
+    std::vector<Slot> slots;
+    size_t numNodes = 0;
+  };
+
+  static constexpr unsigned LogNumShards = 5;
+  static constexpr unsigned NumShards = 1u << LogNumShards;
+  std::unique_ptr<Shard[]> shards;
+
+  static void grow(Shard &shard);
+
+public:
+  CSTUniquer();
+  CSTUniquer(const CSTUniquer &) = delete;
+  CSTUniquer &operator=(const CSTUniquer &) = delete;
+
+  // the canonical node for `key`, `create` is only called (under the lock)
+  // for the first copy; thread-safe
+  CST *getOrCreate(const CSTKey &key, llvm::function_ref<CST *()> create);
+  // number of distinct subtrees seen so far
+  size_t getNumNodes() const;
+};
+
+} // namespace grp
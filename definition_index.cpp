@@ -0,0 +1,156 @@
+#include "definition_index.h"
+
+#include "identifier_interner.h"
+#include "string_pool.h"
+
+#include <algorithm>
+
+namespace grp {
+
+void DefinitionIndex::append(Postings &postings, FormNumber number) {
+  if (postings.size && postings.data[postings.size - 1] == number) {
+    return;
+  }
+  if (postings.size >= postings.capacity) {
+    uint32_t capacity =
+        std::max<uint32_t>(4, 2 * std::max(postings.size, postings.capacity));
+    FormNumber *data = alloc.Allocate<FormNumber>(capacity);
+    std::copy_n(postings.data, postings.size, data);
+    postings.data = data;
+    postings.capacity = capacity;
+  }
+  postings.data[postings.size++] = number;
+}
+
+llvm::ArrayRef<DefinitionIndex::FormNumber>
+DefinitionIndex::lookup(const llvm::DenseMap<IDTy, Postings> &table,
+                        IDTy key) {
+  auto iter = table.find(key);
+  return iter == table.end() ? llvm::ArrayRef<FormNumber>()
+                             : iter->second.get();
+}
+
+void DefinitionIndex::add(ExpressionCST *form) {
+  FormNumber number = forms.size();
+  forms.push_back(form);
+  IDTy lead = form->getLeadID();
+  append(byLead[lead], number);
+  auto sub = form->getSubforms();
+  if (lead != IdentifierInterner::InvalidID && sub.size() > 1) {
+    // unnamed forms, e.g. define_insn "", aren't worth a lookup by name
+    if (sub[1]->getKind() == CST_Kind::String &&
+        !static_cast<StringCST *>(sub[1])->getStr().empty()) {
+      append(byName[{lead, static_cast<StringCST *>(sub[1])->getID()}],
+             number);
+    } else if (sub[1]->getKind() == CST_Kind::Identifier) {
+      append(byName[{lead, static_cast<IdentifierCST *>(sub[1])->getID() |
+                               IdentifierNameBit}],
+             number);
+    }
+  }
+  stack.assign(1, form);
+  while (!stack.empty()) {
+    const CST *node = stack.back();
+    stack.pop_back();
+    switch (node->getKind()) {
+    case CST_Kind::Expression: {
+      auto *expr = static_cast<const ExpressionCST *>(node);
+      if (expr->getMachineMode() != IdentifierInterner::InvalidID) {
+        append(byIdentifier[expr->getMachineMode()], number);
+      }
+      stack.insert(stack.end(), expr->getSubforms().begin(),
+                   expr->getSubforms().end());
+      break;
+    }
+    case CST_Kind::Vector: {
+      auto members = static_cast<const VectorCST *>(node)->getMembers();
+      stack.insert(stack.end(), members.begin(), members.end());
+      break;
+    }
+    case CST_Kind::Identifier:
+      append(byIdentifier[static_cast<const IdentifierCST *>(node)->getID()],
+             number);
+      break;
+    default:
+      break;
+    }
+  }
+}
+
+void DefinitionIndex::clear() {
+  forms.clear();
+  byLead.clear();
+  byName.clear();
+  byIdentifier.clear();
+  alloc.Reset();
+}
+
+llvm::ArrayRef<DefinitionIndex::FormNumber>
+DefinitionIndex::getFormsNamed(IDTy lead, llvm::StringRef name) const {
+  // a name may be a string or an identifier, the StringPool and the
+  // IdentifierInterner number them independently
+  IDTy stringID = sp.lookup(name);
+  if (stringID != StringPool::InvalidID) {
+    auto iter = byName.find({lead, stringID});
+    if (iter != byName.end()) {
+      return iter->second.get();
+    }
+  }
+  IDTy id = ii.lookup(name);
+  if (id != IdentifierInterner::InvalidID) {
+    auto iter = byName.find({lead, id | IdentifierNameBit});
+    if (iter != byName.end()) {
+      return iter->second.get();
+    }
+  }
+  return llvm::None;
+}
+
+void DefinitionIndex::intersect(llvm::ArrayRef<FormNumber> lhs,
+                                llvm::ArrayRef<FormNumber> rhs,
+                                llvm::SmallVectorImpl<FormNumber> &result) {
+  result.clear();
+  std::set_intersection(lhs.begin(), lhs.end(), rhs.begin(), rhs.end(),
+                        std::back_inserter(result));
+}
+
+void DefinitionIndex::forEachPostings(
+    llvm::function_ref<void(Table table, IDTy key, IDTy secondKey,
+                            llvm::ArrayRef<FormNumber> numbers)>
+        fn) const {
+  for (const auto &entry : byLead) {
+    fn(Table::Lead, entry.first, 0, entry.second.get());
+  }
+  for (const auto &entry : byName) {
+    fn(Table::Name, entry.first.first, entry.first.second,
+       entry.second.get());
+  }
+  for (const auto &entry : byIdentifier) {
+    fn(Table::Identifier, entry.first, 0, entry.second.get());
+  }
+}
+
+void DefinitionIndex::restore(llvm::ArrayRef<ExpressionCST *> forms) {
+  clear();
+  this->forms.assign(forms.begin(), forms.end());
+}
+
+void DefinitionIndex::addPostings(Table table, IDTy key, IDTy secondKey,
+                                  llvm::ArrayRef<FormNumber> numbers) {
+  // not ours to grow, see append()
+  Postings postings{const_cast<FormNumber *>(numbers.data()),
+                    static_cast<uint32_t>(numbers.size()), 0};
+  switch (table) {
+  case Table::Lead:
+    byLead[key] = postings;
+    break;
+  case Table::Name:
+    byName[{key, secondKey}] = postings;
+    break;
+  case Table::Identifier:
+    byIdentifier[key] = postings;
+    break;
+  }
+}
+
+} // namespace grp
@@ -0,0 +1,112 @@
+#pragma once
+
+#include "cst.h"
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Allocator.h"
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace grp {
+
+class IdentifierInterner;
+class StringPool;
+
+// Where the top-level forms of a parse are, by what they are and what they
+// use, so that tools don't rescan every form for each question:
+//   - by lead, e.g. every define_split
+//   - by lead and name, e.g. define_insn "*movsi_internal", or
+//     define_mode_iterator SWI
+//   - by identifier used anywhere in the form, modes included, e.g. every
+//     form mentioning V8HI
+//
+// Forms are numbered in the order they are added; each query gives the
+// numbers of the matching forms, ascending, as an array in the arena of the
+// index (or in a CSTCache) valid until the next add() or clear(). Two
+// queries are combined with intersect(), e.g. the define_splits mentioning
+// V8HI.
+class DefinitionIndex {
+public:
+  using FormNumber = uint32_t;
+  enum class Table : uint8_t { Lead, Name, Identifier };
+
+private:
+  // an array of the arena, grown by doubling into a new block, the old one
+  // is left behind; capacity 0 for an array of a CSTCache, copied on the
+  // first append
+  struct Postings {
+    FormNumber *data = nullptr;
+    uint32_t size = 0;
+    uint32_t capacity = 0;
+    llvm::ArrayRef<FormNumber> get() const {
+      return llvm::makeArrayRef(data, size);
+    }
+  };
+
+  IdentifierInterner &ii;
+  StringPool &sp;
+  llvm::BumpPtrAllocator alloc;
+  std::vector<ExpressionCST *> forms;
+  llvm::DenseMap<IDTy, Postings> byLead;
+  // (lead, name) -> forms; the name is a StringPool ID, or an identifier ID
+  // with IdentifierNameBit set
+  llvm::DenseMap<std::pair<IDTy, IDTy>, Postings> byName;
+  llvm::DenseMap<IDTy, Postings> byIdentifier;
+  // reused by add()
+  std::vector<const CST *> stack;
+
+  static constexpr IDTy IdentifierNameBit = IDTy(1) << 63;
+
+  // append `number` unless it is the last number already
+  void append(Postings &postings, FormNumber number);
+  static llvm::ArrayRef<FormNumber>
+  lookup(const llvm::DenseMap<IDTy, Postings> &table, IDTy key);
+
+public:
+  DefinitionIndex(IdentifierInterner &ii, StringPool &sp) : ii(ii), sp(sp) {}
+  DefinitionIndex(const DefinitionIndex &) = delete;
+  DefinitionIndex &operator=(const DefinitionIndex &) = delete;
+
+  // index `form` as the next form
+  void add(ExpressionCST *form);
+  void clear();
+  size_t getNumForms() const { return forms.size(); }
+  ExpressionCST *getForm(FormNumber number) const { return forms[number]; }
+
+  // the forms whose lead is `lead`, e.g. getKeywordID(RTLCode::DEFINE_SPLIT)
+  llvm::ArrayRef<FormNumber> getFormsWithLead(IDTy lead) const {
+    return lookup(byLead, lead);
+  }
+  // the forms whose lead is `lead` and whose name (the string or identifier
+  // right after the lead) is `name`
+  llvm::ArrayRef<FormNumber> getFormsNamed(IDTy lead,
+                                           llvm::StringRef name) const;
+  // the forms `id` appears in, as an identifier or a mode
+  llvm::ArrayRef<FormNumber> getFormsUsing(IDTy id) const {
+    return lookup(byIdentifier, id);
+  }
+  // the numbers in both `lhs` and `rhs`, ascending
+  static void intersect(llvm::ArrayRef<FormNumber> lhs,
+                        llvm::ArrayRef<FormNumber> rhs,
+                        llvm::SmallVectorImpl<FormNumber> &result);
+
+  // for CSTCache: call `fn` with every array of form numbers and its key,
+  // `secondKey` is the name for Table::Name, 0 otherwise
+  void forEachPostings(
+      llvm::function_ref<void(Table table, IDTy key, IDTy secondKey,
+                              llvm::ArrayRef<FormNumber> numbers)>
+          fn) const;
+  // start over with `forms`, already indexed by the arrays given to
+  // addPostings() next, which must outlive the index
+  void restore(llvm::ArrayRef<ExpressionCST *> forms);
+  void addPostings(Table table, IDTy key, IDTy secondKey,
+                   llvm::ArrayRef<FormNumber> numbers);
+};
+
+} // namespace grp
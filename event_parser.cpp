@@ -0,0 +1,169 @@
+#include "event_parser.h"
+
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Support/SMLoc.h"
+
+namespace grp {
+
+namespace {
+// skip the tokens up to the close of the vector (or expression) already
+// open, included
+void skipSubtree(Lexer &lexer) {
+  unsigned depth = 0;
+  for (;;) {
+    switch (lexer.lex().getKind()) {
+    case TokenKind::OpenParen:
+    case TokenKind::OpenBracket:
+      ++depth;
+      break;
+    case TokenKind::CloseParen:
+    case TokenKind::CloseBracket:
+      if (!depth) {
+        return;
+      }
+      --depth;
+      break;
+    case TokenKind::EndOfStream:
+      // TODO: diag
+      return;
+    default:
+      break;
+    }
+  }
+}
+} // namespace
+
+EventParser::EventParser(ParserContext &context)
+    : context(context), locTable(context.getLocationSpace()) {}
+
+bool EventParser::parse(FormHandler &handler) {
+  auto result = context.readFile(context.getOption().mainInputFile);
+  if (!result) {
+    // FIXME: diag
+    return true;
+  }
+  const llvm::MemoryBuffer &buffer = **result;
+  unsigned fileID =
+      srcMgr.AddNewSourceBuffer(std::move(*result), llvm::SMLoc());
+  return parseBuffer(buffer, fileID, handler);
+}
+
+bool EventParser::includeFile(Lexer &lexer, FormHandler &handler) {
+  Token path = lexer.lex();
+  if (path.getKind() != TokenKind::String) {
+    // TODO: diag
+    lexer.skipExpression();
+    return true;
+  }
+  std::string pathStr = StringPool::unescape(lexer.getString(path));
+  if (lexer.peek().getKind() == TokenKind::CloseParen) {
+    lexer.lex();
+  } else {
+    // TODO: diag
+    lexer.skipExpression();
+  }
+  auto result = context.openIncludeFile(pathStr);
+  if (!result) {
+    // TODO: diag
+    return true;
+  }
+  auto loc = llvm::SMLoc::getFromPointer(lexer.getCurPos());
+  unsigned fileID = srcMgr.AddNewSourceBuffer(std::move(*result), loc);
+  return parseBuffer(*srcMgr.getMemoryBuffer(fileID), fileID, handler);
+}
+
+bool EventParser::parseBuffer(const llvm::MemoryBuffer &buffer,
+                              unsigned fileID, FormHandler &handler) {
+  Lexer lexer(buffer, context.getIdentifierInterner(),
+              locTable.addBuffer(buffer, fileID));
+  // the expressions and vectors open, true for a vector
+  llvm::SmallVector<bool, 32> open;
+  for (;;) {
+    Token tok = lexer.lex();
+    SourceLocation loc = lexer.getSourceLocation(tok);
+    EventAction action;
+    switch (tok.getKind()) {
+    case TokenKind::OpenParen: {
+      IDTy leadID = IdentifierInterner::InvalidID;
+      IDTy machineMode = IdentifierInterner::InvalidID;
+      if (lexer.peek().isIdentifier()) {
+        leadID = lexer.lex().getID();
+        if (lexer.peek().getKind() == TokenKind::Colon) {
+          lexer.lex();
+          Token mode = lexer.lex();
+          // TODO: diag if it isn't an identifier
+          if (mode.isIdentifier()) {
+            machineMode = mode.getID();
+          }
+        }
+        if (open.empty() && leadID == getKeywordID(RTLCode::INCLUDE)) {
+          if (!includeFile(lexer, handler)) {
+            return false;
+          }
+          continue;
+        }
+      }
+      open.push_back(false);
+      action = handler.beginExpression(loc, leadID, machineMode);
+      break;
+    }
+    case TokenKind::OpenBracket:
+      open.push_back(true);
+      action = handler.beginVector(loc);
+      break;
+    case TokenKind::CloseParen:
+    case TokenKind::CloseBracket:
+      if (open.empty()) {
+        // TODO: diag, nothing to close
+        continue;
+      }
+      open.pop_back();
+      handler.end();
+      continue;
+    case TokenKind::Identifier:
+      action = handler.identifier(loc, tok.getID());
+      break;
+    case TokenKind::String:
+      action = handler.string(loc, lexer.getString(tok));
+      break;
+    case TokenKind::CodeString:
+      action = handler.codeString(loc, lexer.getString(tok));
+      break;
+    case TokenKind::Number: {
+      int64_t value;
+      if (lexer.getSmallNumber(tok, value)) {
+        action = handler.integer(loc, value);
+      } else {
+        action = handler.wideInteger(loc, lexer.getNumber(tok));
+      }
+      break;
+    }
+    case TokenKind::EndOfStream:
+      if (!open.empty()) {
+        // TODO: diag, close everything that is still open
+      }
+      for (; !open.empty(); open.pop_back()) {
+        handler.end();
+      }
+      return true;
+    default:
+      // TODO: diag
+      continue;
+    }
+    if (action == EventAction::Stop) {
+      return false;
+    }
+    if (action == EventAction::SkipSubtree && !open.empty()) {
+      // expressions are skipped on the characters, without lexing
+      if (open.back()) {
+        skipSubtree(lexer);
+      } else {
+        lexer.skipExpression();
+      }
+      open.pop_back();
+      handler.end();
+    }
+  }
+}
+
+} // namespace grp
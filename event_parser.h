@@ -0,0 +1,85 @@
+#pragma once
+
+#include "keywords.h"
+#include "lexer.h"
+#include "parser.h"
+#include "source_location.h"
+
+#include "llvm/ADT/APInt.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/SourceMgr.h"
+
+namespace grp {
+
+// what the parser does after an event
+enum class EventAction {
+  Continue,
+  // after a begin event: skip the contents of that expression/vector, after
+  // a leaf: skip the rest of the enclosing one; end() is still called
+  SkipSubtree,
+  // no more events, EventParser::parse() returns
+  Stop,
+};
+
+// Callbacks of an EventParser, for the forms of a whole include tree in
+// source order. Every begin event is matched by an end(). An expression
+// starting with an identifier reports it (and the machine mode after it) in
+// beginExpression() rather than as an identifier event; includes are followed
+// and not reported.
+class FormHandler {
+public:
+  virtual ~FormHandler() = default;
+  // `leadID` and `machineMode` are IdentifierInterner::InvalidID if absent
+  virtual EventAction beginExpression(SourceLocation loc, IDTy leadID,
+                                      IDTy machineMode) {
+    return EventAction::Continue;
+  }
+  virtual EventAction beginVector(SourceLocation loc) {
+    return EventAction::Continue;
+  }
+  virtual void end() {}
+  virtual EventAction identifier(SourceLocation loc, IDTy id) {
+    return EventAction::Continue;
+  }
+  // between the quotes, escapes not processed, see StringPool::unescape
+  virtual EventAction string(SourceLocation loc, llvm::StringRef literal) {
+    return EventAction::Continue;
+  }
+  // between the braces
+  virtual EventAction codeString(SourceLocation loc, llvm::StringRef code) {
+    return EventAction::Continue;
+  }
+  virtual EventAction integer(SourceLocation loc, int64_t value) {
+    return EventAction::Continue;
+  }
+  // an integer that doesn't fit in int64_t
+  virtual EventAction wideInteger(SourceLocation loc,
+                                  const llvm::APInt &value) {
+    return EventAction::Continue;
+  }
+};
+
+// Parses the main file of a ParserContext and what it includes into events
+// for a FormHandler, straight off the Lexer: no CST node is allocated, for
+// tools that only scan the forms. Parses sequentially.
+class EventParser {
+  ParserContext &context;
+  llvm::SourceMgr srcMgr;
+  SourceLocationTable locTable;
+  // events for the forms of one buffer, false once stopped
+  bool parseBuffer(const llvm::MemoryBuffer &buffer, unsigned fileID,
+                   FormHandler &handler);
+  // the rest of `(include "path")` after its lead, false once stopped
+  bool includeFile(Lexer &lexer, FormHandler &handler);
+
+public:
+  explicit EventParser(ParserContext &context);
+  // report every form, return false if the handler stopped
+  bool parse(FormHandler &handler);
+  // decode a location of an event
+  LineColumn getLineColumn(SourceLocation loc) const {
+    return locTable.getLineColumn(loc);
+  }
+};
+
+} // namespace grp
@@ -0,0 +1,197 @@
+#include "identifier_interner.h"
+
+#include "llvm/Support/xxhash.h"
+
+#include <cassert>
+#include <cstring>
+
+namespace grp {
+namespace {
+
+// direct mapped by hash, remembers the last identifiers a thread interned;
+// shared by all interners, each slot says which one it belongs to
+struct ThreadCache {
+  static constexpr unsigned Size = 256;
+  struct Slot {
+    // serial of the interner the entry belongs to, 0 for none
+    uint64_t serial = 0;
+    const void *entry = nullptr;
+  };
+  Slot slots[Size];
+};
+
+thread_local ThreadCache threadCache;
+
+std::atomic<uint64_t> nextSerial{1};
+
+} // namespace
+
+IdentifierInterner::Table::Table(size_t size)
+    : mask(size - 1), slots(new std::atomic<const Entry *>[size]) {
+  assert((size & mask) == 0 && "table size must be a power of 2");
+  for (size_t i = 0; i < size; ++i) {
+    slots[i].store(nullptr, std::memory_order_relaxed);
+  }
+}
+
+IdentifierInterner::IdentifierInterner(bool withKeywords)
+    : shards(new Shard[NumShards]),
+      segments(new std::atomic<std::atomic<const Entry *> *>[MaxSegments]),
+      withKeywords(withKeywords),
+      firstID(withKeywords ? IDTy(keyword::EndID) : InvalidID + 1),
+      nextID(firstID),
+      serial(nextSerial.fetch_add(1, std::memory_order_relaxed)) {
+  for (size_t i = 0; i < MaxSegments; ++i) {
+    segments[i].store(nullptr, std::memory_order_relaxed);
+  }
+}
+
+IdentifierInterner::~IdentifierInterner() {
+  for (size_t i = 0; i < MaxSegments; ++i) {
+    delete[] segments[i].load(std::memory_order_relaxed);
+  }
+}
+
+const IdentifierInterner::Entry *
+IdentifierInterner::probe(const Table *table, uint64_t hash,
+                          llvm::StringRef str) {
+  if (!table) {
+    return nullptr;
+  }
+  // the top bits of the hash picked the shard, use the low ones here
+  for (size_t i = hash & table->mask;; i = (i + 1) & table->mask) {
+    const Entry *entry = table->slots[i].load(std::memory_order_acquire);
+    if (!entry) {
+      return nullptr;
+    }
+    if (entry->hash == hash && entry->getName() == str) {
+      return entry;
+    }
+  }
+}
+
+const IdentifierInterner::Entry *
+IdentifierInterner::insert(Shard &shard, uint64_t hash, llvm::StringRef str) {
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  Table *table = shard.table.load(std::memory_order_relaxed);
+  // somebody else may have won the race for the lock
+  if (const Entry *entry = probe(table, hash, str)) {
+    return entry;
+  }
+  if (!table || (shard.numEntries + 1) * 2 > table->mask + 1) {
+    auto newTable =
+        std::make_unique<Table>(table ? (table->mask + 1) * 2 : 64);
+    if (table) {
+      for (size_t i = 0; i <= table->mask; ++i) {
+        const Entry *entry = table->slots[i].load(std::memory_order_relaxed);
+        if (!entry) {
+          continue;
+        }
+        size_t j = entry->hash & newTable->mask;
+        while (newTable->slots[j].load(std::memory_order_relaxed)) {
+          j = (j + 1) & newTable->mask;
+        }
+        newTable->slots[j].store(entry, std::memory_order_relaxed);
+      }
+    }
+    table = newTable.get();
+    shard.tables.push_back(std::move(newTable));
+    shard.table.store(table, std::memory_order_release);
+  }
+
+  void *mem = shard.alloc.Allocate(sizeof(Entry) + str.size() + 1,
+                                   alignof(Entry));
+  Entry *entry = new (mem) Entry{hash, 0, static_cast<uint32_t>(str.size())};
+  char *data = const_cast<char *>(entry->getData());
+  std::memcpy(data, str.data(), str.size());
+  data[str.size()] = '\0';
+  entry->id = nextID.fetch_add(1, std::memory_order_relaxed);
+  // before publishing the entry, whoever sees the ID may ask for its name
+  setEntryForID(entry);
+
+  size_t i = hash & table->mask;
+  while (table->slots[i].load(std::memory_order_relaxed)) {
+    i = (i + 1) & table->mask;
+  }
+  table->slots[i].store(entry, std::memory_order_release);
+  ++shard.numEntries;
+  return entry;
+}
+
+void IdentifierInterner::setEntryForID(const Entry *entry) {
+  size_t index = entry->id - firstID;
+  size_t segmentIndex = index >> LogSegmentSize;
+  assert(segmentIndex < MaxSegments && "too many identifiers");
+  auto *segment = segments[segmentIndex].load(std::memory_order_acquire);
+  if (!segment) {
+    auto *newSegment = new std::atomic<const Entry *>[SegmentSize];
+    for (size_t i = 0; i < SegmentSize; ++i) {
+      newSegment[i].store(nullptr, std::memory_order_relaxed);
+    }
+    if (segments[segmentIndex].compare_exchange_strong(
+            segment, newSegment, std::memory_order_acq_rel)) {
+      segment = newSegment;
+    } else {
+      delete[] newSegment;
+    }
+  }
+  segment[index & (SegmentSize - 1)].store(entry, std::memory_order_release);
+}
+
+IdentifierInterner::IDTy IdentifierInterner::get(llvm::StringRef str) {
+  if (withKeywords) {
+    if (IDTy keywordID = lookupKeyword(str)) {
+      return keywordID;
+    }
+  }
+  uint64_t hash = llvm::xxHash64(str);
+  // spread the interners over the cache
+  ThreadCache::Slot &cached =
+      threadCache.slots[(hash + serial) & (ThreadCache::Size - 1)];
+  if (cached.serial == serial) {
+    auto *entry = static_cast<const Entry *>(cached.entry);
+    if (entry->hash == hash && entry->getName() == str) {
+      return entry->id;
+    }
+  }
+  Shard &shard = shards[hash >> (64 - LogNumShards)];
+  const Entry *entry =
+      probe(shard.table.load(std::memory_order_acquire), hash, str);
+  if (!entry) {
+    entry = insert(shard, hash, str);
+  }
+  cached.serial = serial;
+  cached.entry = entry;
+  return entry->id;
+}
+
+IdentifierInterner::IDTy
+IdentifierInterner::lookup(llvm::StringRef str) const {
+  if (withKeywords) {
+    if (IDTy keywordID = lookupKeyword(str)) {
+      return keywordID;
+    }
+  }
+  uint64_t hash = llvm::xxHash64(str);
+  const Shard &shard = shards[hash >> (64 - LogNumShards)];
+  const Entry *entry =
+      probe(shard.table.load(std::memory_order_acquire), hash, str);
+  return entry ? entry->id : InvalidID;
+}
+
+llvm::StringRef IdentifierInterner::getName(IDTy id) const {
+  if (withKeywords && isKeywordID(id)) {
+    return getKeywordName(id);
+  }
+  assert(id >= firstID && "invalid identifier ID");
+  size_t index = id - firstID;
+  auto *segment =
+      segments[index >> LogSegmentSize].load(std::memory_order_acquire);
+  assert(segment && "identifier ID from another interner?");
+  const Entry *entry =
+      segment[index & (SegmentSize - 1)].load(std::memory_order_acquire);
+  assert(entry && "identifier ID from another interner?");
+  return entry->getName();
+}
+
+} // namespace grp
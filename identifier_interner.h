@@ -0,0 +1,104 @@
+#pragma once
+
+#include "keywords.h"
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Allocator.h"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace grp {
+
+// Maps identifiers to IDs, shared by all the lexers of a ParserContext, which
+// may run on several threads at once.
+//
+// Keywords have fixed IDs, see keywords.h, the remaining identifiers are
+// numbered in first-seen order after them. Without keywords, e.g. for the
+// StringPool, numbering starts at 1. An ID never changes once handed
+// out, so IDs can be compared across threads. Identifiers are copied into the
+// interner, names returned by getName() outlive the source buffers.
+//
+// The map is split into shards by the top bits of the hash. Looking up an
+// identifier already interned takes no lock: shard tables are only ever
+// published with a release store and never freed before the interner, inserts
+// and growing a table take the shard's mutex. A small per-thread cache sits in
+// front of the shards.
+class IdentifierInterner {
+public:
+  using IDTy = grp::IDTy;
+  enum : uint64_t { InvalidID = 0 };
+
+private:
+  struct Entry {
+    uint64_t hash;
+    IDTy id;
+    uint32_t length;
+    // followed by the characters and a '\0'
+    const char *getData() const {
+      return reinterpret_cast<const char *>(this + 1);
+    }
+    llvm::StringRef getName() const {
+      return llvm::StringRef(getData(), length);
+    }
+  };
+
+  // open addressing with linear probing, grown when half full
+  struct Table {
+    size_t mask;
+    std::unique_ptr<std::atomic<const Entry *>[]> slots;
+    explicit Table(size_t size);
+  };
+
+  struct alignas(64) Shard {
+    std::mutex mutex;
+    std::atomic<Table *> table{nullptr};
+    size_t numEntries = 0;
+    // all tables this shard ever had, readers may still be probing old ones
+    std::vector<std::unique_ptr<Table>> tables;
+    llvm::BumpPtrAllocator alloc;
+  };
+
+  static constexpr unsigned LogNumShards = 6;
+  static constexpr unsigned NumShards = 1u << LogNumShards;
+  // ID -> entry, in fixed size segments allocated on demand
+  static constexpr unsigned LogSegmentSize = 14;
+  static constexpr size_t SegmentSize = size_t(1) << LogSegmentSize;
+  static constexpr size_t MaxSegments = size_t(1) << 12;
+
+  std::unique_ptr<Shard[]> shards;
+  std::unique_ptr<std::atomic<std::atomic<const Entry *> *>[]> segments;
+  const bool withKeywords;
+  // ID of the first identifier that isn't a keyword
+  const IDTy firstID;
+  std::atomic<IDTy> nextID;
+  // identifies this interner to the per-thread caches
+  const uint64_t serial;
+
+  static const Entry *probe(const Table *table, uint64_t hash,
+                            llvm::StringRef str);
+  const Entry *insert(Shard &shard, uint64_t hash, llvm::StringRef str);
+  void setEntryForID(const Entry *entry);
+
+public:
+  explicit IdentifierInterner(bool withKeywords = true);
+  ~IdentifierInterner();
+  IdentifierInterner(const IdentifierInterner &) = delete;
+  IdentifierInterner &operator=(const IdentifierInterner &) = delete;
+
+  // intern `str`, thread-safe
+  IDTy get(llvm::StringRef str);
+  // the ID of `str` if it has been interned, InvalidID otherwise
+  IDTy lookup(llvm::StringRef str) const;
+  // the identifier `id` stands for, `id` must come from this interner
+  llvm::StringRef getName(IDTy id) const;
+  // number of plain identifiers interned so far, not counting keywords
+  size_t getNumIdentifiers() const {
+    return nextID.load(std::memory_order_relaxed) - firstID;
+  }
+};
+
+} // namespace grp
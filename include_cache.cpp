@@ -0,0 +1,71 @@
+#include "include_cache.h"
+#include "parser.h"
+
+#include "llvm/Support/xxhash.h"
+
+namespace grp {
+
+const IncludeCache::Entry *
+IncludeCache::get(llvm::StringRef path,
+                  llvm::function_ref<void(Entry &)> parse) {
+  std::string fullPath = context.resolveIncludePath(path);
+  if (fullPath.empty()) {
+    return nullptr;
+  }
+  auto status = context.getFS().status(fullPath);
+  if (!status) {
+    return nullptr;
+  }
+  Entry *old;
+  std::unique_ptr<Entry> entry;
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    entryDone.wait(lock, [&] {
+      old = entries.lookup(fullPath);
+      return !old || old->ready;
+    });
+    if (old &&
+        old->modificationTime == status->getLastModificationTime() &&
+        old->size == status->getSize()) {
+      return old;
+    }
+    // in flight until it is parsed, or dropped
+    entry = std::make_unique<Entry>();
+    entries[fullPath] = entry.get();
+  }
+  auto buffer = context.readFile(fullPath);
+  uint64_t hash = buffer ? llvm::xxHash64((*buffer)->getBuffer()) : 0;
+  if (!buffer || (old && old->hash == hash)) {
+    // unreadable, or touched only: `old` stays
+    std::lock_guard<std::mutex> lock(mutex);
+    if (old) {
+      entries[fullPath] = old;
+    } else {
+      entries.erase(fullPath);
+    }
+    entryDone.notify_all();
+    if (!buffer) {
+      return nullptr;
+    }
+    old->modificationTime = status->getLastModificationTime();
+    return old;
+  }
+  entry->path = fullPath;
+  entry->modificationTime = status->getLastModificationTime();
+  entry->size = (*buffer)->getBufferSize();
+  entry->hash = hash;
+  entry->buffer = std::move(*buffer);
+  parse(*entry);
+  std::lock_guard<std::mutex> lock(mutex);
+  entry->ready = true;
+  entryDone.notify_all();
+  allEntries.push_back(std::move(entry));
+  return allEntries.back().get();
+}
+
+size_t IncludeCache::getNumEntries() {
+  std::lock_guard<std::mutex> lock(mutex);
+  return entries.size();
+}
+
+} // namespace grp
@@ -0,0 +1,74 @@
+#pragma once
+
+#include "cst.h"
+#include "source_location.h"
+
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Chrono.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace grp {
+
+class ParserContext;
+
+// The files included by the CSTParsers of a ParserContext, with their
+// top-level forms, so that including a file again (from the same or another
+// parser, on any thread) costs a stat and a lookup while it is unchanged.
+//
+// Entries are keyed by the path the file was found at, and stay valid while
+// its modification time and size are the same, or else its contents hash
+// the same. The locations of the forms are in the location space of the
+// context, every parser using an entry adds its buffer at the same place.
+class IncludeCache {
+public:
+  struct Entry {
+    // where the file was found
+    std::string path;
+    llvm::sys::TimePoint<> modificationTime;
+    uint64_t size = 0;
+    // xxHash64 of the contents
+    uint64_t hash = 0;
+    std::unique_ptr<llvm::MemoryBuffer> buffer;
+    SourceLocation start;
+    // the top-level forms, an include is an item without form, with the path
+    // as written
+    struct Item {
+      ExpressionCST *form = nullptr;
+      std::string includePath;
+    };
+    std::vector<Item> items;
+    // false while a thread reads and parses the file, guarded by the mutex
+    bool ready = false;
+  };
+
+private:
+  ParserContext &context;
+  std::mutex mutex;
+  // signalled when an entry gets ready or is dropped
+  std::condition_variable entryDone;
+  // the current entry of each path, possibly being parsed: the other threads
+  // including the file wait for it rather than parse it again
+  llvm::StringMap<Entry *> entries;
+  // outdated entries too, their forms may still be in use
+  std::vector<std::unique_ptr<Entry>> allEntries;
+
+public:
+  explicit IncludeCache(ParserContext &context) : context(context) {}
+  // the entry for the file included as `path`, null if it can't be read. On
+  // a miss, `parse` fills in Entry::start and Entry::items of the new entry;
+  // it is called without the lock held, and must not get() entries itself.
+  // Threads asking for the file meanwhile wait for the new entry.
+  const Entry *get(llvm::StringRef path,
+                   llvm::function_ref<void(Entry &)> parse);
+  size_t getNumEntries();
+};
+
+} // namespace grp
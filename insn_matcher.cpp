@@ -0,0 +1,618 @@
+#include "insn_matcher.h"
+
+#include <algorithm>
+
+namespace grp {
+
+namespace {
+llvm::ArrayRef<CST *> getChildren(const CST *node) {
+  switch (node->getKind()) {
+  case CST_Kind::Expression:
+    return static_cast<const ExpressionCST *>(node)->getSubforms();
+  case CST_Kind::Vector:
+    return static_cast<const VectorCST *>(node)->getMembers();
+  default:
+    return llvm::ArrayRef<CST *>();
+  }
+}
+
+// the operand number of a match_* expression
+bool getOperandNumber(const ExpressionCST *expr, unsigned &number) {
+  auto sub = expr->getSubforms();
+  if (sub.size() < 2 || sub[1]->getKind() != CST_Kind::Int) {
+    // TODO: diag
+    return false;
+  }
+  const IntegerValue &value = static_cast<IntCST *>(sub[1])->getValue();
+  // GCC has no more than MAX_RECOG_OPERANDS (30)
+  if (value.isWide() || value.getSExtValue() < 0 ||
+      value.getSExtValue() >= 1024) {
+    // TODO: diag
+    return false;
+  }
+  number = value.getSExtValue();
+  return true;
+}
+
+// the predicate of a match_operand, match_scratch, match_operator or
+// match_parallel, empty if it accepts anything
+llvm::StringRef getPredicate(const ExpressionCST *expr) {
+  if (expr->getLeadID() == getKeywordID(RTLCode::MATCH_SCRATCH)) {
+    return "scratch_operand";
+  }
+  auto sub = expr->getSubforms();
+  if (sub.size() < 3 || sub[2]->getKind() != CST_Kind::String) {
+    return llvm::StringRef();
+  }
+  return static_cast<StringCST *>(sub[2])->getStr();
+}
+
+// the operand patterns of a match_operator or match_parallel, the last
+// subform
+const VectorCST *getOperandPatterns(const ExpressionCST *expr) {
+  auto sub = expr->getSubforms();
+  if (sub.empty() || sub.back()->getKind() != CST_Kind::Vector) {
+    return nullptr;
+  }
+  return static_cast<const VectorCST *>(sub.back());
+}
+
+void bind(InsnMatcher::Operands &operands, unsigned number,
+          const CST *operand) {
+  if (number >= operands.size()) {
+    operands.resize(number + 1);
+  }
+  operands[number] = operand;
+}
+
+bool isParallel(const CST *rtl, llvm::ArrayRef<CST *> &members) {
+  if (rtl->getKind() != CST_Kind::Expression) {
+    return false;
+  }
+  auto *expr = static_cast<const ExpressionCST *>(rtl);
+  auto sub = expr->getSubforms();
+  if (expr->getLeadID() != getKeywordID(RTLCode::PARALLEL) ||
+      sub.size() != 2 || sub[1]->getKind() != CST_Kind::Vector) {
+    return false;
+  }
+  members = static_cast<const VectorCST *>(sub[1])->getMembers();
+  return true;
+}
+} // namespace
+
+InsnMatcher::InsnMatcher() {
+  positions.push_back({UINT32_MAX, 0});
+  root = new (nodeAlloc.Allocate()) Node();
+  parallelLead = new (alloc.Allocate<IdentifierCST>())
+      IdentifierCST(SourceLocation(), getKeywordID(RTLCode::PARALLEL));
+}
+
+InsnMatcher::Node *InsnMatcher::Switch::findCase(uint64_t value) const {
+  auto iter = std::lower_bound(
+      cases.begin(), cases.end(), value,
+      [](const auto &entry, uint64_t value) { return entry.first < value; });
+  if (iter == cases.end() || iter->first != value) {
+    return nullptr;
+  }
+  return iter->second;
+}
+
+unsigned InsnMatcher::getChildPosition(unsigned parent, unsigned index) {
+  auto inserted = childPositions.try_emplace({parent, index}, 0);
+  if (inserted.second) {
+    inserted.first->second = positions.size();
+    positions.push_back({parent, index});
+  }
+  return inserted.first->second;
+}
+
+const CST *InsnMatcher::getAt(const CST *rtl, unsigned pos) const {
+  if (!pos) {
+    return rtl;
+  }
+  const Position &position = positions[pos];
+  const CST *parent = getAt(rtl, position.parent);
+  if (!parent) {
+    return nullptr;
+  }
+  auto children = getChildren(parent);
+  return position.index < children.size() ? children[position.index]
+                                          : nullptr;
+}
+
+bool InsnMatcher::evaluate(TestKind kind, const CST *node, uint64_t &value) {
+  switch (kind) {
+  case TestKind::Code: {
+    IDTy id = 0;
+    if (node->getKind() == CST_Kind::Expression) {
+      id = static_cast<const ExpressionCST *>(node)->getLeadID();
+    } else if (node->getKind() == CST_Kind::Identifier) {
+      id = static_cast<const IdentifierCST *>(node)->getID();
+    }
+    value = static_cast<uint64_t>(node->getKind()) << 56 | id;
+    return true;
+  }
+  case TestKind::Kind:
+    value = static_cast<uint64_t>(node->getKind());
+    return true;
+  case TestKind::Mode:
+    if (node->getKind() != CST_Kind::Expression) {
+      return false;
+    }
+    value = static_cast<const ExpressionCST *>(node)->getMachineMode();
+    return true;
+  case TestKind::Arity:
+    value = getChildren(node).size();
+    return true;
+  case TestKind::Int: {
+    if (node->getKind() != CST_Kind::Int) {
+      return false;
+    }
+    const IntegerValue &intValue =
+        static_cast<const IntCST *>(node)->getValue();
+    if (intValue.isWide()) {
+      return false;
+    }
+    value = static_cast<uint64_t>(intValue.getSExtValue());
+    return true;
+  }
+  case TestKind::String:
+    if (node->getKind() != CST_Kind::String) {
+      return false;
+    }
+    value = static_cast<const StringCST *>(node)->getID();
+    return true;
+  }
+  return false;
+}
+
+void InsnMatcher::compile(const CST *pattern, unsigned pos,
+                          std::vector<Test> &tests, CompiledInsn &insn) {
+  auto addCheck = [&](CheckKind kind, unsigned operand) {
+    insn.checks.push_back({kind, pos, operand, pattern});
+    if (kind != CheckKind::Subtree) {
+      insn.numOperands = std::max(insn.numOperands, operand + 1);
+    }
+  };
+  auto code = [&](IDTy id) {
+    tests.push_back({pos, TestKind::Code,
+                     static_cast<uint64_t>(pattern->getKind()) << 56 | id});
+  };
+  switch (pattern->getKind()) {
+  case CST_Kind::Expression: {
+    auto *expr = static_cast<const ExpressionCST *>(pattern);
+    IDTy lead = expr->getLeadID();
+    auto sub = expr->getSubforms();
+    unsigned number;
+    if (isRTLCodeID(lead)) {
+      switch (getRTLCode(lead)) {
+      case RTLCode::MATCH_OPERAND:
+      case RTLCode::MATCH_SCRATCH:
+        if (!getOperandNumber(expr, number)) {
+          break;
+        }
+        addCheck(CheckKind::Bind, number);
+        if (!getPredicate(expr).empty()) {
+          addCheck(CheckKind::Predicate, number);
+        }
+        return;
+      case RTLCode::MATCH_DUP:
+        if (!getOperandNumber(expr, number)) {
+          break;
+        }
+        addCheck(CheckKind::Dup, number);
+        return;
+      case RTLCode::MATCH_OPERATOR: {
+        // any code, with operands matching the patterns of the vector
+        const VectorCST *operandPatterns = getOperandPatterns(expr);
+        if (!getOperandNumber(expr, number) || !operandPatterns) {
+          break;
+        }
+        auto members = operandPatterns->getMembers();
+        tests.push_back({pos, TestKind::Kind,
+                         static_cast<uint64_t>(CST_Kind::Expression)});
+        tests.push_back({pos, TestKind::Arity, members.size() + 1});
+        addCheck(CheckKind::Bind, number);
+        if (!getPredicate(expr).empty()) {
+          addCheck(CheckKind::Predicate, number);
+        }
+        for (unsigned i = 0; i < members.size(); ++i) {
+          compile(members[i], getChildPosition(pos, i + 1), tests, insn);
+        }
+        return;
+      }
+      default:
+        break;
+      }
+      if (getRTXClass(getRTLCode(lead)) == RTXClass::RTX_MATCH) {
+        // match_parallel, match_op_dup, malformed match_*: rare, left to
+        // matchPattern
+        addCheck(CheckKind::Subtree, 0);
+        return;
+      }
+    }
+    if (lead == IdentifierInterner::InvalidID) {
+      addCheck(CheckKind::Subtree, 0);
+      return;
+    }
+    // an RTL code, or an iterator like `any_plus` that only matches itself
+    code(lead);
+    tests.push_back({pos, TestKind::Mode, expr->getMachineMode()});
+    tests.push_back({pos, TestKind::Arity, sub.size()});
+    for (unsigned i = 1; i < sub.size(); ++i) {
+      compile(sub[i], getChildPosition(pos, i), tests, insn);
+    }
+    return;
+  }
+  case CST_Kind::Vector: {
+    auto members = static_cast<const VectorCST *>(pattern)->getMembers();
+    code(0);
+    tests.push_back({pos, TestKind::Arity, members.size()});
+    for (unsigned i = 0; i < members.size(); ++i) {
+      compile(members[i], getChildPosition(pos, i), tests, insn);
+    }
+    return;
+  }
+  case CST_Kind::Identifier:
+    code(static_cast<const IdentifierCST *>(pattern)->getID());
+    return;
+  case CST_Kind::Int: {
+    const IntegerValue &value =
+        static_cast<const IntCST *>(pattern)->getValue();
+    if (value.isWide()) {
+      addCheck(CheckKind::Subtree, 0);
+      return;
+    }
+    code(0);
+    tests.push_back(
+        {pos, TestKind::Int, static_cast<uint64_t>(value.getSExtValue())});
+    return;
+  }
+  case CST_Kind::String:
+    code(0);
+    tests.push_back({pos, TestKind::String,
+                     static_cast<const StringCST *>(pattern)->getID()});
+    return;
+  default:
+    addCheck(CheckKind::Subtree, 0);
+    return;
+  }
+}
+
+void InsnMatcher::insert(std::vector<Test> &tests, unsigned insnNumber) {
+  Node *node = root;
+  node->minInsn = std::min(node->minInsn, insnNumber);
+  for (const Test &test : tests) {
+    auto iter = std::find_if(
+        node->switches.begin(), node->switches.end(), [&](const Switch &sw) {
+          return sw.pos == test.pos && sw.kind == test.kind;
+        });
+    if (iter == node->switches.end()) {
+      // insns come in ascending order, the switches stay sorted by minInsn
+      node->switches.push_back({test.pos, test.kind, insnNumber, {}});
+      iter = node->switches.end() - 1;
+    }
+    auto &cases = iter->cases;
+    auto caseIter = std::lower_bound(
+        cases.begin(), cases.end(), test.value,
+        [](const auto &entry, uint64_t value) { return entry.first < value; });
+    if (caseIter == cases.end() || caseIter->first != test.value) {
+      caseIter = cases.insert(caseIter,
+                              {test.value, new (nodeAlloc.Allocate()) Node()});
+      ++numNodes;
+    }
+    node = caseIter->second;
+    node->minInsn = std::min(node->minInsn, insnNumber);
+  }
+  // an insn that repeats an earlier one never matches (its checks fail
+  // whenever the earlier one's do), leave it out rather than check it again
+  const CompiledInsn &insn = insns[insnNumber];
+  for (unsigned accepted : node->accepts) {
+    if (insns[accepted].insn.condition == insn.insn.condition &&
+        isEqual(insns[accepted].pattern, insn.pattern)) {
+      return;
+    }
+  }
+  node->accepts.push_back(insnNumber);
+}
+
+bool InsnMatcher::addInsn(const ExpressionCST *form) {
+  auto sub = form->getSubforms();
+  if (form->getLeadID() != getKeywordID(RTLCode::DEFINE_INSN) ||
+      sub.size() < 3 || sub[2]->getKind() != CST_Kind::Vector) {
+    return false;
+  }
+  CompiledInsn insn;
+  insn.insn.form = form;
+  if (sub[1]->getKind() == CST_Kind::String) {
+    insn.insn.name = static_cast<StringCST *>(sub[1])->getStr();
+  }
+  if (sub.size() > 3 && sub[3]->getKind() == CST_Kind::String) {
+    insn.insn.condition = static_cast<StringCST *>(sub[3])->getStr();
+  }
+  auto members = static_cast<VectorCST *>(sub[2])->getMembers();
+  if (members.size() == 1) {
+    insn.pattern = members[0];
+  } else {
+    // like GCC, several rtxes are matched as a parallel of them
+    CST *parallel[] = {parallelLead, sub[2]};
+    insn.pattern = ExpressionCST::create(alloc, sub[2]->getLoc(),
+                                         IdentifierInterner::InvalidID,
+                                         parallel);
+  }
+  std::vector<Test> tests;
+  compile(insn.pattern, 0, tests, insn);
+  // a match_dup before its match_operand fails in matchPattern(), it must
+  // not see the operand bound later here
+  std::stable_partition(
+      insn.checks.begin(), insn.checks.end(),
+      [](const Check &check) { return check.kind != CheckKind::Predicate; });
+  insns.push_back(std::move(insn));
+  insert(tests, insns.size() - 1);
+  return true;
+}
+
+bool InsnMatcher::checkLeaf(const CompiledInsn &insn, const CST *rtl,
+                            MatchPredicates &predicates,
+                            Operands &operands) const {
+  operands.assign(insn.numOperands, nullptr);
+  for (const Check &check : insn.checks) {
+    const CST *node = getAt(rtl, check.pos);
+    if (!node) {
+      return false;
+    }
+    switch (check.kind) {
+    case CheckKind::Bind:
+      operands[check.operand] = node;
+      break;
+    case CheckKind::Subtree:
+      if (!matchPattern(check.pattern, node, predicates, operands)) {
+        return false;
+      }
+      break;
+    case CheckKind::Predicate: {
+      auto *expr = static_cast<const ExpressionCST *>(check.pattern);
+      if (!predicates.testPredicate(getPredicate(expr),
+                                    expr->getMachineMode(), node)) {
+        return false;
+      }
+      break;
+    }
+    case CheckKind::Dup:
+      if (check.operand >= operands.size() || !operands[check.operand] ||
+          !isEqual(operands[check.operand], node)) {
+        return false;
+      }
+      break;
+    }
+  }
+  return predicates.testCondition(insn.insn.condition);
+}
+
+void InsnMatcher::search(const Node &node, const CST *rtl,
+                         MatchPredicates &predicates, unsigned &best,
+                         Operands &operands, Operands &scratch) const {
+  for (unsigned insnNumber : node.accepts) {
+    if (insnNumber >= best) {
+      break;
+    }
+    if (checkLeaf(insns[insnNumber], rtl, predicates, scratch)) {
+      best = insnNumber;
+      operands = scratch;
+      break;
+    }
+  }
+  for (const Switch &sw : node.switches) {
+    if (sw.minInsn >= best) {
+      break;
+    }
+    const CST *at = getAt(rtl, sw.pos);
+    uint64_t value;
+    if (!at || !evaluate(sw.kind, at, value)) {
+      continue;
+    }
+    const Node *child = sw.findCase(value);
+    if (child && child->minInsn < best) {
+      search(*child, rtl, predicates, best, operands, scratch);
+    }
+  }
+}
+
+int InsnMatcher::match(const CST *rtl, MatchPredicates &predicates,
+                       Operands &operands) const {
+  unsigned best = UINT32_MAX;
+  Operands scratch;
+  search(*root, rtl, predicates, best, operands, scratch);
+  return best == UINT32_MAX ? -1 : static_cast<int>(best);
+}
+
+int InsnMatcher::matchLinear(const CST *rtl, MatchPredicates &predicates,
+                             Operands &operands) const {
+  for (unsigned i = 0; i < insns.size(); ++i) {
+    operands.clear();
+    if (matchPattern(insns[i].pattern, rtl, predicates, operands) &&
+        predicates.testCondition(insns[i].insn.condition)) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+bool InsnMatcher::matchPattern(const CST *pattern, const CST *rtl,
+                               MatchPredicates &predicates,
+                               Operands &operands) {
+  auto matchAll = [&](llvm::ArrayRef<CST *> patterns,
+                      llvm::ArrayRef<CST *> rtls) {
+    for (unsigned i = 0; i < patterns.size(); ++i) {
+      if (!matchPattern(patterns[i], rtls[i], predicates, operands)) {
+        return false;
+      }
+    }
+    return true;
+  };
+  switch (pattern->getKind()) {
+  case CST_Kind::Expression: {
+    auto *expr = static_cast<const ExpressionCST *>(pattern);
+    IDTy lead = expr->getLeadID();
+    unsigned number;
+    const VectorCST *operandPatterns;
+    llvm::ArrayRef<CST *> members;
+    if (isRTLCodeID(lead) &&
+        getRTXClass(getRTLCode(lead)) == RTXClass::RTX_MATCH) {
+      switch (getRTLCode(lead)) {
+      case RTLCode::MATCH_OPERAND:
+      case RTLCode::MATCH_SCRATCH: {
+        if (!getOperandNumber(expr, number)) {
+          return false;
+        }
+        bind(operands, number, rtl);
+        llvm::StringRef predicate = getPredicate(expr);
+        return predicate.empty() ||
+               predicates.testPredicate(predicate, expr->getMachineMode(),
+                                        rtl);
+      }
+      case RTLCode::MATCH_DUP:
+        return getOperandNumber(expr, number) && number < operands.size() &&
+               operands[number] && isEqual(operands[number], rtl);
+      case RTLCode::MATCH_OPERATOR: {
+        operandPatterns = getOperandPatterns(expr);
+        if (!getOperandNumber(expr, number) || !operandPatterns ||
+            rtl->getKind() != CST_Kind::Expression) {
+          return false;
+        }
+        auto patterns = operandPatterns->getMembers();
+        auto rtlSub = getChildren(rtl);
+        if (rtlSub.size() != patterns.size() + 1) {
+          return false;
+        }
+        bind(operands, number, rtl);
+        llvm::StringRef predicate = getPredicate(expr);
+        if (!predicate.empty() &&
+            !predicates.testPredicate(predicate, expr->getMachineMode(),
+                                      rtl)) {
+          return false;
+        }
+        return matchAll(patterns, rtlSub.drop_front());
+      }
+      case RTLCode::MATCH_PARALLEL: {
+        // a parallel whose first members match the patterns
+        operandPatterns = getOperandPatterns(expr);
+        if (!getOperandNumber(expr, number) || !operandPatterns ||
+            !isParallel(rtl, members)) {
+          return false;
+        }
+        auto patterns = operandPatterns->getMembers();
+        if (members.size() < patterns.size()) {
+          return false;
+        }
+        bind(operands, number, rtl);
+        llvm::StringRef predicate = getPredicate(expr);
+        if (!predicate.empty() &&
+            !predicates.testPredicate(predicate, expr->getMachineMode(),
+                                      rtl)) {
+          return false;
+        }
+        return matchAll(patterns, members);
+      }
+      case RTLCode::MATCH_OP_DUP: {
+        // the code and mode of the operator bound before
+        operandPatterns = getOperandPatterns(expr);
+        if (!getOperandNumber(expr, number) || !operandPatterns ||
+            number >= operands.size() || !operands[number] ||
+            operands[number]->getKind() != CST_Kind::Expression ||
+            rtl->getKind() != CST_Kind::Expression) {
+          return false;
+        }
+        auto *op = static_cast<const ExpressionCST *>(operands[number]);
+        auto *rtlExpr = static_cast<const ExpressionCST *>(rtl);
+        auto patterns = operandPatterns->getMembers();
+        return rtlExpr->getLeadID() == op->getLeadID() &&
+               rtlExpr->getMachineMode() == op->getMachineMode() &&
+               rtlExpr->getSubforms().size() == patterns.size() + 1 &&
+               matchAll(patterns, rtlExpr->getSubforms().drop_front());
+      }
+      case RTLCode::MATCH_PAR_DUP: {
+        operandPatterns = getOperandPatterns(expr);
+        if (!operandPatterns || !isParallel(rtl, members) ||
+            members.size() != operandPatterns->getMembers().size()) {
+          return false;
+        }
+        return matchAll(operandPatterns->getMembers(), members);
+      }
+      default:
+        // match_code, match_test: only in predicates
+        return false;
+      }
+    }
+    if (rtl->getKind() != CST_Kind::Expression) {
+      return false;
+    }
+    auto *rtlExpr = static_cast<const ExpressionCST *>(rtl);
+    auto sub = expr->getSubforms();
+    return rtlExpr->getMachineMode() == expr->getMachineMode() &&
+           rtlExpr->getSubforms().size() == sub.size() &&
+           matchAll(sub, rtlExpr->getSubforms());
+  }
+  case CST_Kind::Vector: {
+    auto patterns = static_cast<const VectorCST *>(pattern)->getMembers();
+    return rtl->getKind() == CST_Kind::Vector &&
+           getChildren(rtl).size() == patterns.size() &&
+           matchAll(patterns, getChildren(rtl));
+  }
+  default:
+    return isEqual(pattern, rtl);
+  }
+}
+
+bool InsnMatcher::isEqual(const CST *lhs, const CST *rhs) {
+  if (lhs == rhs) {
+    return true;
+  }
+  if (lhs->getKind() != rhs->getKind()) {
+    return false;
+  }
+  switch (lhs->getKind()) {
+  case CST_Kind::Expression: {
+    auto *lhsExpr = static_cast<const ExpressionCST *>(lhs);
+    auto *rhsExpr = static_cast<const ExpressionCST *>(rhs);
+    if (lhsExpr->getMachineMode() != rhsExpr->getMachineMode()) {
+      return false;
+    }
+    LLVM_FALLTHROUGH;
+  }
+  case CST_Kind::Vector: {
+    auto lhsChildren = getChildren(lhs);
+    auto rhsChildren = getChildren(rhs);
+    if (lhsChildren.size() != rhsChildren.size()) {
+      return false;
+    }
+    for (unsigned i = 0; i < lhsChildren.size(); ++i) {
+      if (!isEqual(lhsChildren[i], rhsChildren[i])) {
+        return false;
+      }
+    }
+    return true;
+  }
+  case CST_Kind::Identifier:
+    return static_cast<const IdentifierCST *>(lhs)->getID() ==
+           static_cast<const IdentifierCST *>(rhs)->getID();
+  case CST_Kind::Int: {
+    const IntegerValue &lhsValue = static_cast<const IntCST *>(lhs)->getValue();
+    const IntegerValue &rhsValue = static_cast<const IntCST *>(rhs)->getValue();
+    if (!lhsValue.isWide() && !rhsValue.isWide()) {
+      return lhsValue.getSExtValue() == rhsValue.getSExtValue();
+    }
+    return llvm::APInt::isSameValue(lhsValue.getAPInt(), rhsValue.getAPInt());
+  }
+  case CST_Kind::String:
+    return static_cast<const StringCST *>(lhs)->getID() ==
+           static_cast<const StringCST *>(rhs)->getID();
+  case CST_Kind::CodeString:
+    return static_cast<const CodeStringCST *>(lhs)->getStr() ==
+           static_cast<const CodeStringCST *>(rhs)->getStr();
+  default:
+    return false;
+  }
+}
+
+} // namespace grp
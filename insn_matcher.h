@@ -0,0 +1,178 @@
+#pragma once
+
+#include "cst.h"
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Allocator.h"
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace grp {
+
+// What an InsnMatcher can't decide from the RTL alone.
+class MatchPredicates {
+public:
+  virtual ~MatchPredicates() = default;
+  // whether `operand` satisfies the predicate named `predicate` (e.g.
+  // "register_operand") for the mode `mode` of its match_operand,
+  // IdentifierInterner::InvalidID if the operand has no mode
+  virtual bool testPredicate(llvm::StringRef predicate, IDTy mode,
+                             const CST *operand) = 0;
+  // the condition string of a define_insn
+  virtual bool testCondition(llvm::StringRef condition) { return true; }
+};
+
+// Matches RTL against the patterns of the define_insns of a machine
+// description, like GCC's recog(): the result is the first insn, in the
+// order they were added, whose pattern matches and whose predicates and
+// condition hold.
+//
+// The patterns are compiled into a shared decision tree, in the spirit of
+// genrecog: each pattern becomes a sequence of tests (the code, mode or
+// number of operands of an expression, the value of an integer or string)
+// on positions of the RTL, in pre-order, and patterns testing the same
+// position the same way share the node that switches on the result. What
+// can't be decided by a switch (predicates, match_dup, the condition) is
+// checked at the leaves, for the few insns that get there.
+//
+// The RTL to match is a CST, e.g. `(set (reg:SI 0) (const_int 1))` parsed
+// by a CSTParser of the same ParserContext as the patterns: strings are
+// compared by StringPool ID. Mode iterators aren't expanded, a mode like
+// `<MODE>` only matches itself.
+class InsnMatcher {
+public:
+  struct Insn {
+    const ExpressionCST *form;
+    llvm::StringRef name;
+    llvm::StringRef condition;
+  };
+  // bound by match_operand, match_operator, ..., indexed by operand number,
+  // null if unbound
+  using Operands = llvm::SmallVector<const CST *, 8>;
+
+private:
+  // a node of the RTL: the root, or a subform/member of the node at another
+  // position
+  struct Position {
+    unsigned parent;
+    unsigned index;
+  };
+  enum class TestKind : uint8_t {
+    // CST_Kind, plus the lead of an expression or the ID of an identifier
+    Code,
+    // CST_Kind only, e.g. any expression for a match_operator
+    Kind,
+    // the machine mode of an expression
+    Mode,
+    // the number of subforms of an expression (with its lead) or members of
+    // a vector
+    Arity,
+    // the value of an integer that fits in int64_t
+    Int,
+    // the StringPool ID of a string
+    String,
+  };
+  struct Node;
+  // switch on the result of one test, the lowest insn number found under
+  // any of the switches of a node wins
+  struct Switch {
+    unsigned pos;
+    TestKind kind;
+    unsigned minInsn;
+    // sorted by value
+    std::vector<std::pair<uint64_t, Node *>> cases;
+    Node *findCase(uint64_t value) const;
+  };
+  struct Node {
+    // the insns whose tests are all passed here, ascending
+    std::vector<unsigned> accepts;
+    // in order of minInsn
+    std::vector<Switch> switches;
+    // the lowest insn number in the subtree, to prune the search
+    unsigned minInsn = UINT32_MAX;
+  };
+  // checked at a leaf in pre-order, like matchPattern() does, so that a
+  // match_dup sees exactly the operands bound before it; the predicates,
+  // which bind nothing, last
+  enum class CheckKind : uint8_t {
+    // bind an operand, no check
+    Bind,
+    // match a subtree the way matchLinear() does, for what doesn't fit the
+    // decision tree (match_parallel, wide integers, ...)
+    Subtree,
+    Predicate,
+    // match_dup
+    Dup,
+  };
+  struct Check {
+    CheckKind kind;
+    unsigned pos;
+    unsigned operand;
+    // the match_* expression, or the pattern of a Subtree
+    const CST *pattern;
+  };
+  struct CompiledInsn {
+    Insn insn;
+    // the template, a parallel if the define_insn has several
+    const CST *pattern;
+    // in pre-order, then the predicates
+    std::vector<Check> checks;
+    unsigned numOperands = 0;
+  };
+  struct Test {
+    unsigned pos;
+    TestKind kind;
+    uint64_t value;
+  };
+
+  // for the parallel patterns synthesized from multi-rtx templates
+  llvm::BumpPtrAllocator alloc;
+  llvm::SpecificBumpPtrAllocator<Node> nodeAlloc;
+  std::vector<Position> positions;
+  llvm::DenseMap<std::pair<unsigned, unsigned>, unsigned> childPositions;
+  std::vector<CompiledInsn> insns;
+  Node *root;
+  unsigned numNodes = 1;
+  // what the synthesized parallel patterns lead with
+  IdentifierCST *parallelLead;
+
+  unsigned getChildPosition(unsigned parent, unsigned index);
+  const CST *getAt(const CST *rtl, unsigned pos) const;
+  // the result of a test, false if it doesn't apply to `node`
+  static bool evaluate(TestKind kind, const CST *node, uint64_t &value);
+  void compile(const CST *pattern, unsigned pos, std::vector<Test> &tests,
+               CompiledInsn &insn);
+  void insert(std::vector<Test> &tests, unsigned insnNumber);
+  bool checkLeaf(const CompiledInsn &insn, const CST *rtl,
+                 MatchPredicates &predicates, Operands &operands) const;
+  void search(const Node &node, const CST *rtl, MatchPredicates &predicates,
+              unsigned &best, Operands &operands, Operands &scratch) const;
+  // the way matchLinear() matches `rtl` against `pattern`
+  static bool matchPattern(const CST *pattern, const CST *rtl,
+                           MatchPredicates &predicates, Operands &operands);
+
+public:
+  InsnMatcher();
+  // add `form` if it is a define_insn, return false otherwise; insns added
+  // earlier take precedence, one repeating an earlier insn is never matched
+  bool addInsn(const ExpressionCST *form);
+  const Insn &getInsn(unsigned number) const { return insns[number].insn; }
+  size_t getNumInsns() const { return insns.size(); }
+  // nodes of the decision tree
+  unsigned getNumNodes() const { return numNodes; }
+  // the number of the insn `rtl` matches with its operands, -1 if none
+  int match(const CST *rtl, MatchPredicates &predicates,
+            Operands &operands) const;
+  // the same by trying the insns one after the other, for reference
+  int matchLinear(const CST *rtl, MatchPredicates &predicates,
+                  Operands &operands) const;
+  // whether `lhs` and `rhs` are the same RTL, as match_dup requires
+  static bool isEqual(const CST *lhs, const CST *rhs);
+};
+
+} // namespace grp
@@ -0,0 +1,740 @@
+#include "iterator_expander.h"
+
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringExtras.h"
+
+#define DEBUG_TYPE "iterators"
+
+namespace grp {
+
+namespace {
+// indexed by IteratorExpander::Variants::Event
+Statistic expansionStats[IteratorExpander::Variants::NumEvents] = {
+    {DEBUG_TYPE, "NumVariants", "variants of forms expanded"},
+    {DEBUG_TYPE, "NumSharedSubtrees",
+     "subtrees without iterators shared by the variants"},
+    {DEBUG_TYPE, "NumReusedSubtrees",
+     "subtrees with iterators reused from an earlier variant"},
+    {DEBUG_TYPE, "NumCreatedNodes", "nodes created for the variants"},
+};
+} // namespace
+
+GRP_STATISTIC(NumStringsSubstituted, "strings with attributes substituted");
+GRP_STATISTIC(NumStringsReused, "substituted strings found memoized");
+
+namespace {
+bool isAttributeName(llvm::StringRef ref) {
+  return !ref.empty() && llvm::all_of(ref, [](char c) {
+    return llvm::isAlnum(c) || c == '_' || c == ':';
+  });
+}
+
+std::string joinConditions(llvm::StringRef lhs, llvm::StringRef rhs) {
+  if (lhs.empty()) {
+    return rhs.str();
+  }
+  if (rhs.empty()) {
+    return lhs.str();
+  }
+  return ("(" + lhs + ") && (" + rhs + ")").str();
+}
+
+// like GCC's add_condition_to_string: a split condition starting with "&&"
+// already includes the condition of the insn
+std::string addCondition(llvm::StringRef condition, llvm::StringRef extra) {
+  if (condition.startswith("&&")) {
+    return condition.str();
+  }
+  return joinConditions(condition, extra);
+}
+
+void appendRaw(llvm::SmallVectorImpl<char> &key, uint64_t value) {
+  key.append(reinterpret_cast<const char *>(&value),
+             reinterpret_cast<const char *>(&value + 1));
+}
+} // namespace
+
+bool IteratorExpander::isDefinition(const ExpressionCST *form) {
+  IDTy lead = form->getLeadID();
+  if (!isMDDirectiveID(lead)) {
+    return false;
+  }
+  switch (getMDDirective(lead)) {
+  case MDDirective::DEFINE_MODE_ITERATOR:
+  case MDDirective::DEFINE_MODE_ATTR:
+  case MDDirective::DEFINE_CODE_ITERATOR:
+  case MDDirective::DEFINE_CODE_ATTR:
+  case MDDirective::DEFINE_INT_ITERATOR:
+  case MDDirective::DEFINE_INT_ATTR:
+    return true;
+  default:
+    return false;
+  }
+}
+
+bool IteratorExpander::addDefinition(const ExpressionCST *form) {
+  if (!isDefinition(form)) {
+    return false;
+  }
+  switch (getMDDirective(form->getLeadID())) {
+  case MDDirective::DEFINE_MODE_ITERATOR:
+    addIterator(IteratorKind::Mode, form);
+    break;
+  case MDDirective::DEFINE_MODE_ATTR:
+    addAttribute(IteratorKind::Mode, form);
+    break;
+  case MDDirective::DEFINE_CODE_ITERATOR:
+    addIterator(IteratorKind::Code, form);
+    break;
+  case MDDirective::DEFINE_CODE_ATTR:
+    addAttribute(IteratorKind::Code, form);
+    break;
+  case MDDirective::DEFINE_INT_ITERATOR:
+    addIterator(IteratorKind::Int, form);
+    break;
+  case MDDirective::DEFINE_INT_ATTR:
+    addAttribute(IteratorKind::Int, form);
+    break;
+  default:
+    llvm_unreachable("not a definition");
+  }
+  return true;
+}
+
+const IteratorExpander::Iterator *
+IteratorExpander::lookupIterator(llvm::StringRef name) const {
+  IDTy id = context.getIdentifierInterner().lookup(name);
+  auto iter = iteratorsByID.find(id);
+  return iter == iteratorsByID.end() ? nullptr : &iterators[iter->second];
+}
+
+void IteratorExpander::addIterator(IteratorKind kind,
+                                   const ExpressionCST *form) {
+  auto sub = form->getSubforms();
+  if (sub.size() < 3 || sub[1]->getKind() != CST_Kind::Identifier ||
+      sub[2]->getKind() != CST_Kind::Vector) {
+    // TODO: diag
+    return;
+  }
+  IDTy id = static_cast<IdentifierCST *>(sub[1])->getID();
+  Iterator iterator{kind, context.getIdentifierInterner().getName(id), {}};
+  // VALUE or (VALUE "condition")
+  for (const CST *member : static_cast<VectorCST *>(sub[2])->getMembers()) {
+    llvm::StringRef condition;
+    if (member->getKind() == CST_Kind::Expression) {
+      auto memberSub =
+          static_cast<const ExpressionCST *>(member)->getSubforms();
+      if (memberSub.empty()) {
+        // TODO: diag
+        continue;
+      }
+      if (memberSub.size() > 1 &&
+          memberSub[1]->getKind() == CST_Kind::String) {
+        condition = static_cast<StringCST *>(memberSub[1])->getStr();
+      }
+      member = memberSub[0];
+    }
+    if (member->getKind() == CST_Kind::Identifier) {
+      iterator.values.push_back(
+          {member, static_cast<const IdentifierCST *>(member)->getID(),
+           condition});
+    } else if (member->getKind() == CST_Kind::Int) {
+      iterator.values.push_back(
+          {member, IdentifierInterner::InvalidID, condition});
+    } else {
+      // TODO: diag
+    }
+  }
+  // a redefinition replaces the iterator for the forms after it
+  // TODO: diag
+  iteratorsByID[id] = iterators.size();
+  iterators.push_back(std::move(iterator));
+}
+
+void IteratorExpander::addAttribute(IteratorKind kind,
+                                    const ExpressionCST *form) {
+  auto sub = form->getSubforms();
+  if (sub.size() < 3 || sub[1]->getKind() != CST_Kind::Identifier ||
+      sub[2]->getKind() != CST_Kind::Vector) {
+    // TODO: diag
+    return;
+  }
+  llvm::StringRef name = context.getIdentifierInterner().getName(
+      static_cast<IdentifierCST *>(sub[1])->getID());
+  Attribute &attribute =
+      attributes[static_cast<unsigned>(kind)].try_emplace(name).first->second;
+  // (VALUE "text")
+  for (const CST *member : static_cast<VectorCST *>(sub[2])->getMembers()) {
+    auto *expr = static_cast<const ExpressionCST *>(member);
+    if (member->getKind() != CST_Kind::Expression ||
+        expr->getSubforms().size() != 2 ||
+        expr->getSubforms()[1]->getKind() != CST_Kind::String) {
+      // TODO: diag
+      continue;
+    }
+    attribute[expr->getLeadID()] =
+        static_cast<StringCST *>(expr->getSubforms()[1])->getStr();
+  }
+}
+
+IteratorExpander::Variants
+IteratorExpander::expand(const ExpressionCST *form,
+                         llvm::BumpPtrAllocator &alloc) {
+  return Variants(*this, form, alloc);
+}
+
+IteratorExpander::Variants::Variants(IteratorExpander &expander,
+                                     const ExpressionCST *form,
+                                     llvm::BumpPtrAllocator &alloc)
+    : expander(&expander), form(form), alloc(&alloc),
+      counts(expansionStats) {
+  collectDims(form);
+  values.assign(dims.size(), 0);
+  done = size() == 0;
+}
+
+void IteratorExpander::Variants::addDim(const Iterator *iterator) {
+  if (llvm::is_contained(dims, iterator)) {
+    return;
+  }
+  if (dims.size() == 64) {
+    // TODO: diag, the iterators past the 64th aren't expanded
+    return;
+  }
+  dims.push_back(iterator);
+}
+
+void IteratorExpander::Variants::collectDims(const CST *node) {
+  // the iterators named explicitly by `<ITER:attr>`
+  auto collectExplicit = [&](llvm::StringRef text) {
+    for (size_t pos = text.find('<'); pos != llvm::StringRef::npos;
+         pos = text.find('<', pos + 1)) {
+      llvm::StringRef ref = text.substr(pos + 1).take_until(
+          [](char c) { return c == '>'; });
+      if (ref.contains(':') && isAttributeName(ref)) {
+        if (auto *iterator = expander->lookupIterator(ref.split(':').first)) {
+          addDim(iterator);
+        }
+      }
+    }
+  };
+  auto collectID = [&](IDTy id) {
+    if (id == IdentifierInterner::InvalidID || isKeywordID(id)) {
+      return;
+    }
+    auto iter = expander->iteratorsByID.find(id);
+    if (iter != expander->iteratorsByID.end()) {
+      addDim(&expander->iterators[iter->second]);
+    } else {
+      collectExplicit(expander->context.getIdentifierInterner().getName(id));
+    }
+  };
+  switch (node->getKind()) {
+  case CST_Kind::Expression: {
+    auto *expr = static_cast<const ExpressionCST *>(node);
+    collectID(expr->getMachineMode());
+    for (const CST *subform : expr->getSubforms()) {
+      collectDims(subform);
+    }
+    break;
+  }
+  case CST_Kind::Vector:
+    for (const CST *member :
+         static_cast<const VectorCST *>(node)->getMembers()) {
+      collectDims(member);
+    }
+    break;
+  case CST_Kind::Identifier:
+    collectID(static_cast<const IdentifierCST *>(node)->getID());
+    break;
+  case CST_Kind::String:
+    collectExplicit(static_cast<const StringCST *>(node)->getStr());
+    break;
+  case CST_Kind::CodeString:
+    collectExplicit(static_cast<const CodeStringCST *>(node)->getStr());
+    break;
+  default:
+    break;
+  }
+}
+
+bool IteratorExpander::Variants::resolve(llvm::StringRef ref,
+                                         AttributeUse &use) const {
+  llvm::StringRef iteratorName, name = ref;
+  if (ref.contains(':')) {
+    std::tie(iteratorName, name) = ref.split(':');
+  }
+  use = {0, {}, false, false};
+  // for the built-in ones
+  use.upperCase = name == "MODE" || name == "CODE";
+  use.lowerCase = name == "mode" || name == "code";
+  // add `dim` to the dims of the use if the attribute is defined for its kind
+  auto addDim = [&](unsigned dim) {
+    IteratorKind kind = dims[dim]->kind;
+    if ((kind == IteratorKind::Mode && (name == "mode" || name == "MODE")) ||
+        (kind == IteratorKind::Code && (name == "code" || name == "CODE"))) {
+      use.dims |= uint64_t(1) << dim;
+      return true;
+    }
+    auto &kindAttributes = expander->attributes[static_cast<unsigned>(kind)];
+    auto iter = kindAttributes.find(name);
+    if (iter == kindAttributes.end()) {
+      return false;
+    }
+    use.attributes[static_cast<unsigned>(kind)] = &iter->second;
+    use.dims |= uint64_t(1) << dim;
+    return true;
+  };
+  if (!iteratorName.empty()) {
+    auto iter = llvm::find(dims, expander->lookupIterator(iteratorName));
+    return iter != dims.end() && addDim(iter - dims.begin());
+  }
+  // `<ITER>`, the value itself
+  for (unsigned dim = 0; dim < dims.size(); ++dim) {
+    if (dims[dim]->name == name) {
+      use = {uint64_t(1) << dim, {}, false, false};
+      return true;
+    }
+  }
+  // every iterator of the form the attribute is defined for, which one
+  // depends on the values of the variant
+  for (unsigned dim = 0; dim < dims.size(); ++dim) {
+    addDim(dim);
+  }
+  return use.dims != 0;
+}
+
+template <typename Fn>
+void IteratorExpander::Variants::forEachUse(llvm::StringRef text,
+                                            Fn fn) const {
+  size_t pos = text.find('<');
+  while (pos != llvm::StringRef::npos) {
+    size_t end = text.find('>', pos + 1);
+    if (end == llvm::StringRef::npos) {
+      return;
+    }
+    // `<` also appears in C code, e.g. "INTVAL (operands[2]) < 32"
+    llvm::StringRef ref = text.slice(pos + 1, end);
+    AttributeUse use;
+    if (isAttributeName(ref) && resolve(ref, use)) {
+      fn(pos, end + 1 - pos, use);
+      pos = text.find('<', end + 1);
+    } else {
+      pos = text.find('<', pos + 1);
+    }
+  }
+}
+
+uint64_t IteratorExpander::Variants::getTextMask(llvm::StringRef text) const {
+  uint64_t mask = 0;
+  if (text.contains('<')) {
+    forEachUse(text, [&](size_t, size_t, const AttributeUse &use) {
+      mask |= use.dims;
+    });
+  }
+  return mask;
+}
+
+uint64_t IteratorExpander::Variants::getMask(const CST *node) {
+  auto iter = masks.find(node);
+  if (iter != masks.end()) {
+    return iter->second;
+  }
+  auto getIDMask = [&](IDTy id) -> uint64_t {
+    if (id == IdentifierInterner::InvalidID || isKeywordID(id)) {
+      return 0;
+    }
+    auto iter = expander->iteratorsByID.find(id);
+    if (iter != expander->iteratorsByID.end()) {
+      auto dim = llvm::find(dims, &expander->iterators[iter->second]);
+      return dim == dims.end() ? 0 : uint64_t(1) << (dim - dims.begin());
+    }
+    return getTextMask(expander->context.getIdentifierInterner().getName(id));
+  };
+  uint64_t mask = 0;
+  switch (node->getKind()) {
+  case CST_Kind::Expression: {
+    auto *expr = static_cast<const ExpressionCST *>(node);
+    mask = getIDMask(expr->getMachineMode());
+    for (const CST *subform : expr->getSubforms()) {
+      mask |= getMask(subform);
+    }
+    break;
+  }
+  case CST_Kind::Vector:
+    for (const CST *member :
+         static_cast<const VectorCST *>(node)->getMembers()) {
+      mask |= getMask(member);
+    }
+    break;
+  case CST_Kind::Identifier:
+    mask = getIDMask(static_cast<const IdentifierCST *>(node)->getID());
+    break;
+  case CST_Kind::String:
+    mask = getTextMask(static_cast<const StringCST *>(node)->getStr());
+    break;
+  case CST_Kind::CodeString:
+    mask = getTextMask(static_cast<const CodeStringCST *>(node)->getStr());
+    break;
+  default:
+    break;
+  }
+  masks[node] = mask;
+  return mask;
+}
+
+bool IteratorExpander::Variants::appendValueText(const AttributeUse &use,
+                                                 std::string &out) const {
+  // like GCC's map_attr_string, the first dim with a text for its value
+  for (unsigned dim = 0; dim < dims.size(); ++dim) {
+    if (!(use.dims >> dim & 1)) {
+      continue;
+    }
+    const Value &value = dims[dim]->values[values[dim]];
+    const Attribute *attribute =
+        use.attributes[static_cast<unsigned>(dims[dim]->kind)];
+    if (attribute) {
+      auto iter = attribute->find(value.id);
+      if (iter != attribute->end()) {
+        out += iter->second;
+        return true;
+      }
+      continue;
+    }
+    if (value.id == IdentifierInterner::InvalidID) {
+      out += llvm::toString(
+          static_cast<const IntCST *>(value.cst)->getValue().getAPInt(), 10,
+          /*Signed=*/true);
+      return true;
+    }
+    llvm::StringRef text =
+        expander->context.getIdentifierInterner().getName(value.id);
+    if (use.lowerCase) {
+      out += text.lower();
+    } else if (use.upperCase) {
+      out += text.upper();
+    } else {
+      out += text;
+    }
+    return true;
+  }
+  return false;
+}
+
+std::string IteratorExpander::Variants::substitute(llvm::StringRef text) const {
+  std::string result;
+  size_t last = 0;
+  forEachUse(text, [&](size_t offset, size_t length, const AttributeUse &use) {
+    result += text.slice(last, offset);
+    if (!appendValueText(use, result)) {
+      // TODO: diag, left as is
+      result += text.substr(offset, length);
+    }
+    last = offset + length;
+  });
+  result += text.substr(last);
+  return result;
+}
+
+IDTy IteratorExpander::Variants::substituteString(IDTy id,
+                                                  llvm::StringRef text) {
+  // the result only depends on the string and on the iterators and values
+  // each of its attributes may resolve to
+  llvm::SmallString<64> key;
+  appendRaw(key, id);
+  forEachUse(text, [&](size_t, size_t, const AttributeUse &use) {
+    for (unsigned dim = 0; dim < dims.size(); ++dim) {
+      if (use.dims >> dim & 1) {
+        appendRaw(key, (dims[dim] - expander->iterators.data()) << 32 |
+                           values[dim]);
+      }
+    }
+  });
+  {
+    std::lock_guard<std::mutex> lock(expander->stringsMutex);
+    auto iter = expander->substitutedStrings.find(key);
+    if (iter != expander->substitutedStrings.end()) {
+      ++NumStringsReused;
+      return iter->second;
+    }
+  }
+  IDTy result = expander->context.getStringPool().get(substitute(text));
+  std::lock_guard<std::mutex> lock(expander->stringsMutex);
+  ++NumStringsSubstituted;
+  expander->substitutedStrings.try_emplace(key, result);
+  return result;
+}
+
+IDTy IteratorExpander::Variants::substituteID(IDTy id) {
+  if (id == IdentifierInterner::InvalidID || isKeywordID(id)) {
+    return id;
+  }
+  auto iter = expander->iteratorsByID.find(id);
+  if (iter != expander->iteratorsByID.end()) {
+    auto dim = llvm::find(dims, &expander->iterators[iter->second]);
+    if (dim == dims.end()) {
+      return id;
+    }
+    IDTy value = (*dim)->values[values[dim - dims.begin()]].id;
+    // TODO: diag, an int where an identifier is expected
+    return value == IdentifierInterner::InvalidID ? id : value;
+  }
+  IdentifierInterner &ii = expander->context.getIdentifierInterner();
+  llvm::StringRef name = ii.getName(id);
+  return getTextMask(name) ? ii.get(substitute(name)) : id;
+}
+
+CST *IteratorExpander::Variants::build(const CST *node) {
+  uint64_t mask = getMask(node);
+  if (!mask) {
+    counts.count(Event::SharedSubtree);
+    // never modified, CST nodes are immutable once parsed
+    return const_cast<CST *>(node);
+  }
+  // the values of the dims the subtree mentions, in mixed radix
+  uint64_t key = 0;
+  for (unsigned dim = 0; dim < dims.size(); ++dim) {
+    if (mask >> dim & 1) {
+      key = key * dims[dim]->values.size() + values[dim];
+    }
+  }
+  auto iter = built.find({node, key});
+  if (iter != built.end()) {
+    counts.count(Event::ReusedSubtree);
+    return iter->second;
+  }
+  counts.count(Event::CreatedNode);
+  SourceLocation loc = node->getLoc();
+  StringPool &sp = expander->context.getStringPool();
+  CST *result = nullptr;
+  switch (node->getKind()) {
+  case CST_Kind::Expression: {
+    auto *expr = static_cast<const ExpressionCST *>(node);
+    llvm::SmallVector<CST *, 8> subforms;
+    for (const CST *subform : expr->getSubforms()) {
+      subforms.push_back(build(subform));
+    }
+    result = ExpressionCST::create(*alloc, loc,
+                                   substituteID(expr->getMachineMode()),
+                                   subforms);
+    break;
+  }
+  case CST_Kind::Vector: {
+    llvm::SmallVector<CST *, 8> members;
+    for (const CST *member :
+         static_cast<const VectorCST *>(node)->getMembers()) {
+      members.push_back(build(member));
+    }
+    result = VectorCST::create(*alloc, loc, members);
+    break;
+  }
+  case CST_Kind::Identifier: {
+    IDTy id = static_cast<const IdentifierCST *>(node)->getID();
+    auto iterator = expander->iteratorsByID.find(id);
+    if (iterator != expander->iteratorsByID.end()) {
+      unsigned dim = llvm::find(dims, &expander->iterators[iterator->second]) -
+                     dims.begin();
+      const Value &value = dims[dim]->values[values[dim]];
+      if (value.cst->getKind() == CST_Kind::Int) {
+        result = new (alloc->Allocate<IntCST>()) IntCST(
+            loc, static_cast<const IntCST *>(value.cst)->getValue());
+        break;
+      }
+    }
+    result = new (alloc->Allocate<IdentifierCST>())
+        IdentifierCST(loc, substituteID(id));
+    break;
+  }
+  case CST_Kind::String: {
+    auto *str = static_cast<const StringCST *>(node);
+    IDTy id = substituteString(str->getID(), str->getStr());
+    result = new (alloc->Allocate<StringCST>())
+        StringCST(loc, id, sp.getString(id));
+    break;
+  }
+  case CST_Kind::CodeString: {
+    llvm::StringRef text = static_cast<const CodeStringCST *>(node)->getStr();
+    IDTy id = substituteString(sp.get(text), text);
+    result = new (alloc->Allocate<CodeStringCST>())
+        CodeStringCST(loc, sp.getString(id));
+    break;
+  }
+  default:
+    llvm_unreachable("only identifiers and strings mention iterators");
+  }
+  built[{node, key}] = result;
+  return result;
+}
+
+const ExpressionCST *IteratorExpander::Variants::buildForm() {
+  // built anew for every variant, its condition may change
+  llvm::SmallVector<CST *, 8> subforms;
+  for (const CST *subform : form->getSubforms()) {
+    subforms.push_back(build(subform));
+  }
+  std::string condition;
+  for (unsigned dim = 0; dim < dims.size(); ++dim) {
+    condition =
+        joinConditions(condition, dims[dim]->values[values[dim]].condition);
+  }
+  if (!condition.empty()) {
+    // where the conditions are, the lead counting as subform 0
+    llvm::SmallVector<unsigned, 2> conditions;
+    IDTy lead = form->getLeadID();
+    if (lead == getKeywordID(RTLCode::DEFINE_INSN) ||
+        lead == getKeywordID(RTLCode::DEFINE_EXPAND) ||
+        lead == getKeywordID(RTLCode::DEFINE_SUBST)) {
+      conditions = {3};
+    } else if (lead == getKeywordID(RTLCode::DEFINE_INSN_AND_SPLIT) ||
+               lead == getKeywordID(RTLCode::DEFINE_INSN_AND_REWRITE)) {
+      conditions = {3, 5};
+    } else if (lead == getKeywordID(RTLCode::DEFINE_SPLIT) ||
+               lead == getKeywordID(RTLCode::DEFINE_PEEPHOLE2)) {
+      conditions = {2};
+    }
+    StringPool &sp = expander->context.getStringPool();
+    for (unsigned index : conditions) {
+      if (index >= subforms.size() ||
+          subforms[index]->getKind() != CST_Kind::String) {
+        continue;
+      }
+      auto *str = static_cast<StringCST *>(subforms[index]);
+      IDTy id = sp.get(addCondition(str->getStr(), condition));
+      subforms[index] = new (alloc->Allocate<StringCST>())
+          StringCST(str->getLoc(), id, sp.getString(id));
+    }
+  }
+  return ExpressionCST::create(*alloc, form->getLoc(),
+                               substituteID(form->getMachineMode()),
+                               subforms);
+}
+
+uint64_t IteratorExpander::Variants::size() const {
+  uint64_t result = 1;
+  for (const Iterator *iterator : dims) {
+    result *= iterator->values.size();
+  }
+  return result;
+}
+
+const ExpressionCST *IteratorExpander::Variants::next() {
+  if (done) {
+    return nullptr;
+  }
+  counts.count(Event::Variant);
+  if (dims.empty()) {
+    done = true;
+    return form;
+  }
+  const ExpressionCST *result = buildForm();
+  // the last dim varies fastest
+  done = true;
+  for (unsigned dim = dims.size(); dim-- > 0;) {
+    if (++values[dim] < dims[dim]->values.size()) {
+      done = false;
+      break;
+    }
+    values[dim] = 0;
+  }
+  return result;
+}
+
+ExpansionStream::ExpansionStream(IteratorExpander &expander,
+                                 CSTParser &parser, unsigned numThreads)
+    : expander(expander), parser(parser) {
+  if (numThreads > 1) {
+    // enough forms ahead to keep the threads busy when a form has a lot
+    // more variants than its neighbours
+    slots.resize(4 * numThreads);
+    for (auto &slot : slots) {
+      slot = std::make_unique<Slot>();
+    }
+    pool = std::make_unique<ThreadPool>(numThreads);
+  }
+}
+
+const ExpressionCST *ExpansionStream::nextForm() {
+  while (!sourceDone) {
+    const ExpressionCST *form = parser.parseTopCST();
+    if (!form) {
+      sourceDone = true;
+      break;
+    }
+    if (!IteratorExpander::isDefinition(form)) {
+      return form;
+    }
+    if (pool) {
+      // the expansions in flight may be reading the definitions
+      pool->wait();
+    }
+    expander.addDefinition(form);
+  }
+  return nullptr;
+}
+
+void ExpansionStream::fill() {
+  while (numFilled < slots.size()) {
+    const ExpressionCST *form = nextForm();
+    if (!form) {
+      return;
+    }
+    // not in use: the consumer is past it and no task has it
+    Slot &slot = *slots[(head + numFilled) % slots.size()];
+    ++numFilled;
+    slot.alloc.Reset();
+    slot.variants.clear();
+    slot.done = false;
+    pool->async([this, &slot, form] {
+      auto variants = expander.expand(form, slot.alloc);
+      while (auto *variant = variants.next()) {
+        slot.variants.push_back(variant);
+      }
+      std::lock_guard<std::mutex> lock(mutex);
+      slot.done = true;
+      slotDone.notify_all();
+    });
+  }
+}
+
+const ExpressionCST *ExpansionStream::next() {
+  if (!pool) {
+    while (true) {
+      if (current) {
+        if (auto *variant = current->next()) {
+          return variant;
+        }
+      }
+      const ExpressionCST *form = nextForm();
+      // the variants of the previous form go
+      current.reset();
+      alloc.Reset();
+      if (!form) {
+        return nullptr;
+      }
+      current.emplace(expander.expand(form, alloc));
+    }
+  }
+  while (true) {
+    if (!numFilled) {
+      fill();
+      if (!numFilled) {
+        return nullptr;
+      }
+    }
+    Slot &slot = *slots[head];
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      slotDone.wait(lock, [&] { return slot.done; });
+    }
+    if (nextVariant < slot.variants.size()) {
+      return slot.variants[nextVariant++];
+    }
+    head = (head + 1) % slots.size();
+    --numFilled;
+    nextVariant = 0;
+    fill();
+  }
+}
+
+} // namespace grp
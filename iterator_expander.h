@@ -0,0 +1,214 @@
+#pragma once
+
+#include "cst.h"
+#include "parser.h"
+#include "stats.h"
+#include "thread_pool.h"
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/Optional.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Allocator.h"
+
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace grp {
+
+// Expands the mode, code and int iterators of a machine description the way
+// GCC's md reader does: a form using iterators stands for one variant per
+// combination of their values, with each iterator replaced by its value
+// wherever it appears (as a mode, the code of an expression or an int) and
+// the attributes `<attr>`, `<ITER:attr>`, `<mode>`, `<MODE>`, `<code>` and
+// `<CODE>` substituted in identifiers and strings. The conditions attached
+// to the values are ANDed into the condition of the insns, splits, ...
+//
+// The expansion is memoized per form: subtrees that mention none of its
+// iterators (most of them, typically) are shared by all the variants and the
+// original form, a subtree mentioning some of them is built once per
+// combination of their values. Substituted strings are memoized by the
+// expander across forms.
+//
+// The definitions must come before the forms using them, as in GCC.
+// Expanding is thread-safe, adding definitions isn't.
+class IteratorExpander {
+public:
+  enum class IteratorKind : uint8_t { Mode, Code, Int };
+  static constexpr unsigned NumIteratorKinds = 3;
+  class Variants;
+
+private:
+  struct Value {
+    // the identifier or integer substituted for the iterator
+    const CST *cst;
+    // the ID of `cst` if it is an identifier, InvalidID otherwise
+    IDTy id;
+    // ANDed into the condition of the variants with this value, may be empty
+    llvm::StringRef condition;
+  };
+  struct Iterator {
+    IteratorKind kind;
+    llvm::StringRef name;
+    std::vector<Value> values;
+  };
+  // value (identifier ID) -> text
+  using Attribute = llvm::DenseMap<IDTy, llvm::StringRef>;
+
+  ParserContext &context;
+  std::vector<Iterator> iterators;
+  llvm::DenseMap<IDTy, unsigned> iteratorsByID;
+  // by name, for each kind of iterator
+  llvm::StringMap<Attribute> attributes[NumIteratorKinds];
+  // StringPool ID of a string and the iterator values it was substituted
+  // with -> StringPool ID of the result
+  std::mutex stringsMutex;
+  llvm::StringMap<IDTy> substitutedStrings;
+
+  const Iterator *lookupIterator(llvm::StringRef name) const;
+  void addIterator(IteratorKind kind, const ExpressionCST *form);
+  void addAttribute(IteratorKind kind, const ExpressionCST *form);
+
+public:
+  explicit IteratorExpander(ParserContext &context) : context(context) {}
+  IteratorExpander(const IteratorExpander &) = delete;
+  IteratorExpander &operator=(const IteratorExpander &) = delete;
+
+  // whether `form` is a define_{mode,code,int}_{iterator,attr}
+  static bool isDefinition(const ExpressionCST *form);
+  // record `form` if it is a definition, return false otherwise
+  bool addDefinition(const ExpressionCST *form);
+  size_t getNumIterators() const { return iterators.size(); }
+  // the variants of `form`, the new nodes go to `alloc`; `form` itself is
+  // the only variant if it uses no iterator. Thread-safe.
+  Variants expand(const ExpressionCST *form, llvm::BumpPtrAllocator &alloc);
+};
+
+// The variants of one form, built one at a time, in the order of the values
+// of the iterators, the first one used varying slowest.
+class IteratorExpander::Variants {
+public:
+  // counted for -stats
+  enum class Event : uint8_t {
+    Variant,
+    // a subtree mentioning no iterator used as is
+    SharedSubtree,
+    // a subtree built for an earlier variant with the same values
+    ReusedSubtree,
+    CreatedNode,
+  };
+  static constexpr size_t NumEvents = 4;
+
+private:
+  // an attribute substitution `<...>` resolved against the iterators of the
+  // form
+  struct AttributeUse {
+    // the dims that may stand for it, one bit per dim: like GCC, the first
+    // whose current value the attribute has a text for
+    uint64_t dims;
+    // by kind of the dims, null for `<ITER>` and the built-in `<mode>`,
+    // `<MODE>`, ...
+    const Attribute *attributes[NumIteratorKinds];
+    bool upperCase;
+    bool lowerCase;
+  };
+
+  IteratorExpander *expander;
+  const ExpressionCST *form;
+  llvm::BumpPtrAllocator *alloc;
+  // the iterators the form uses, at most 64
+  llvm::SmallVector<const Iterator *, 4> dims;
+  // the index of the current value of each dim
+  llvm::SmallVector<unsigned, 4> values;
+  bool done = false;
+  // the dims each subtree mentions, one bit per dim
+  llvm::DenseMap<const CST *, uint64_t> masks;
+  // (subtree, values of the dims it mentions) -> its copy
+  llvm::DenseMap<std::pair<const CST *, uint64_t>, CST *> built;
+  StatCounters<Event, NumEvents> counts;
+
+  void addDim(const Iterator *iterator);
+  void collectDims(const CST *node);
+  bool resolve(llvm::StringRef ref, AttributeUse &use) const;
+  // call `fn` for each attribute `<...>` of `text` that resolves, with its
+  // offset and length
+  template <typename Fn> void forEachUse(llvm::StringRef text, Fn fn) const;
+  uint64_t getTextMask(llvm::StringRef text) const;
+  uint64_t getMask(const CST *node);
+  // append the text `use` stands for, false if the attribute has no value
+  // for the current value of any of its dims
+  bool appendValueText(const AttributeUse &use, std::string &out) const;
+  std::string substitute(llvm::StringRef text) const;
+  // the StringPool ID of `text` substituted, memoized
+  IDTy substituteString(IDTy id, llvm::StringRef text);
+  IDTy substituteID(IDTy id);
+  CST *build(const CST *node);
+  const ExpressionCST *buildForm();
+
+  friend class IteratorExpander;
+  Variants(IteratorExpander &expander, const ExpressionCST *form,
+           llvm::BumpPtrAllocator &alloc);
+
+public:
+  // the number of variants, 1 if the form uses no iterator
+  uint64_t size() const;
+  // the next variant, null after the last
+  const ExpressionCST *next();
+};
+
+// The variants of the forms of a CSTParser, in order, one at a time; the
+// definitions of iterators and attributes go to the expander instead.
+//
+// A variant lives until the stream hands out a variant of a later form: the
+// arenas of the variants are recycled, so expanding a whole machine
+// description takes the memory of a few forms, whatever the number of
+// variants. With several threads, the forms of a window ahead of the
+// consumer are expanded in parallel; forms after a definition wait for the
+// expansions in flight, which may be reading the definitions.
+class ExpansionStream {
+  IteratorExpander &expander;
+  CSTParser &parser;
+  bool sourceDone = false;
+
+  // sequential
+  llvm::BumpPtrAllocator alloc;
+  llvm::Optional<IteratorExpander::Variants> current;
+
+  // parallel: a ring of slots, `numFilled` of them from `head` in order
+  struct Slot {
+    llvm::BumpPtrAllocator alloc;
+    std::vector<const ExpressionCST *> variants;
+    // guarded by mutex
+    bool done = false;
+  };
+  std::vector<std::unique_ptr<Slot>> slots;
+  size_t head = 0;
+  size_t numFilled = 0;
+  // of the variants of the head slot
+  size_t nextVariant = 0;
+  std::mutex mutex;
+  std::condition_variable slotDone;
+  // read forms until the window is full
+  void fill();
+  // last, destroyed first: its tasks use the members above
+  std::unique_ptr<ThreadPool> pool;
+
+  // the next form that isn't a definition, null at the end
+  const ExpressionCST *nextForm();
+
+public:
+  ExpansionStream(IteratorExpander &expander, CSTParser &parser,
+                  unsigned numThreads = 1);
+  ExpansionStream(const ExpansionStream &) = delete;
+  ExpansionStream &operator=(const ExpansionStream &) = delete;
+  // the next variant, null at the end
+  const ExpressionCST *next();
+};
+
+} // namespace grp
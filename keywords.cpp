@@ -0,0 +1,158 @@
+#include "keywords.h"
+
+#include <array>
+#include <cstring>
+#include <string_view>
+
+namespace grp {
+namespace {
+
+constexpr unsigned NumKeywords = keyword::EndID - keyword::FirstDirectiveID;
+
+constexpr std::array<std::string_view, NumKeywords> makeKeywordNames() {
+  std::array<std::string_view, NumKeywords> names{};
+  unsigned i = 0;
+  for (const char *name : detail::mdDirectiveNames) {
+    names[i++] = name;
+  }
+  for (const char *name : detail::rtlCodeNames) {
+    names[i++] = name;
+  }
+  // skip MachineMode::Invalid
+  for (unsigned m = 1; m <= NumMachineModes; ++m) {
+    names[i++] = detail::machineModeNames[m];
+  }
+  return names;
+}
+
+constexpr std::array<std::string_view, NumKeywords> keywordNames =
+    makeKeywordNames();
+
+// Two level hash-and-displace: the top bits of the hash pick a bucket, the
+// bucket's seed then picks the slot. Seeds are searched for at compile time,
+// biggest buckets first, until every keyword has a slot of its own.
+constexpr unsigned LogNumBuckets = 7;
+constexpr unsigned NumBuckets = 1u << LogNumBuckets;
+constexpr unsigned NumSlots = 1024;
+constexpr uint16_t EmptySlot = UINT16_MAX;
+static_assert(NumKeywords < NumSlots / 2, "grow the keyword hash table");
+
+// FNV-1a
+constexpr uint64_t hashName(const char *data, size_t length) {
+  uint64_t h = 14695981039346656037ull;
+  for (size_t i = 0; i < length; ++i) {
+    h ^= static_cast<unsigned char>(data[i]);
+    h *= 1099511628211ull;
+  }
+  return h;
+}
+
+constexpr unsigned getBucket(uint64_t h) { return h >> (64 - LogNumBuckets); }
+
+constexpr unsigned getSlot(uint64_t h, uint16_t seed) {
+  h ^= seed * 0x9e3779b97f4a7c15ull;
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdull;
+  h ^= h >> 33;
+  return h & (NumSlots - 1);
+}
+
+struct PerfectHashTable {
+  std::array<uint16_t, NumBuckets> seeds;
+  // index into keywordNames
+  std::array<uint16_t, NumSlots> slots;
+};
+
+// not constexpr, calling it stops the compile time evaluation
+void perfectHashFailed() {}
+
+constexpr PerfectHashTable buildPerfectHashTable() {
+  PerfectHashTable table{};
+  for (auto &slot : table.slots) {
+    slot = EmptySlot;
+  }
+  std::array<uint64_t, NumKeywords> hashes{};
+  std::array<unsigned, NumBuckets> bucketSizes{};
+  unsigned maxBucketSize = 0;
+  for (unsigned i = 0; i < NumKeywords; ++i) {
+    hashes[i] = hashName(keywordNames[i].data(), keywordNames[i].size());
+    unsigned size = ++bucketSizes[getBucket(hashes[i])];
+    maxBucketSize = size > maxBucketSize ? size : maxBucketSize;
+  }
+  for (unsigned size = maxBucketSize; size > 0; --size) {
+    for (unsigned bucket = 0; bucket < NumBuckets; ++bucket) {
+      if (bucketSizes[bucket] != size) {
+        continue;
+      }
+      for (uint16_t seed = 1;; ++seed) {
+        if (seed == EmptySlot) {
+          perfectHashFailed();
+        }
+        std::array<unsigned, NumKeywords> taken{};
+        unsigned numTaken = 0;
+        bool ok = true;
+        for (unsigned i = 0; ok && i < NumKeywords; ++i) {
+          if (getBucket(hashes[i]) != bucket) {
+            continue;
+          }
+          unsigned slot = getSlot(hashes[i], seed);
+          ok = table.slots[slot] == EmptySlot;
+          for (unsigned j = 0; ok && j < numTaken; ++j) {
+            ok = taken[j] != slot;
+          }
+          taken[numTaken++] = slot;
+        }
+        if (!ok) {
+          continue;
+        }
+        table.seeds[bucket] = seed;
+        for (unsigned i = 0; i < NumKeywords; ++i) {
+          if (getBucket(hashes[i]) == bucket) {
+            table.slots[getSlot(hashes[i], seed)] = i;
+          }
+        }
+        break;
+      }
+    }
+  }
+  return table;
+}
+
+constexpr PerfectHashTable perfectHashTable = buildPerfectHashTable();
+
+constexpr unsigned lookupKeywordIndex(const char *data, size_t length) {
+  uint64_t h = hashName(data, length);
+  uint16_t index =
+      perfectHashTable.slots[getSlot(h, perfectHashTable.seeds[getBucket(h)])];
+  if (index == EmptySlot ||
+      keywordNames[index] != std::string_view(data, length)) {
+    return EmptySlot;
+  }
+  return index;
+}
+
+constexpr bool verifyPerfectHashTable() {
+  for (unsigned i = 0; i < NumKeywords; ++i) {
+    if (lookupKeywordIndex(keywordNames[i].data(), keywordNames[i].size()) !=
+        i) {
+      return false;
+    }
+  }
+  return true;
+}
+static_assert(verifyPerfectHashTable(), "keyword names must be unique");
+
+} // namespace
+
+IDTy lookupKeyword(llvm::StringRef name) {
+  unsigned index = lookupKeywordIndex(name.data(), name.size());
+  return index == EmptySlot ? 0 : keyword::FirstDirectiveID + index;
+}
+
+llvm::StringRef getKeywordName(IDTy id) {
+  assert(isKeywordID(id));
+  std::string_view name = keywordNames[id - keyword::FirstDirectiveID];
+  return llvm::StringRef(name.data(), name.size());
+}
+
+} // namespace grp
@@ -0,0 +1,106 @@
+#pragma once
+
+#include "machine_mode.h"
+#include "rtl_code.h"
+
+#include "llvm/ADT/StringRef.h"
+
+#include <cassert>
+#include <cstdint>
+
+namespace grp {
+
+// identifier IDs as handed out by IdentifierInterner
+using IDTy = uint64_t;
+
+enum class MDDirective : uint8_t {
+#define DEF_MD_DIRECTIVE(ENUM, NAME) ENUM,
+#include "md_directive.def"
+};
+
+inline constexpr unsigned NumMDDirectives = 0
+#define DEF_MD_DIRECTIVE(ENUM, NAME) +1
+#include "md_directive.def"
+    ;
+
+namespace detail {
+inline constexpr const char *mdDirectiveNames[] = {
+#define DEF_MD_DIRECTIVE(ENUM, NAME) NAME,
+#include "md_directive.def"
+};
+} // namespace detail
+
+inline constexpr const char *getMDDirectiveName(MDDirective directive) {
+  return detail::mdDirectiveNames[static_cast<unsigned>(directive)];
+}
+
+// Keywords are interned with fixed IDs, right after IdentifierInterner's
+// InvalidID: first the .md directives, then the RTL codes, then the machine
+// modes, each in the order of its .def file. So a lead identifier or a mode
+// is classified with a range check, and e.g.
+//   case getKeywordID(RTLCode::DEFINE_INSN):
+// works as a switch label.
+namespace keyword {
+enum : IDTy {
+  FirstDirectiveID = 1,
+  FirstRTLCodeID = FirstDirectiveID + NumMDDirectives,
+  FirstMachineModeID = FirstRTLCodeID + NumRTLCodes,
+  // one past the last keyword, the first ID of a plain identifier
+  EndID = FirstMachineModeID + NumMachineModes,
+};
+} // namespace keyword
+
+constexpr IDTy getKeywordID(MDDirective directive) {
+  return keyword::FirstDirectiveID + static_cast<unsigned>(directive);
+}
+
+constexpr IDTy getKeywordID(RTLCode code) {
+  return keyword::FirstRTLCodeID + static_cast<unsigned>(code);
+}
+
+constexpr IDTy getKeywordID(MachineMode mode) {
+  assert(mode != MachineMode::Invalid);
+  return keyword::FirstMachineModeID + static_cast<unsigned>(mode) - 1;
+}
+
+inline bool isKeywordID(IDTy id) {
+  return id >= keyword::FirstDirectiveID && id < keyword::EndID;
+}
+
+inline bool isMDDirectiveID(IDTy id) {
+  return id >= keyword::FirstDirectiveID && id < keyword::FirstRTLCodeID;
+}
+
+inline bool isRTLCodeID(IDTy id) {
+  return id >= keyword::FirstRTLCodeID && id < keyword::FirstMachineModeID;
+}
+
+inline bool isMachineModeID(IDTy id) {
+  return id >= keyword::FirstMachineModeID && id < keyword::EndID;
+}
+
+inline MDDirective getMDDirective(IDTy id) {
+  assert(isMDDirectiveID(id));
+  return static_cast<MDDirective>(id - keyword::FirstDirectiveID);
+}
+
+inline RTLCode getRTLCode(IDTy id) {
+  assert(isRTLCodeID(id));
+  return static_cast<RTLCode>(id - keyword::FirstRTLCodeID);
+}
+
+// MachineMode::Invalid if `id` does not name a mode known to machine_mode.def
+inline MachineMode getMachineMode(IDTy id) {
+  if (!isMachineModeID(id)) {
+    return MachineMode::Invalid;
+  }
+  return static_cast<MachineMode>(id - keyword::FirstMachineModeID + 1);
+}
+
+// the keyword ID of `name`, 0 if it is not a keyword; a single probe into a
+// perfect hash table built at compile time
+IDTy lookupKeyword(llvm::StringRef name);
+
+llvm::StringRef getKeywordName(IDTy id);
+
+} // namespace grp
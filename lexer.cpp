@@ -1,67 +1,127 @@
 #include "lexer.h"
+#include "simd_scan.h"
+#include "token_pipeline.h"
 
+#include "llvm/Support/ErrorHandling.h"
+
+#include <cstring>
 #include <utility>
 
+#define DEBUG_TYPE "lexer"
+
 namespace grp {
-Token Token::createEOF(const SourceLocation &loc) {
-  return Token(TokenKind::EndOfStream, loc);
+namespace {
+// indexed by TokenKind
+Statistic tokenStats[NumTokenKinds] = {
+    {DEBUG_TYPE, "NumInvalidTokens", "invalid tokens lexed"},
+    {DEBUG_TYPE, "NumIdentifierTokens", "identifier tokens lexed"},
+    {DEBUG_TYPE, "NumStringTokens", "string tokens lexed"},
+    {DEBUG_TYPE, "NumCodeStringTokens", "code string tokens lexed"},
+    {DEBUG_TYPE, "NumNumberTokens", "number tokens lexed"},
+    {DEBUG_TYPE, "NumOpenParenTokens", "'(' tokens lexed"},
+    {DEBUG_TYPE, "NumCloseParenTokens", "')' tokens lexed"},
+    {DEBUG_TYPE, "NumOpenBracketTokens", "'[' tokens lexed"},
+    {DEBUG_TYPE, "NumCloseBracketTokens", "']' tokens lexed"},
+    {DEBUG_TYPE, "NumColonTokens", "':' tokens lexed"},
+    {DEBUG_TYPE, "NumEndOfStreamTokens", "ends of stream lexed"},
+};
+} // namespace
+
+Token Token::createEOF(uint32_t offset) {
+  return Token(TokenKind::EndOfStream, offset);
 }
 
-Token Token::createInvalid(const SourceLocation &loc) {
-  return Token(TokenKind::Invalid, loc);
+Token Token::createInvalid(uint32_t offset) {
+  return Token(TokenKind::Invalid, offset);
 }
 
-Token Token::createIdentifier(IdentifierInterner::IDTy ID,
-                              const SourceLocation &loc) {
-  Token result(TokenKind::Identifier, loc);
+Token Token::createIdentifier(IdentifierInterner::IDTy ID, uint32_t offset) {
+  Token result(TokenKind::Identifier, offset);
   result.id = ID;
   return result;
 }
 
-Token Token::createString(llvm::StringRef str, const SourceLocation &loc) {
-  Token result(TokenKind::String, loc);
-  new (&result.str) llvm::StringRef(str);
+Token Token::createString(uint32_t start, uint32_t length, uint32_t offset) {
+  Token result(TokenKind::String, offset);
+  result.range = {start, length};
   return result;
 }
 
-Token Token::createCodeString(llvm::StringRef str, const SourceLocation &loc) {
-  Token result(TokenKind::CodeString, loc);
-  new (&result.str) llvm::StringRef(str);
+Token Token::createCodeString(uint32_t start, uint32_t length,
+                              uint32_t offset) {
+  Token result(TokenKind::CodeString, offset);
+  result.range = {start, length};
   return result;
 }
 
-Token Token::createNumber(llvm::APInt &&num, const SourceLocation &loc) {
-  Token result(TokenKind::Number, loc);
-  new (&result.num) llvm::APInt(std::move(num));
+Token Token::createNumber(uint32_t start, uint32_t length, uint32_t offset,
+                          bool negative) {
+  Token result(TokenKind::Number, offset);
+  result.range = {start, length};
+  result.negative = negative;
   return result;
 }
 
-Token Token::createDelimiter(TokenKind kind, const SourceLocation &loc) {
-  return Token(kind, loc);
+Token Token::createDelimiter(TokenKind kind, uint32_t offset) {
+  return Token(kind, offset);
+}
+
+// out of line, TokenPipeline is only complete here
+Lexer::Lexer(const llvm::MemoryBuffer &buffer, IdentifierInterner &ii,
+             SourceLocation bufferStart)
+    : buffer(buffer), ii(ii), bufferStart(bufferStart),
+      bufferEnd(buffer.getBufferEnd()), curPos(buffer.getBufferStart()),
+      hasLookahead(false), tokenCounts(tokenStats) {
+  assert(buffer.getBufferSize() <= UINT32_MAX && "token offsets are 32-bit");
+}
+
+Lexer::Lexer(const llvm::MemoryBuffer &buffer, IdentifierInterner &ii,
+             SourceLocation bufferStart, uint32_t beginOffset,
+             uint32_t endOffset)
+    : Lexer(buffer, ii, bufferStart) {
+  assert(beginOffset <= endOffset && endOffset <= buffer.getBufferSize());
+  curPos = buffer.getBufferStart() + beginOffset;
+  bufferEnd = buffer.getBufferStart() + endOffset;
+}
+
+Lexer::Lexer(Lexer &&other) = default;
+
+Lexer::~Lexer() = default;
+
+void Lexer::pretokenize(bool async) {
+  assert(!hasLookahead && !replayBlock && "already lexing");
+  pipeline = std::make_unique<TokenPipeline>(
+      buffer, ii, bufferStart, getOffset(curPos), getOffset(bufferEnd), async);
+  fetchReplayBlock();
 }
 
-SourceLocation Lexer::getSourceLocation() const {
-  return SourceLocation(line, curPos - lineStart + 1, fileID);
+void Lexer::fetchReplayBlock() {
+  replayBlock = pipeline->next();
+  replayIndex = 0;
+  assert(!replayBlock->empty());
 }
 
 void Lexer::skipWhiteSpaces() {
   while (hasMoreChars()) {
     char c = *curPos;
     if (isWhileSpace(c)) {
+      // most runs between tokens are a single space, don't bother the vector
+      // unit for them
       advancePos();
+      if (hasMoreChars() && isWhileSpace(*curPos)) {
+        curPos = simd::skipWhiteSpaceRun(curPos, bufferEnd);
+      }
     } else if (c == ';') {
-      advancePos();
-      while (true) {
-        char c1 = *curPos;
-        if (c1 == '\n') {
-          advancePos();
-          break;
-        }
-        advancePos();
+      // the comment runs till the end of line, jump over it as a whole
+      auto *newLine = static_cast<const char *>(
+          memchr(curPos, '\n', bufferEnd - curPos));
+      if (!newLine) {
+        curPos = bufferEnd;
+        break;
       }
+      curPos = newLine + 1;
     } else if (c == '/') {
       // note: no c-style '\\' '\n' escape here
-      const char *bufferEnd = buffer.getBufferEnd();
       if (curPos + 1 < bufferEnd) {
         if (curPos[1] == '*') {
           bool foundEnd = false;
@@ -76,14 +136,18 @@ void Lexer::skipWhiteSpaces() {
             // FIXME: diag
           }
         } else if (curPos[1] == '/') {
-          for (curPos += 2; curPos < bufferEnd; ++curPos) {
-            if (*curPos == '\n') {
-              ++line;
-              ++curPos;
-              break;
-            }
+          auto *newLine = static_cast<const char *>(
+              memchr(curPos + 2, '\n', bufferEnd - curPos - 2));
+          if (!newLine) {
+            curPos = bufferEnd;
+            break;
           }
+          curPos = newLine + 1;
+        } else {
+          break;
         }
+      } else {
+        break;
       }
     } else {
       break;
@@ -93,18 +157,22 @@ void Lexer::skipWhiteSpaces() {
 
 Token Lexer::lexIdentifierImpl() {
   const char *savedPos = curPos;
-  advancePos();
-  while (hasMoreChars()) {
-    char c = *curPos;
-    if (canContIdentifier(c)) {
-      advancePos();
-      continue;
-    } else {
+  // identifiers never contain escapes, scan them in blocks
+  curPos = simd::skipIdentifierRun(curPos + 1, bufferEnd);
+  // ':' ends an identifier, as in 'code:MODE', but not inside an attribute
+  // reference: 'match_operand:<SWI:imodesuffix>' has the mode
+  // '<SWI:imodesuffix>'
+  while (curPos < bufferEnd && *curPos == ':') {
+    llvm::StringRef run(savedPos, curPos - savedPos);
+    size_t open = run.rfind('<');
+    if (open == llvm::StringRef::npos ||
+        run.find('>', open) != llvm::StringRef::npos) {
       break;
     }
+    curPos = simd::skipIdentifierRun(curPos + 1, bufferEnd);
   }
   auto ID = ii.get(llvm::StringRef(savedPos, curPos - savedPos));
-  return Token::createIdentifier(ID, getSourceLocation());
+  return Token::createIdentifier(ID, getOffset(savedPos));
 }
 
 Token Lexer::lexStringImpl() {
@@ -112,7 +180,7 @@ Token Lexer::lexStringImpl() {
   advancePos();
   while (hasMoreChars()) {
     char c = *curPos;
-    // TODO: escape
+    // skip escapes here, StringPool processes them
     if (c == '\\') {
       advancePos();
       advancePos();
@@ -123,25 +191,30 @@ Token Lexer::lexStringImpl() {
     }
     advancePos();
   }
-  Token result =
-      Token::createString(llvm::StringRef(savedPos + 1, curPos - savedPos - 1),
-                          getSourceLocation());
+  Token result = Token::createString(
+      getOffset(savedPos + 1), curPos - savedPos - 1, getOffset(savedPos));
   advancePos();
   return result;
 }
 
-Token Lexer::lexCodeStringImpl() {
-  const char *savedPos = curPos;
+void Lexer::scanCodeString(bool fastForward) {
   bool insideString = false;
   bool insideChar = false;
   bool insideLineComment = false;
   bool insideBlockComment = false;
   unsigned int blockNestingLevel = 0;
-  while (advanceCodePos()) {
+  while (true) {
+    // the state machine below only reacts to a handful of characters, jump
+    // over everything else
+    if (fastForward) {
+      curPos = simd::skipCodeRun(curPos + 1, bufferEnd) - 1;
+    }
+    if (!advanceCodePos()) {
+      break;
+    }
     char c = *curPos;
     if (c == '\\') {
-      const char *endPos = buffer.getBufferEnd();
-      if (curPos + 1 == endPos) {
+      if (curPos + 1 == bufferEnd) {
         // FIXME: diag
       }
       c = curPos[1];
@@ -222,58 +295,213 @@ Token Lexer::lexCodeStringImpl() {
       insideChar = true;
     }
   }
+}
+
+Token Lexer::lexCodeStringImpl() {
+  const char *savedPos = curPos;
+#ifdef GRP_EXPENSIVE_CHECKS
+  scanCodeString(false);
+  const char *scalarPos = curPos;
+  curPos = savedPos;
+#endif
+  scanCodeString(true);
+#ifdef GRP_EXPENSIVE_CHECKS
+  if (curPos != scalarPos) {
+    llvm::report_fatal_error(
+        "fast-forwarded code string scan disagrees with the scalar one");
+  }
+#endif
   Token result = Token::createCodeString(
-      llvm::StringRef(savedPos + 1, curPos - savedPos - 1),
-      getSourceLocation());
+      getOffset(savedPos + 1), curPos - savedPos - 1, getOffset(savedPos));
   advancePos();
   return result;
 }
 
+uint32_t Lexer::scanCodeStringAt(uint32_t offset, bool fastForward) {
+  curPos = buffer.getBufferStart() + offset;
+  scanCodeString(fastForward);
+  return getOffset(curPos);
+}
+
 Token Lexer::lexNumberImpl() {
-  // TODO: octal and hexadecimal number
-  const char *savedPos = curPos;
-  char c = *curPos;
+  const char *startPos = curPos;
   bool isNegative = false;
-  if (c == '-') {
+  if (*curPos == '-') {
     isNegative = true;
     advancePos();
     skipWhiteSpaces();
-    savedPos = curPos;
   }
-  while (hasMoreChars()) {
-    char c1 = *curPos;
-    if (!isdigit(c1)) {
-      break;
+  const char *literalPos = curPos;
+  if (*curPos == '0' && curPos + 2 < bufferEnd &&
+      (curPos[1] == 'x' || curPos[1] == 'X') && isHexDigit(curPos[2])) {
+    curPos += 3;
+    while (hasMoreChars() && isHexDigit(*curPos)) {
+      ++curPos;
+    }
+  } else {
+    // a '0x' without digits is a 0 followed by an identifier, as with
+    // GCC's reader
+    while (hasMoreChars() && isDigit(*curPos)) {
+      ++curPos;
     }
-    advancePos();
   }
-  if (savedPos == curPos) {
+  if (literalPos == curPos) {
     // FIXME: diag
   }
-  llvm::StringRef str(savedPos, curPos - savedPos);
-  unsigned bitsNeeded = llvm::APInt::getBitsNeeded(str, 10);
-  llvm::APInt num(bitsNeeded, str, 10);
-  if (isNegative) {
+  return Token::createNumber(getOffset(literalPos), curPos - literalPos,
+                             getOffset(startPos), isNegative);
+}
+
+namespace {
+// strip the radix prefix from a number literal, leading '0' means octal and
+// '0x' means hexadecimal
+llvm::StringRef getDigitsAndRadix(llvm::StringRef literal, unsigned &radix) {
+  if (literal.startswith_insensitive("0x")) {
+    radix = 16;
+    return literal.drop_front(2);
+  }
+  if (literal.size() > 1 && literal[0] == '0') {
+    radix = 8;
+    if (literal.find_first_of("89") != llvm::StringRef::npos) {
+      // FIXME: diag
+      radix = 10;
+    }
+    return literal.drop_front(1);
+  }
+  radix = 10;
+  return literal;
+}
+
+unsigned getDigitValue(char c) {
+  if (isDigit(c)) {
+    return c - '0';
+  }
+  return (c | 0x20) - 'a' + 10;
+}
+} // namespace
+
+llvm::APInt Lexer::getNumber(const Token &tok) const {
+  assert(tok.isNumber());
+  llvm::StringRef literal(buffer.getBufferStart() + tok.getRangeStart(),
+                          tok.getRangeLength());
+  unsigned radix;
+  llvm::StringRef digits = getDigitsAndRadix(literal, radix);
+  if (digits.empty()) {
+    // a '-' without digits, see lexNumberImpl
+    return llvm::APInt(1, 0);
+  }
+  // one more bit so that the value reads back the same as a signed number
+  unsigned bitsNeeded = llvm::APInt::getBitsNeeded(digits, radix) + 1;
+  llvm::APInt num(bitsNeeded, digits, radix);
+  if (tok.isNegative()) {
     num.negate();
   }
-  return Token::createNumber(std::move(num), getSourceLocation());
+  return num;
+}
+
+bool Lexer::getSmallNumber(const Token &tok, int64_t &value) const {
+  assert(tok.isNumber());
+  llvm::StringRef literal(buffer.getBufferStart() + tok.getRangeStart(),
+                          tok.getRangeLength());
+  unsigned radix;
+  llvm::StringRef digits = getDigitsAndRadix(literal, radix);
+  uint64_t magnitude = 0;
+  for (char c : digits) {
+    if (__builtin_mul_overflow(magnitude, radix, &magnitude) ||
+        __builtin_add_overflow(magnitude, getDigitValue(c), &magnitude)) {
+      return false;
+    }
+  }
+  uint64_t limit = static_cast<uint64_t>(INT64_MAX) + tok.isNegative();
+  if (magnitude > limit) {
+    return false;
+  }
+  value = tok.isNegative() ? static_cast<int64_t>(0 - magnitude)
+                           : static_cast<int64_t>(magnitude);
+  return true;
+}
+
+bool Lexer::scanTopLevelForm(uint32_t &begin, uint32_t &end) {
+  assert(!hasLookahead && "pre-scan mixed with lexing");
+  skipWhiteSpaces();
+  if (!hasMoreChars()) {
+    return false;
+  }
+  if (*curPos != '(') {
+    // FIXME: diag, only expressions are allowed at the top-level
+  }
+  begin = getOffset(curPos);
+  if (!skipToClose(0)) {
+    // FIXME: diag, unterminated form
+  }
+  end = getOffset(curPos);
+  return true;
 }
 
-Token Lexer::peek() {
-  if (!lookahead) {
-    lookahead = lex();
+void Lexer::skipExpression() {
+  assert(!replayBlock && "skipping needs live lexing");
+  unsigned depth = 1;
+  if (hasLookahead) {
+    hasLookahead = false;
+    switch (lookahead.getKind()) {
+    case TokenKind::OpenParen:
+      ++depth;
+      break;
+    case TokenKind::CloseParen:
+    case TokenKind::EndOfStream:
+      return;
+    default:
+      break;
+    }
+  }
+  if (!skipToClose(depth)) {
+    // FIXME: diag, unterminated form
   }
-  return *lookahead;
 }
 
-Token Lexer::lex() {
-  if (lookahead) {
-    return *std::exchange(lookahead, std::nullopt);
+bool Lexer::skipToClose(unsigned depth) {
+  while (true) {
+    // only parentheses and what may hide them matter here
+    curPos = simd::skipFormRun(curPos, bufferEnd);
+    if (!hasMoreChars()) {
+      return false;
+    }
+    switch (*curPos) {
+    case '(':
+      ++depth;
+      ++curPos;
+      break;
+    case ')':
+      ++curPos;
+      if (depth <= 1) {
+        return true;
+      }
+      --depth;
+      break;
+    case '"':
+      lexStringImpl();
+      break;
+    case '{':
+      lexCodeStringImpl();
+      break;
+    default: {
+      // ';' or '/', a comment unless it is a lone '/'
+      const char *savedPos = curPos;
+      skipWhiteSpaces();
+      if (curPos == savedPos) {
+        ++curPos;
+      }
+    }
+    }
   }
+}
+
+Token Lexer::lexImpl() {
   skipWhiteSpaces();
-  if (curPos == buffer.getBufferEnd()) {
-    return Token::createEOF(getSourceLocation());
+  if (curPos == bufferEnd) {
+    return Token::createEOF(getOffset(curPos));
   }
+  const char *savedPos = curPos;
   char c = *curPos;
   switch (c) {
   case '{':
@@ -300,20 +528,20 @@ Token Lexer::lex() {
       ++curPos;
       return result;
     }
-    return Token::createDelimiter(TokenKind::OpenParen, getSourceLocation());
+    return Token::createDelimiter(TokenKind::OpenParen, getOffset(savedPos));
   }
   case ')':
     ++curPos;
-    return Token::createDelimiter(TokenKind::CloseParen, getSourceLocation());
+    return Token::createDelimiter(TokenKind::CloseParen, getOffset(savedPos));
   case '[':
     ++curPos;
-    return Token::createDelimiter(TokenKind::OpenBracket, getSourceLocation());
+    return Token::createDelimiter(TokenKind::OpenBracket, getOffset(savedPos));
   case ']':
     ++curPos;
-    return Token::createDelimiter(TokenKind::CloseBracket, getSourceLocation());
+    return Token::createDelimiter(TokenKind::CloseBracket, getOffset(savedPos));
   case ':':
     ++curPos;
-    return Token::createDelimiter(TokenKind::Colon, getSourceLocation());
+    return Token::createDelimiter(TokenKind::Colon, getOffset(savedPos));
   default:
     if (canStartIdentifier(c)) {
       return lexIdentifierImpl();
@@ -324,6 +552,6 @@ Token Lexer::lex() {
   }
   assert(false && "unknown how to handle character when lexing");
   advancePos();
-  return Token::createInvalid(getSourceLocation());
+  return Token::createInvalid(getOffset(savedPos));
 }
 } // namespace grp
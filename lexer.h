@@ -1,244 +1,185 @@
 #pragma once
 
+#include "char_class.h"
+#include "identifier_interner.h"
+#include "source_location.h"
+#include "stats.h"
+#include "token_stream.h"
+
 #include "llvm/ADT/APInt.h"
-#include "llvm/ADT/DenseMap.h"
 #include "llvm/ADT/StringRef.h"
 #include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Support/SourceMgr.h"
 
-#include <cctype>
 #include <cstdint>
-#include <optional>
+#include <memory>
 
 namespace grp {
 
-inline bool isWhileSpace(char c) {
-  // TODO: '\r'
-  return isspace(c);
-}
-
-inline bool canStartIdentifier(char c) {
-  return c == '?' || c == '<' || c == '_' || c == '$' || isalpha(c);
-}
-
-inline bool canContIdentifier(char c) {
-  return c == '*' || c == ':' || c == '>' || canStartIdentifier(c) ||
-         isdigit(c);
-}
-
-inline bool canStartNumber(char c) {
-  // FIXME: only decimial digit now
-  return c == '-' || isdigit(c);
-}
-
-// FIXME: more sophisticated source location implementation, currently this is
-// enough
-class SourceLocation {
-  // line count and columnt count starts with 1
-  // 0 means invalid value
-  uint64_t line, column;
-  // as known to llvm::SourceMge
-  unsigned fileID;
-
-public:
-  // 0 is a invalid fileID for SourceMgr
-  SourceLocation() : line(0), column(0), fileID(0) {}
-  SourceLocation(uint64_t line, uint64_t column, unsigned fileID)
-      : line(line), column(column), fileID(fileID) {}
-  uint64_t getLine() const { return line; }
-  uint64_t getColumn() const { return column; }
-  unsigned getFileID() const { return fileID; }
-};
-
-enum class TokenKind {
-  Invalid,
-  Identifier,
-  String,
-  CodeString,
-  Number,
-  OpenParen,
-  CloseParen,
-  OpenBracket,
-  CloseBracket,
-  Colon,
-  EndOfStream
-};
-
-class IdentifierInterner {
-public:
-  using IDTy = uint64_t;
-  enum : uint64_t { InvalidID = 0 };
-
-private:
-  IDTy lastID = InvalidID;
-  llvm::DenseMap<llvm::StringRef, IDTy> internedIDs;
-
-public:
-  IDTy get(llvm::StringRef str) {
-    auto &val = internedIDs[str];
-    if (val == InvalidID) {
-      return val = ++lastID;
-    } else {
-      return val;
-    }
-  }
-};
-
-using IDTy = IdentifierInterner::IDTy;
-
-class Token {
-private:
-  void destructContent() {
-    if (kind == TokenKind::String) {
-      str.~StringRef();
-    } else if (kind == TokenKind::Number) {
-      num.~APInt();
-    }
-  }
-  void constructContentFrom(const Token &other) {
-    switch (other.kind) {
-    default:
-      assert(false && "unknown token kind");
-    case TokenKind::Identifier:
-      id = other.id;
-      break;
-    case TokenKind::String:
-    case TokenKind::CodeString:
-      new (&str) llvm::StringRef(other.str);
-      break;
-    case TokenKind::Number:
-      new (&num) llvm::APInt(other.num);
-    case TokenKind::EndOfStream:
-    case TokenKind::OpenParen:
-    case TokenKind::CloseParen:
-    case TokenKind::OpenBracket:
-    case TokenKind::CloseBracket:
-    case TokenKind::Colon:
-      break;
-    }
-  }
-  TokenKind kind;
-  union {
-    int placeHolder;
-    IdentifierInterner::IDTy id;
-    llvm::StringRef str;
-    llvm::APInt num;
-  };
-  SourceLocation loc;
-
-public:
-  Token() : kind(TokenKind::Invalid), loc() {}
-  Token(TokenKind kind, const SourceLocation &loc)
-      : kind(kind), placeHolder(0), loc(loc) {}
-  ~Token() { destructContent(); }
-  Token(const Token &other) : kind(other.kind), loc(other.loc) {
-    constructContentFrom(other);
-  }
-  Token &operator=(const Token &other) {
-    destructContent();
-    kind = other.kind;
-    loc = other.loc;
-    constructContentFrom(other);
-    return *this;
-  }
-  TokenKind getKind() const { return kind; }
-  bool isValid() const { return kind != TokenKind::Invalid; }
-  bool isAnyString() const {
-    return kind == TokenKind::String || kind == TokenKind::CodeString;
-  }
-  bool isPlainString() const { return kind == TokenKind::String; }
-  bool isCodeString() const { return kind == TokenKind::CodeString; }
-  bool isIdentifier() const { return kind == TokenKind::Identifier; }
-  bool isNumber() const { return kind == TokenKind::Number; }
-  bool isEOS() const { return kind == TokenKind::EndOfStream; }
-  IdentifierInterner::IDTy getID() const {
-    assert(kind == TokenKind::Identifier);
-    return id;
-  }
-  llvm::StringRef getString() const {
-    assert(kind == TokenKind::String || kind == TokenKind::CodeString);
-    return str;
-  }
-  const llvm::APInt &getNum() const {
-    assert(kind == TokenKind::Number);
-    return num;
-  }
-  llvm::APInt &&takeNum() { return std::move(num); }
-  const SourceLocation &getLoc() const { return loc; }
-  static Token createEOF(const SourceLocation &loc);
-  static Token createInvalid(const SourceLocation &loc);
-  static Token createIdentifier(IdentifierInterner::IDTy ID,
-                                const SourceLocation &loc);
-  static Token createString(llvm::StringRef str, const SourceLocation &loc);
-  static Token createCodeString(llvm::StringRef str, const SourceLocation &loc);
-  static Token createNumber(llvm::APInt &&num, const SourceLocation &loc);
-  static Token createDelimiter(TokenKind kind, const SourceLocation &loc);
-};
+class TokenPipeline;
 
 // For RTL, `include` is handled on the parser level, so this class only a
 // single file
 class Lexer {
   const llvm::MemoryBuffer &buffer;
   IdentifierInterner &ii;
-  // as known to llvm::SourceMgr
-  unsigned fileID;
-  int64_t line;
+  // location of the first character of the buffer
+  SourceLocation bufferStart;
+  // end of the range being lexed, usually the end of the buffer
+  const char *bufferEnd;
   const char *curPos;
-  const char *lineStart;
-  std::optional<Token> lookahead;
-  bool hasMoreChars() const { return curPos < buffer.getBufferEnd(); }
+  Token lookahead;
+  bool hasLookahead;
+  // replay mode: tokens come from the blocks `pipeline` lexed ahead of time,
+  // replayIndex is always valid in replayBlock
+  std::unique_ptr<TokenPipeline> pipeline;
+  std::unique_ptr<TokenStream> replayBlock;
+  size_t replayIndex = 0;
+  // tokens lexed by kind, for -stats
+  StatCounters<TokenKind, NumTokenKinds> tokenCounts;
+  void fetchReplayBlock();
+  void advanceReplay() {
+    // like the live lexer, keep on returning the end of stream
+    if (replayBlock->getKind(replayIndex) != TokenKind::EndOfStream &&
+        ++replayIndex == replayBlock->size()) {
+      fetchReplayBlock();
+    }
+  }
+  Token replayNext() {
+    Token result = (*replayBlock)[replayIndex];
+    advanceReplay();
+    return result;
+  }
+  uint32_t getOffset(const char *pos) const {
+    return pos - buffer.getBufferStart();
+  }
+  bool hasMoreChars() const { return curPos < bufferEnd; }
   void skipWhiteSpaces();
   void advancePos() {
     // TODO: C-style escape-newline ???
-    char c = *curPos;
     ++curPos;
-    if (c == '\n') {
-      ++line;
-      lineStart = curPos;
-    }
   }
   // return if we have more characters to look-at
   bool advanceCodePos() {
-    char c = *curPos;
     ++curPos;
-    if (c == '\n') {
-      ++line;
-    }
     if (!hasMoreChars()) {
       return false;
     }
-    c = *curPos;
+    char c = *curPos;
     if (c == '\\') {
       const char *pos1 = curPos + 1;
-      const char *posEnd = buffer.getBufferEnd();
-      while (pos1 < posEnd) {
+      while (pos1 < bufferEnd) {
         char c1 = *pos1;
         if (c1 == '\n') {
           curPos = pos1 + 1;
-          ++line;
           return hasMoreChars();
         }
-        if (!isspace(c1)) {
+        if (!isWhileSpace(c1)) {
           break;
         }
+        ++pos1;
       }
     }
     return true;
   }
   Token lexIdentifierImpl();
   Token lexStringImpl();
+  // move curPos from the opening '{' of a code string to its closing '}',
+  // `fastForward` lets the scan skip uninteresting characters in blocks
+  void scanCodeString(bool fastForward);
   Token lexCodeStringImpl();
   Token lexNumberImpl();
+  Token lexImpl();
+  // with `depth` parentheses open (0 before a form), scan past the ')'
+  // closing the outermost one, skipping what may hide parentheses; return
+  // false if the range ends first
+  bool skipToClose(unsigned depth);
 
 public:
   Lexer(const llvm::MemoryBuffer &buffer, IdentifierInterner &ii,
-        unsigned fileID)
-      : buffer(buffer), ii(ii), fileID(fileID), line(0),
-        curPos(buffer.getBufferStart()), lineStart(curPos),
-        lookahead(std::nullopt) {}
-  SourceLocation getSourceLocation() const;
-  Token lex();
-  Token peek();
+        SourceLocation bufferStart);
+  // only lex the characters in [beginOffset, endOffset) of the buffer, e.g. a
+  // chunk of top-level forms; token offsets stay relative to the buffer
+  Lexer(const llvm::MemoryBuffer &buffer, IdentifierInterner &ii,
+        SourceLocation bufferStart, uint32_t beginOffset, uint32_t endOffset);
+  Lexer(Lexer &&other);
+  ~Lexer();
+  // switch to replay mode: the rest of the range is lexed ahead of time by a
+  // TokenPipeline, in `async` mode on a thread of its own
+  void pretokenize(bool async);
+  bool isReplaying() const { return replayBlock != nullptr; }
+  Token lex() {
+    if (replayBlock) {
+      return replayNext();
+    }
+    if (hasLookahead) {
+      hasLookahead = false;
+      return lookahead;
+    }
+    Token result = lexImpl();
+    tokenCounts.count(result.getKind());
+    return result;
+  }
+  Token peek() {
+    if (replayBlock) {
+      return (*replayBlock)[replayIndex];
+    }
+    if (!hasLookahead) {
+      lookahead = lexImpl();
+      tokenCounts.count(lookahead.getKind());
+      hasLookahead = true;
+    }
+    return lookahead;
+  }
+  // the kind of the next token; in replay mode it is read from the kinds
+  // of the block alone, no Token is put together
+  TokenKind peekKind() {
+    if (replayBlock) {
+      return replayBlock->getKind(replayIndex);
+    }
+    return peek().getKind();
+  }
+  // drop the next token, e.g. a delimiter whose kind was peeked
+  void skip() {
+    if (replayBlock) {
+      advanceReplay();
+      return;
+    }
+    lex();
+  }
+  // for lexers whose tokens aren't part of the parse, e.g. the prefetch
+  // scans: keep the tokens so far out of the -stats counters, return how
+  // many there were
+  unsigned discardTokenCounts() { return tokenCounts.discard(); }
+  // not meaningful in replay mode
   const char *getCurPos() const { return curPos; }
+  const llvm::MemoryBuffer &getBuffer() const { return buffer; }
+  SourceLocation getSourceLocation(const Token &tok) const {
+    return bufferStart.getLocWithOffset(tok.getOffset());
+  }
+  // the characters of a (code) string token, without quotes/braces
+  llvm::StringRef getString(const Token &tok) const {
+    assert(tok.isAnyString());
+    return llvm::StringRef(buffer.getBufferStart() + tok.getRangeStart(),
+                           tok.getRangeLength());
+  }
+  // materialize the value of a number token
+  llvm::APInt getNumber(const Token &tok) const;
+  // the value of a number token if it fits in an int64_t, without going
+  // through APInt; return false on overflow
+  bool getSmallNumber(const Token &tok, int64_t &value) const;
+  // pre-scan mode: find the offsets [begin, end) of the next top-level form
+  // without producing tokens, skipping comments, strings and code blocks the
+  // same way lex() does; return false at the end of the range. Must not be
+  // mixed with lex()/peek().
+  bool scanTopLevelForm(uint32_t &begin, uint32_t &end);
+  // the offset of the '}' closing the code string whose '{' is at `offset`
+  // (or the end of the range), found by `fastForward`ing with the scanners
+  // of the active simd::ISA or one character at a time, to check the one
+  // against the other. Must not be mixed with lex()/peek().
+  uint32_t scanCodeStringAt(uint32_t offset, bool fastForward);
+  // skip the rest of the expression whose '(' has been lexed, past its ')',
+  // the same way scanTopLevelForm() does; not in replay mode
+  void skipExpression();
 };
 } // namespace grp
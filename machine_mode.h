@@ -1,5 +1,59 @@
 #pragma once
 
-enum class MachineMode {
+#include <cstdint>
+
+namespace grp {
+
+// mode classes, as in GCC's mode-classes.def
+enum class ModeClass : uint8_t {
+  MODE_RANDOM,
+  MODE_CC,
+  MODE_INT,
+  MODE_PARTIAL_INT,
+  MODE_FRACT,
+  MODE_UFRACT,
+  MODE_ACCUM,
+  MODE_UACCUM,
+  MODE_FLOAT,
+  MODE_DECIMAL_FLOAT,
+  MODE_COMPLEX_INT,
+  MODE_COMPLEX_FLOAT,
+  MODE_VECTOR_INT,
+  MODE_VECTOR_FLOAT,
+};
+
+enum class MachineMode : uint8_t {
   Invalid,
+#define DEF_MACHINE_MODE(NAME, CLASS) NAME,
+#include "machine_mode.def"
+};
+
+// not counting Invalid
+inline constexpr unsigned NumMachineModes = 0
+#define DEF_MACHINE_MODE(NAME, CLASS) +1
+#include "machine_mode.def"
+    ;
+
+namespace detail {
+inline constexpr const char *machineModeNames[] = {
+    "<invalid>",
+#define DEF_MACHINE_MODE(NAME, CLASS) #NAME,
+#include "machine_mode.def"
+};
+
+inline constexpr ModeClass modeClasses[] = {
+    ModeClass::MODE_RANDOM,
+#define DEF_MACHINE_MODE(NAME, CLASS) ModeClass::CLASS,
+#include "machine_mode.def"
 };
+} // namespace detail
+
+inline constexpr const char *getMachineModeName(MachineMode mode) {
+  return detail::machineModeNames[static_cast<unsigned>(mode)];
+}
+
+inline constexpr ModeClass getModeClass(MachineMode mode) {
+  return detail::modeClasses[static_cast<unsigned>(mode)];
+}
+
+} // namespace grp
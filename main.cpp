@@ -1,6 +1,8 @@
 #include "parser.h"
 
+#include "llvm/ADT/Statistic.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/raw_ostream.h"
 
 #include <string>
 
@@ -8,12 +10,68 @@ namespace cl = llvm::cl;
 
 cl::opt<std::string> inputFileName(cl::Positional, cl::desc("<input-file>"),
                                    cl::Required);
+cl::opt<unsigned> numThreads("j",
+                             cl::desc("parse included files on this many "
+                                      "threads"),
+                             cl::init(1));
+cl::opt<unsigned>
+    chunkSize("chunk-size",
+              cl::desc("split files bigger than this many bytes into chunks "
+                       "parsed in parallel, 0 keeps files whole"),
+              cl::init(256 * 1024));
+cl::opt<grp::ParserOption::TokenMode> tokenMode(
+    "token-mode", cl::desc("how tokens get from the lexer to the parser"),
+    cl::values(clEnumValN(grp::ParserOption::TokenMode::Live, "live",
+                          "lex on demand"),
+               clEnumValN(grp::ParserOption::TokenMode::Pretokenized,
+                          "pretokenized", "lex whole files first"),
+               clEnumValN(grp::ParserOption::TokenMode::Pipelined,
+                          "pipelined", "lex on a thread of its own")),
+    cl::init(grp::ParserOption::TokenMode::Live));
+cl::opt<bool> hashConsing("hash-consing",
+                          cl::desc("share structurally identical subtrees"));
+cl::opt<std::string>
+    cacheDir("cache-dir",
+             cl::desc("keep the parse result in this directory, and reuse it "
+                      "while the input files are unchanged"));
+cl::opt<unsigned>
+    prefetchThreads("prefetch-threads",
+                    cl::desc("read included files ahead on this many threads "
+                             "when parsing sequentially"),
+                    cl::init(0));
+cl::opt<bool> timeReport("time-report",
+                         cl::desc("print the time spent in each phase of the "
+                                  "parse and on each file"));
+// -stats comes with LLVM
+
 int main(int argc, const char *argv[]) {
   cl::ParseCommandLineOptions(argc, argv);
   grp::ParserOption option =
       grp::ParserOption::createDefaultOption(inputFileName);
-  grp::ParserContext context(option);
-  grp::CSTParser parser(context);
-  while (auto *result = parser.parseTopCST()) {
+  option.numThreads = numThreads;
+  option.chunkSize = chunkSize;
+  option.tokenMode = tokenMode;
+  option.hashConsing = hashConsing;
+  option.cacheDir = cacheDir;
+  option.prefetchThreads = prefetchThreads;
+  option.timeReport = timeReport;
+  {
+    grp::ParserContext context(option);
+    {
+      grp::CSTParser parser(context);
+      while (auto *result = parser.parseTopCST()) {
+      }
+    }
+    if (timeReport) {
+      context.getTimeReport()->print(llvm::errs());
+    }
+  }
+  // the counters are complete once the parsers and the context are gone
+  if (llvm::AreStatisticsEnabled()) {
+#ifdef GRP_ENABLE_STATS
+    llvm::PrintStatistics(llvm::errs());
+#else
+    llvm::errs() << "-stats: built without GRP_ENABLE_STATS\n";
+#endif
   }
 }
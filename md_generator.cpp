@@ -0,0 +1,399 @@
+#include "md_generator.h"
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <vector>
+
+namespace grp {
+
+namespace {
+
+// splitmix64: unlike the distributions of <random>, the same sequence on
+// every platform
+class Random {
+  uint64_t state;
+
+public:
+  explicit Random(uint64_t seed) : state(seed) {}
+  uint64_t next() {
+    uint64_t z = (state += 0x9e3779b97f4a7c15);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+    return z ^ (z >> 31);
+  }
+  unsigned below(unsigned n) { return next() % n; }
+  bool chance(double p) { return (next() >> 11) * 0x1.0p-53 < p; }
+  template <typename T, size_t N> const T &pick(const T (&items)[N]) {
+    return items[below(N)];
+  }
+};
+
+// with the `<ITER:attr>` spelling sse.md uses for modes
+const char *const modes[] = {"QI",   "HI",   "SI",   "DI",
+                             "TI",   "SF",   "DF",   "XF",
+                             "V4SI", "V2DI", "CC",   "V4SF",
+                             "V8HI", "SWI",  "<MODE>", "<SWI:ssescalarmode>"};
+const char *const unaryCodes[] = {"neg",         "not",      "abs",
+                                  "zero_extend", "truncate", "popcount",
+                                  "sign_extend", "sqrt",     "float"};
+const char *const binaryCodes[] = {
+    "plus", "minus",    "mult",     "and",  "ior",  "xor",    "ashift",
+    "rotate", "lshiftrt", "ashiftrt", "smax", "umin", "compare", "div"};
+const char *const predicates[] = {
+    "register_operand",  "nonimmediate_operand", "general_operand",
+    "memory_operand",    "immediate_operand",    "const_int_operand",
+    "x86_64_general_operand", "vector_operand", "ext_register_operand"};
+const char *const constraints[] = {"r",  "=r", "rm", "=rm", "x", "=x",
+                                   "m",  "n",  "i",  "0",   "?r", "*x",
+                                   "=&r", "r,m", "=r,r", "rn"};
+const char *const conditions[] = {
+    "",
+    "TARGET_64BIT",
+    "TARGET_SSE2",
+    "TARGET_AVX && !TARGET_PARTIAL_REG_STALL",
+    "reload_completed",
+    "ix86_binary_operator_ok (PLUS, <MODE>mode, operands)"};
+const char *const mnemonics[] = {"add", "sub", "imul", "and",    "or",
+                                 "xor", "sal", "shr",  "mov",    "lea",
+                                 "test", "cmp", "vpaddd", "movaps"};
+const char *const attrTypes[] = {"alu",    "imov", "sse",  "ssemov", "ishift",
+                                 "imul",   "idiv", "fmov", "other"};
+
+class Generator {
+  const MDGeneratorOption &option;
+  Random random;
+  // of the file being generated
+  std::string out;
+  // makes the names unique
+  unsigned nextName = 0;
+  // the last define_mode_iterator of the file, empty before the first; the
+  // files aren't parsed in the order they are generated
+  std::string iterator;
+
+  void newLine(unsigned indent) {
+    out += '\n';
+    out.append(indent, ' ');
+  }
+  void name(const char *prefix) {
+    out += prefix;
+    out += llvm::utostr(nextName++);
+  }
+  void mode();
+  void leaf(unsigned &numOperands);
+  void rtx(unsigned depth, unsigned indent, unsigned &numOperands);
+  void codeBlock(bool returnsTemplate);
+  void insn();
+  // an insn using the last mode iterator and a vector one, with an attribute
+  // only the vector one has values for, as in sse.md
+  void vectorInsn();
+  void expand();
+
+public:
+  Generator(const MDGeneratorOption &option)
+      : option(option), random(option.seed) {}
+  std::string &getOutput() { return out; }
+  void startFile() {
+    out.clear();
+    iterator.clear();
+  }
+  // append a top-level form (or a comment)
+  void form();
+};
+
+void Generator::mode() {
+  // now and then the wider mode of the last iterator, to be expanded
+  if (!iterator.empty() && random.chance(0.05)) {
+    out += '<';
+    out += iterator;
+    out += ':';
+    out += iterator;
+    out += "_wider>";
+    return;
+  }
+  out += random.pick(modes);
+}
+
+void Generator::leaf(unsigned &numOperands) {
+  switch (random.below(5)) {
+  case 0:
+  case 1:
+    out += "(match_operand:";
+    mode();
+    out += ' ';
+    out += llvm::utostr(numOperands++);
+    out += " \"";
+    out += random.pick(predicates);
+    out += "\" \"";
+    out += random.pick(constraints);
+    out += "\")";
+    return;
+  case 2:
+    out += "(const_int ";
+    if (random.chance(0.2)) {
+      out += '-';
+    }
+    out += llvm::utostr(random.below(random.chance(0.1) ? 1u << 31 : 256));
+    out += ')';
+    return;
+  case 3:
+    out += random.chance(0.5) ? "(reg:CC FLAGS_REG)" : "(reg:SI 17)";
+    return;
+  default:
+    if (!numOperands) {
+      out += "(pc)";
+      return;
+    }
+    out += "(match_dup ";
+    out += llvm::utostr(random.below(numOperands));
+    out += ')';
+  }
+}
+
+void Generator::rtx(unsigned depth, unsigned indent, unsigned &numOperands) {
+  if (depth <= 1 || random.chance(0.2)) {
+    leaf(numOperands);
+    return;
+  }
+  // break the lines of the upper levels, like GCC's .md files
+  bool breakLines = indent < 16;
+  unsigned choice = random.below(10);
+  if (choice == 0 && depth > 2) {
+    out += "(vec_select:V4SF";
+    newLine(indent + 2);
+    rtx(depth - 1, indent + 2, numOperands);
+    newLine(indent + 2);
+    out += "(parallel [";
+    unsigned numElements = 1 + random.below(4);
+    for (unsigned i = 0; i < numElements; ++i) {
+      out += i ? " (const_int " : "(const_int ";
+      out += llvm::utostr(i);
+      out += ')';
+    }
+    out += "]))";
+    return;
+  }
+  const char *code;
+  unsigned numSubforms;
+  if (choice == 1) {
+    code = "if_then_else";
+    numSubforms = 3;
+  } else if (choice < 4) {
+    code = random.pick(unaryCodes);
+    numSubforms = 1;
+  } else {
+    code = random.pick(binaryCodes);
+    numSubforms = 2;
+  }
+  out += '(';
+  out += code;
+  out += ':';
+  mode();
+  for (unsigned i = 0; i < numSubforms; ++i) {
+    if (breakLines) {
+      newLine(indent + 2);
+    } else {
+      out += ' ';
+    }
+    rtx(depth - 1, indent + 2, numOperands);
+  }
+  out += ')';
+}
+
+void Generator::codeBlock(bool returnsTemplate) {
+  out += "{";
+  unsigned numStatements = 1 + random.below(6);
+  if (returnsTemplate) {
+    out += "\n  switch (get_attr_type (insn))\n    {";
+    for (unsigned i = 0; i < numStatements; ++i) {
+      out += "\n    case TYPE_";
+      out += llvm::StringRef(random.pick(attrTypes)).upper();
+      out += ":\n      if (REG_P (operands[";
+      out += llvm::utostr(random.below(3));
+      out += "]))\n\treturn \"";
+      out += random.pick(mnemonics);
+      out += "{l}\\t{%2, %0|%0, %2}\";\n      return \"#\";";
+    }
+    out += "\n    default:\n      gcc_unreachable ();\n    }\n}";
+    return;
+  }
+  for (unsigned i = 0; i < numStatements; ++i) {
+    out += "\n  operands[";
+    out += llvm::utostr(random.below(4));
+    out += "] = force_reg (<MODE>mode, operands[";
+    out += llvm::utostr(random.below(4));
+    out += "]); /* keep {braces} \"balanced\" */";
+  }
+  out += "\n  DONE;\n}";
+}
+
+void Generator::insn() {
+  out += "(define_insn \"*";
+  name(random.pick(mnemonics));
+  out += "_<mode>\"\n  [(set ";
+  unsigned numOperands = 0;
+  leaf(numOperands);
+  out += "\n\t";
+  rtx(option.maxDepth > 2 ? option.maxDepth - 2 : 1, 8, numOperands);
+  out += ')';
+  if (random.chance(0.5)) {
+    out += "\n   (clobber (reg:CC FLAGS_REG))";
+  }
+  out += "]\n  \"";
+  out += random.pick(conditions);
+  out += "\"\n  ";
+  if (random.chance(option.codeRatio)) {
+    codeBlock(true);
+  } else {
+    out += '"';
+    out += random.pick(mnemonics);
+    out += "{<imodesuffix>}\\t{%2, %0|%0, %2}\"";
+  }
+  out += "\n  [(set_attr \"type\" \"";
+  out += random.pick(attrTypes);
+  out += "\")\n   (set_attr \"mode\" \"";
+  out += random.pick(modes);
+  out += "\")])\n\n";
+}
+
+void Generator::vectorInsn() {
+  std::string vector = "VI" + llvm::utostr(nextName++);
+  out += "(define_mode_iterator ";
+  out += vector;
+  out += " [V4SI V2DI])\n\n(define_mode_attr ";
+  out += vector;
+  out += "_scalar [(V4SI \"SI\") (V2DI \"DI\")])\n\n";
+  // `<mode>` is the scalar iterator's, `<VIn_scalar>` the vector one's
+  out += "(define_insn \"*vec_extract_<";
+  out += vector;
+  out += "_scalar>_<mode>\"\n  [(set (match_operand:";
+  out += iterator;
+  out += " 0 \"register_operand\" \"=r\")\n\t(vec_select:<";
+  out += vector;
+  out += "_scalar>\n\t  (match_operand:";
+  out += vector;
+  out += " 1 \"register_operand\" \"x\")\n\t  (parallel [(const_int 0)])))]";
+  out += "\n  \"TARGET_SSE2\"\n  \"vmov<";
+  out += vector;
+  out += "_scalar>\\t{%1, %0|%0, %1}\")\n\n";
+}
+
+void Generator::expand() {
+  out += "(define_expand \"";
+  name("expand");
+  out += "<mode>3\"\n  [(set ";
+  unsigned numOperands = 0;
+  leaf(numOperands);
+  out += "\n\t";
+  rtx(option.maxDepth > 2 ? option.maxDepth - 2 : 1, 8, numOperands);
+  out += ")]\n  \"";
+  out += random.pick(conditions);
+  out += "\"\n  ";
+  if (random.chance(option.codeRatio)) {
+    codeBlock(false);
+  } else {
+    out += "\"\"";
+  }
+  out += ")\n\n";
+}
+
+void Generator::form() {
+  unsigned choice = random.below(100);
+  if (choice < 55) {
+    insn();
+  } else if (choice < 70) {
+    expand();
+  } else if (choice < 78) {
+    iterator = "SWI" + llvm::utostr(nextName++);
+    out += "(define_mode_iterator ";
+    out += iterator;
+    out += " [QI HI SI (DI \"TARGET_64BIT\")])\n\n(define_mode_attr ";
+    out += iterator;
+    out += "_wider [(QI \"HI\") (HI \"SI\") (SI \"DI\") (DI \"TI\")])\n\n";
+    vectorInsn();
+  } else if (choice < 83) {
+    out += "(define_constants\n  [";
+    unsigned numConstants = 1 + random.below(8);
+    for (unsigned i = 0; i < numConstants; ++i) {
+      out += i ? "\n   (" : "(";
+      name("UNSPEC_");
+      out += ' ';
+      out += llvm::utostr(random.below(1024));
+      out += ')';
+    }
+    out += "])\n\n";
+  } else if (choice < 90) {
+    out += "(define_attr \"";
+    name("attr");
+    out += "\" \"alu,imov,sse,other\"\n  (const_string \"other\"))\n\n";
+  } else {
+    out += ";; ";
+    name("Synthetic comment ");
+    out += ", to be skipped by the lexer like the real ones.\n";
+  }
+}
+
+} // namespace
+
+std::error_code generateMD(llvm::StringRef dir, const MDGeneratorOption &option,
+                           std::string &mainFile) {
+  // a complete tree, file i includes files i * fanout + 1 ... i * fanout +
+  // fanout
+  unsigned numFiles = 1;
+  std::vector<unsigned> levels{0};
+  if (option.includeFanout) {
+    for (unsigned i = 0; i < numFiles; ++i) {
+      if (levels[i] == option.includeDepth) {
+        continue;
+      }
+      numFiles += option.includeFanout;
+      levels.resize(numFiles, levels[i] + 1);
+    }
+  }
+  auto getFileName = [](unsigned i) {
+    return i ? "gen" + llvm::utostr(i) + ".md" : std::string("main.md");
+  };
+  uint64_t budget = option.size / numFiles;
+  Generator generator(option);
+  std::string &out = generator.getOutput();
+  for (unsigned i = 0; i < numFiles; ++i) {
+    generator.startFile();
+    out += ";; Synthetic machine description, generated by grp-bench.\n\n";
+    unsigned numChildren =
+        levels[i] < option.includeDepth ? option.includeFanout : 0;
+    unsigned nextChild = 0;
+    auto includeChild = [&] {
+      out += "(include \"";
+      out += getFileName(i * option.includeFanout + ++nextChild);
+      out += "\")\n\n";
+    };
+    while (out.size() < budget) {
+      // spread the includes over the file
+      if (nextChild < numChildren &&
+          out.size() >= (nextChild + 1) * budget / (numChildren + 1)) {
+        includeChild();
+      } else {
+        generator.form();
+      }
+    }
+    while (nextChild < numChildren) {
+      includeChild();
+    }
+    llvm::SmallString<128> path(dir);
+    llvm::sys::path::append(path, getFileName(i));
+    std::error_code ec;
+    llvm::raw_fd_ostream os(path, ec);
+    if (ec) {
+      return ec;
+    }
+    os << out;
+    if (!i) {
+      mainFile = std::string(path.str());
+    }
+  }
+  return std::error_code();
+}
+
+} // namespace grp
@@ -0,0 +1,34 @@
+#pragma once
+
+#include "llvm/ADT/StringRef.h"
+
+#include <cstdint>
+#include <string>
+#include <system_error>
+
+namespace grp {
+
+struct MDGeneratorOption {
+  // total size of the files, roughly
+  uint64_t size = 4 << 20;
+  // deepest nesting of expressions/vectors in an RTL template
+  unsigned maxDepth = 6;
+  // share of the define_insns and define_expands whose output template or
+  // preparation statements are a code block rather than a string
+  double codeRatio = 0.3;
+  // files included by each file, 0 puts everything in the main file
+  unsigned includeFanout = 0;
+  // levels of includes below the main file
+  unsigned includeDepth = 2;
+  uint64_t seed = 1;
+};
+
+// Write a synthetic machine description into `dir`: define_insns,
+// define_expands, iterators, attributes and constants made up from the RTL
+// codes and modes GCC uses, with comments and code blocks, and a tree of
+// included files. The same option always gives the same files. The main file
+// is put in `mainFile`.
+std::error_code generateMD(llvm::StringRef dir, const MDGeneratorOption &option,
+                           std::string &mainFile);
+
+} // namespace grp
@@ -1,10 +1,39 @@
 #include "parser.h"
 
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/StringMap.h"
 #include "llvm/Support/Path.h"
 #include "llvm/Support/SMLoc.h"
 #include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/xxhash.h"
+
+#include <array>
+
+#define DEBUG_TYPE "parser"
+
+GRP_STATISTIC(NumFilesRead, "files read");
+GRP_STATISTIC(NumBytesRead, "bytes read");
+GRP_STATISTIC(NumIncludes, "includes resolved");
+GRP_STATISTIC(NumPrefetchTokens, "tokens lexed by the prefetch scans");
+GRP_STATISTIC(NumBytesAllocated, "bytes allocated for the CSTs");
 
 namespace grp {
+namespace {
+// indexed by CST_Kind
+Statistic nodeStats[NumCSTKinds] = {
+    {DEBUG_TYPE, "NumInvalidNodes", "invalid nodes created"},
+    {DEBUG_TYPE, "NumExpressionNodes", "expression nodes created"},
+    {DEBUG_TYPE, "NumIdentifierNodes", "identifier nodes created"},
+    {DEBUG_TYPE, "NumIntNodes", "integer nodes created"},
+    {DEBUG_TYPE, "NumHostIntNodes", "host integer nodes created"},
+    {DEBUG_TYPE, "NumStringNodes", "string nodes created"},
+    {DEBUG_TYPE, "NumCodeStringNodes", "code string nodes created"},
+    {DEBUG_TYPE, "NumVectorNodes", "vector nodes created"},
+    {DEBUG_TYPE, "NumEndOfStreamNodes", "end of stream nodes created"},
+};
+} // namespace
+
 ParserOption
 ParserOption::createDefaultOption(const std::string mainInputFile) {
   ParserOption result;
@@ -15,93 +44,150 @@ ParserOption::createDefaultOption(const std::string mainInputFile) {
 }
 
 ParserContext::ParserContext(const ParserOption &option)
-    : option(option), fs(llvm::vfs::createPhysicalFileSystem()) {}
+    : option(option), fs(llvm::vfs::createPhysicalFileSystem()),
+      includeCache(*this) {
+  if (option.timeReport) {
+    timeReport = std::make_unique<TimeReport>();
+  }
+}
 
-CSTParser::CSTParser(ParserContext &context) : context(context) {
-  srcMgr.setIncludeDirs(context.getOption().includePaths);
-  auto result = context.getFS().getBufferForFile(
-      context.getOption().mainInputFile, -1, false);
-  if (!result) {
-    // FIXME: diag
+ParserContext::~ParserContext() { NumBytesAllocated += getBytesAllocated(); }
+
+llvm::BumpPtrAllocator &ParserContext::createAllocator() {
+  std::lock_guard<std::mutex> lock(allocatorsMutex);
+  allocators.push_back(std::make_unique<llvm::BumpPtrAllocator>());
+  return *allocators.back();
+}
+
+size_t ParserContext::getBytesAllocated() {
+  std::lock_guard<std::mutex> lock(allocatorsMutex);
+  size_t result = alloc.getBytesAllocated();
+  for (const auto &allocator : allocators) {
+    result += allocator->getBytesAllocated();
   }
-  lexerStack.emplace_back(**result, context.getIdentifierInterner(), 1);
-  srcMgr.AddNewSourceBuffer(std::move(*result), llvm::SMLoc());
-  ID_include = context.getIdentifierInterner().get("include");
+  return result;
 }
 
-IdentifierCST *CSTParser::parseIdentifierCST() {
-  Token id = topLexer().lex();
+llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>>
+ParserContext::readFile(const llvm::Twine &path) {
+  std::string pathStr = path.str();
+  PhaseTimer timer(getTimeReport(), TimeReport::Read, pathStr);
+  auto result = getFS().getBufferForFile(pathStr, -1, false);
+  if (result) {
+    ++NumFilesRead;
+    NumBytesRead += (*result)->getBufferSize();
+  }
+  return result;
+}
+
+std::string ParserContext::resolveIncludePath(llvm::StringRef path) {
+  PhaseTimer timer(getTimeReport(), TimeReport::IncludeResolution);
+  if (getFS().exists(path)) {
+    ++NumIncludes;
+    return path.str();
+  }
+  for (const std::string &dir : option.includePaths) {
+    llvm::SmallString<128> fullPath(dir);
+    llvm::sys::path::append(fullPath, path);
+    if (getFS().exists(fullPath)) {
+      ++NumIncludes;
+      return std::string(fullPath.str());
+    }
+  }
+  return std::string();
+}
+
+llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>>
+ParserContext::openIncludeFile(llvm::StringRef path) {
+  std::string fullPath = resolveIncludePath(path);
+  if (fullPath.empty()) {
+    return std::make_error_code(std::errc::no_such_file_or_directory);
+  }
+  return readFile(fullPath);
+}
+
+FormParser::FormParser(const llvm::MemoryBuffer &buffer,
+                       IdentifierInterner &ii, StringPool &sp,
+                       SourceLocation bufferStart,
+                       llvm::BumpPtrAllocator &alloc, CSTUniquer *uniquer)
+    : lexer(buffer, ii, bufferStart), sp(&sp), alloc(&alloc),
+      uniquer(uniquer), nodeCounts(nodeStats) {}
+
+FormParser::FormParser(const llvm::MemoryBuffer &buffer,
+                       IdentifierInterner &ii, StringPool &sp,
+                       SourceLocation bufferStart, uint32_t beginOffset,
+                       uint32_t endOffset, llvm::BumpPtrAllocator &alloc,
+                       CSTUniquer *uniquer)
+    : lexer(buffer, ii, bufferStart, beginOffset, endOffset), sp(&sp),
+      alloc(&alloc), uniquer(uniquer), nodeCounts(nodeStats) {}
+
+IdentifierCST *FormParser::parseIdentifierCST() {
+  Token id = lexer.lex();
   assert(id.isIdentifier());
-  auto ptr = context.getAllocator().Allocate<IdentifierCST>();
-  new (ptr) IdentifierCST(id.getLoc(), id.getID());
-  return ptr;
+  return static_cast<IdentifierCST *>(createLeaf(id));
 }
 
-StringCST *CSTParser::parseStringCST() {
-  Token str = topLexer().lex();
+StringCST *FormParser::parseStringCST() {
+  Token str = lexer.lex();
   assert(str.isPlainString());
-  auto ptr = context.getAllocator().Allocate<StringCST>();
-  new (ptr) StringCST(str.getLoc(), str.getString());
-  return ptr;
+  return static_cast<StringCST *>(createLeaf(str));
 }
 
-CodeStringCST *CSTParser::parseCodeStringCST() {
-  Token str = topLexer().lex();
+CodeStringCST *FormParser::parseCodeStringCST() {
+  Token str = lexer.lex();
   assert(str.isCodeString());
-  auto ptr = context.getAllocator().Allocate<CodeStringCST>();
-  new (ptr) CodeStringCST(str.getLoc(), str.getString());
-  return ptr;
+  return static_cast<CodeStringCST *>(createLeaf(str));
 }
 
-IntCST *CSTParser::parseIntCST() {
-  Token num = topLexer().lex();
+IntCST *FormParser::parseIntCST() {
+  Token num = lexer.lex();
   assert(num.isNumber());
-  auto ptr = context.getAllocator().Allocate<IntCST>();
-  new (ptr) IntCST(num.getLoc(), num.takeNum());
-  return ptr;
+  return static_cast<IntCST *>(createLeaf(num));
 }
 
-VectorCST *CSTParser::parseVectorCST() {
+VectorCST *FormParser::parseVectorCST() {
   Token openBracket = expect(TokenKind::OpenBracket);
-  std::vector<CST *> subforms;
+  SourceLocation loc = lexer.getSourceLocation(openBracket);
+  size_t scratchStart = scratch.size();
   while (true) {
-    if (topLexer().peek().getKind() == TokenKind::CloseBracket) {
-      topLexer().lex();
-      auto ptr = context.getAllocator().Allocate<VectorCST>();
-      new (ptr) VectorCST(openBracket.getLoc(), std::move(subforms));
+    if (lexer.peekKind() == TokenKind::CloseBracket) {
+      lexer.skip();
+      auto ptr = createVector(
+          loc, llvm::makeArrayRef(scratch).drop_front(scratchStart));
+      scratch.resize(scratchStart);
       return ptr;
     }
     auto ptr = parseSubCST();
     if (!ptr) {
       // TODO: diag
     }
-    subforms.push_back(ptr);
+    scratch.push_back(ptr);
   }
 }
 
-ExpressionCST *CSTParser::parseRawExpressionCST() {
+ExpressionCST *FormParser::parseExpression(bool topLevel) {
   Token openParen = expect(TokenKind::OpenParen);
+  SourceLocation loc = lexer.getSourceLocation(openParen);
   Token machineMode;
   bool first = true;
-  std::vector<CST *> subforms;
+  size_t scratchStart = scratch.size();
   while (true) {
-    Token peek = topLexer().peek();
-    if (peek.getKind() == TokenKind::CloseParen) {
-      topLexer().lex();
-      auto ptr = context.getAllocator().Allocate<ExpressionCST>();
-      new (ptr) ExpressionCST(openParen.getLoc(),
-                              machineMode.isValid() ? machineMode.getID() : 0,
-                              std::move(subforms));
+    if (lexer.peekKind() == TokenKind::CloseParen) {
+      lexer.skip();
+      auto ptr = createExpression(
+          loc, machineMode.isValid() ? machineMode.getID() : 0,
+          llvm::makeArrayRef(scratch).drop_front(scratchStart), topLevel);
+      scratch.resize(scratchStart);
       return ptr;
     }
     auto ptr = parseSubCST();
     if (!ptr) {
       // TODO: diag
     }
-    subforms.push_back(ptr);
+    scratch.push_back(ptr);
     if (first) {
-      if (topLexer().peek().getKind() == TokenKind::Colon) {
-        topLexer().lex();
+      if (lexer.peekKind() == TokenKind::Colon) {
+        lexer.skip();
         machineMode = expect(TokenKind::Identifier);
       }
       first = false;
@@ -109,9 +195,8 @@ ExpressionCST *CSTParser::parseRawExpressionCST() {
   }
 }
 
-CST *CSTParser::parseSubCST() {
-  Token peek = topLexer().peek();
-  switch (peek.getKind()) {
+CST *FormParser::parseSubCST() {
+  switch (lexer.peekKind()) {
   default:
     return nullptr;
   case TokenKind::Identifier:
@@ -123,50 +208,763 @@ CST *CSTParser::parseSubCST() {
   case TokenKind::Number:
     return parseIntCST();
   case TokenKind::OpenParen:
-    return parseRawExpressionCST();
+    return parseExpression(false);
   case TokenKind::OpenBracket:
     return parseVectorCST();
   }
 }
 
-void CSTParser::skipEmptyLexers() {
-  while (!lexerStack.empty() && lexerStack.back().peek().isEOS()) {
-    lexerStack.pop_back();
+namespace {
+// what parseForm does with the next token
+enum class FormAction : uint8_t {
+  // an identifier, string or number
+  Leaf,
+  OpenExpression,
+  OpenVector,
+  Close,
+  Error,
+};
+
+constexpr std::array<FormAction, 11> makeFormActionTable() {
+  std::array<FormAction, 11> table{};
+  for (auto &action : table) {
+    action = FormAction::Error;
+  }
+  for (auto kind : {TokenKind::Identifier, TokenKind::String,
+                    TokenKind::CodeString, TokenKind::Number}) {
+    table[static_cast<unsigned>(kind)] = FormAction::Leaf;
+  }
+  table[static_cast<unsigned>(TokenKind::OpenParen)] =
+      FormAction::OpenExpression;
+  table[static_cast<unsigned>(TokenKind::OpenBracket)] = FormAction::OpenVector;
+  table[static_cast<unsigned>(TokenKind::CloseParen)] = FormAction::Close;
+  table[static_cast<unsigned>(TokenKind::CloseBracket)] = FormAction::Close;
+  return table;
+}
+
+constexpr std::array<FormAction, 11> formActionTable = makeFormActionTable();
+static_assert(static_cast<unsigned>(TokenKind::EndOfStream) + 1 ==
+                  formActionTable.size(),
+              "formActionTable must cover every TokenKind");
+} // namespace
+
+CST *FormParser::createLeaf(const Token &tok) {
+  SourceLocation loc = lexer.getSourceLocation(tok);
+  switch (tok.getKind()) {
+  case TokenKind::Identifier:
+    return getNode({CST_Kind::Identifier, tok.getID()}, [&] {
+      return new (alloc->Allocate<IdentifierCST>())
+          IdentifierCST(loc, tok.getID());
+    });
+  case TokenKind::String: {
+    IDTy id = sp->getLiteral(lexer.getString(tok));
+    return getNode({CST_Kind::String, id}, [&] {
+      return new (alloc->Allocate<StringCST>())
+          StringCST(loc, id, sp->getString(id));
+    });
+  }
+  case TokenKind::CodeString: {
+    llvm::StringRef str = lexer.getString(tok);
+    return getNode({CST_Kind::CodeString, 0, str}, [&] {
+      return new (alloc->Allocate<CodeStringCST>()) CodeStringCST(loc, str);
+    });
+  }
+  default: {
+    assert(tok.isNumber());
+    int64_t smallValue;
+    if (lexer.getSmallNumber(tok, smallValue)) {
+      return getNode({CST_Kind::Int, static_cast<uint64_t>(smallValue)}, [&] {
+        return new (alloc->Allocate<IntCST>())
+            IntCST(loc, IntegerValue(smallValue));
+      });
+    }
+    // wide integers are rare, not worth sharing
+    nodeCounts.count(CST_Kind::Int);
+    auto ptr = alloc->Allocate<IntCST>();
+    return new (ptr) IntCST(loc, IntegerValue(*alloc, lexer.getNumber(tok)));
+  }
+  }
+}
+
+ExpressionCST *FormParser::createExpression(SourceLocation loc,
+                                            IDTy machineMode,
+                                            llvm::ArrayRef<CST *> subforms,
+                                            bool topLevel) {
+  auto create = [&] {
+    return ExpressionCST::create(*alloc, loc, machineMode, subforms);
+  };
+  if (topLevel) {
+    nodeCounts.count(CST_Kind::Expression);
+    return create();
+  }
+  return static_cast<ExpressionCST *>(
+      getNode({CST_Kind::Expression, machineMode, {}, subforms}, create));
+}
+
+VectorCST *FormParser::createVector(SourceLocation loc,
+                                    llvm::ArrayRef<CST *> members) {
+  return static_cast<VectorCST *>(
+      getNode({CST_Kind::Vector, 0, {}, members},
+              [&] { return VectorCST::create(*alloc, loc, members); }));
+}
+
+CST *FormParser::finishFrame(const Frame &frame) {
+  auto children = llvm::makeArrayRef(scratch).drop_front(frame.scratchStart);
+  CST *result;
+  if (frame.isVector) {
+    result = createVector(frame.loc, children);
+  } else {
+    result = createExpression(frame.loc, frame.machineMode, children,
+                              &frame == &frames.front());
+  }
+  scratch.resize(frame.scratchStart);
+  return result;
+}
+
+ExpressionCST *FormParser::parseForm() {
+  assert(frames.empty());
+  Token openParen = expect(TokenKind::OpenParen);
+  frames.push_back({false, true, lexer.getSourceLocation(openParen),
+                    scratch.size(), IdentifierInterner::InvalidID});
+  while (true) {
+    // the kind decides, only leaves and opening delimiters need the rest of
+    // the token
+    TokenKind kind = lexer.peekKind();
+    CST *child;
+    switch (formActionTable[static_cast<unsigned>(kind)]) {
+    case FormAction::Leaf:
+      child = createLeaf(lexer.lex());
+      break;
+    case FormAction::OpenExpression:
+    case FormAction::OpenVector:
+      frames.push_back({kind == TokenKind::OpenBracket, true,
+                        lexer.getSourceLocation(lexer.lex()), scratch.size(),
+                        IdentifierInterner::InvalidID});
+      continue;
+    case FormAction::Close:
+      lexer.skip();
+      if ((kind == TokenKind::CloseBracket) != frames.back().isVector) {
+        // TODO: diag, mismatched close
+      }
+      child = finishFrame(frames.back());
+      frames.pop_back();
+      if (frames.empty()) {
+        return static_cast<ExpressionCST *>(child);
+      }
+      break;
+    case FormAction::Error:
+      // TODO: diag
+      lexer.skip();
+      if (kind == TokenKind::EndOfStream) {
+        // close everything that is still open
+        while (frames.size() > 1) {
+          child = finishFrame(frames.back());
+          frames.pop_back();
+          scratch.push_back(child);
+        }
+        child = finishFrame(frames.back());
+        frames.pop_back();
+        return static_cast<ExpressionCST *>(child);
+      }
+      continue;
+    }
+    scratch.push_back(child);
+    Frame &parent = frames.back();
+    if (parent.first) {
+      parent.first = false;
+      if (!parent.isVector && lexer.peekKind() == TokenKind::Colon) {
+        lexer.skip();
+        Token machineMode = expect(TokenKind::Identifier);
+        if (machineMode.isIdentifier()) {
+          parent.machineMode = machineMode.getID();
+        }
+      }
+    }
+  }
+}
+
+namespace {
+// the path of an `(include "path")` form, or an empty StringRef for other
+// forms
+llvm::StringRef getIncludePath(const ExpressionCST *form) {
+  if (form->getLeadID() != getKeywordID(RTLCode::INCLUDE)) {
+    return llvm::StringRef();
+  }
+  auto sub = form->getSubforms();
+  if (sub.size() != 2 || sub[1]->getKind() != CST_Kind::String) {
+    // TODO: diag
+  }
+  return static_cast<StringCST *>(sub[1])->getStr();
+}
+} // namespace
+
+CSTParser::CSTParser(ParserContext &context)
+    : context(context), locTable(context.getLocationSpace()) {
+  if (context.getOption().hashConsing) {
+    uniquer = std::make_unique<CSTUniquer>();
+  }
+  if (context.getOption().definitionIndex) {
+    index = std::make_unique<DefinitionIndex>(context.getIdentifierInterner(),
+                                              context.getStringPool());
+  }
+  auto result = context.readFile(context.getOption().mainInputFile);
+  if (!result) {
+    // FIXME: diag
+  }
+  mainBuffer = result->get();
+  unsigned fileID =
+      srcMgr.AddNewSourceBuffer(std::move(*result), llvm::SMLoc());
+  if (!context.getOption().cacheDir.empty()) {
+    cachePath = CSTCache::getCachePath(context, *mainBuffer);
+    PhaseTimer timer(context.getTimeReport(), TimeReport::Cache);
+    cache = CSTCache::load(cachePath, context, srcMgr, locTable);
+    if (cache) {
+      parsedForms.assign(cache->getForms().begin(), cache->getForms().end());
+      allParsed = true;
+      if (index) {
+        // or else built as the forms are handed out
+        cache->loadIndex(*index);
+      }
+      return;
+    }
+  }
+  if (context.getOption().numThreads <= 1) {
+    pushParser(*mainBuffer, fileID);
+    if (context.getOption().prefetchThreads &&
+        !context.getOption().shareIncludes) {
+      prefetchPool =
+          std::make_unique<ThreadPool>(context.getOption().prefetchThreads);
+      prefetchPool->async([this] { prefetchIncludes(*mainBuffer); });
+    }
+  }
+}
+
+void CSTParser::pushParser(const llvm::MemoryBuffer &buffer,
+                           unsigned fileID) {
+  ParsedFile *file = createParsedFile();
+  initParsedFile(*file, buffer, fileID);
+  if (fileStack.empty()) {
+    mainFile = file;
+  } else {
+    fileStack.back()->items.emplace_back();
+    fileStack.back()->items.back().included = file;
+  }
+  fileStack.push_back(file);
+  parserStack.emplace_back(buffer, context.getIdentifierInterner(),
+                           context.getStringPool(),
+                           locTable.addBuffer(buffer, fileID),
+                           context.getAllocator(), uniquer.get());
+  // a thread of its own doesn't pay off for small files
+  bool async =
+      context.getOption().tokenMode == ParserOption::TokenMode::Pipelined &&
+      buffer.getBufferSize() >= 64 * 1024;
+  pretokenize(topParser(), async);
+}
+
+void CSTParser::pretokenize(FormParser &parser, bool async) {
+  if (context.getOption().tokenMode == ParserOption::TokenMode::Live) {
+    return;
+  }
+  Lexer &lexer = parser.getLexer();
+  PhaseTimer timer(context.getTimeReport(), TimeReport::Lex,
+                   lexer.getBuffer().getBufferIdentifier());
+  lexer.pretokenize(async);
+}
+
+LineColumn CSTParser::getLineColumn(SourceLocation loc) const {
+  return locTable.getLineColumn(loc);
+}
+
+void CSTParser::skipEmptyParsers() {
+  while (!parserStack.empty() && parserStack.back().peek().isEOS()) {
+    parserStack.pop_back();
+    fileStack.pop_back();
   }
 }
 
 void CSTParser::includeFile(llvm::StringRef path) {
-  std::string pathStr(path.data(), path.size());
-  std::string realPath;
+  if (context.getOption().shareIncludes) {
+    ParsedFile *included = createParsedFile();
+    if (!includeCachedFile(nullptr, *included, path)) {
+      // TODO: diag
+      return;
+    }
+    fileStack.back()->items.emplace_back();
+    fileStack.back()->items.back().included = included;
+    pendingForms.clear();
+    nextPendingForm = 0;
+    included->splice(pendingForms);
+    return;
+  }
   // TODO: get SMLoc from a token
-  auto loc = llvm::SMLoc::getFromPointer(topLexer().getCurPos());
-  unsigned fileID = srcMgr.AddIncludeFile(pathStr, loc, realPath);
-  if (fileID) {
+  auto loc = llvm::SMLoc::getFromPointer(topParser().getLexer().getCurPos());
+  if (prefetchPool) {
+    if (const llvm::MemoryBuffer *buffer = getPrefetched(path)) {
+      // `prefetches` keeps the buffer
+      unsigned fileID = srcMgr.AddNewSourceBuffer(
+          llvm::MemoryBuffer::getMemBuffer(buffer->getMemBufferRef(), false),
+          loc);
+      pushParser(*srcMgr.getMemoryBuffer(fileID), fileID);
+      return;
+    }
+  }
+  auto result = context.openIncludeFile(path);
+  if (!result) {
     // TODO: diag
   }
   // temporarily, make some noise
-  assert(fileID);
-  lexerStack.emplace_back(*srcMgr.getMemoryBuffer(fileID),
-                          context.getIdentifierInterner(), fileID);
+  assert(result);
+  unsigned fileID = srcMgr.AddNewSourceBuffer(std::move(*result), loc);
+  pushParser(*srcMgr.getMemoryBuffer(fileID), fileID);
 }
 
-ExpressionCST *CSTParser::parseTopCST() {
-again:
-  skipEmptyLexers();
-  if (lexerStack.empty()) {
+void CSTParser::ParsedFile::splice(std::vector<ExpressionCST *> &forms) const {
+  for (const Item &item : items) {
+    if (item.included) {
+      item.included->splice(forms);
+    } else {
+      forms.push_back(item.form);
+    }
+  }
+}
+
+CSTParser::ParsedFile *CSTParser::createParsedFile() {
+  std::lock_guard<std::mutex> lock(parsedFilesMutex);
+  parsedFiles.push_back(std::make_unique<ParsedFile>());
+  return parsedFiles.back().get();
+}
+
+void CSTParser::initParsedFile(ParsedFile &file,
+                               const llvm::MemoryBuffer &buffer,
+                               unsigned fileID) {
+  file.path = buffer.getBufferIdentifier().str();
+  file.hash = llvm::xxHash64(buffer.getBuffer());
+  file.fileID = fileID;
+}
+
+void CSTParser::parseFileTask(ThreadPool &pool, ParsedFile &file,
+                              const llvm::MemoryBuffer &buffer,
+                              unsigned fileID) {
+  initParsedFile(file, buffer, fileID);
+  SourceLocation bufferStart = locTable.addBuffer(buffer, fileID);
+  uint32_t size = buffer.getBufferSize();
+  uint32_t chunkSize = context.getOption().chunkSize;
+  if (!chunkSize || size <= chunkSize) {
+    parseRangeTask(pool, file, buffer, bufferStart, 0, size);
+    return;
+  }
+  // the chunks cover the whole buffer, and offsets (and so locations) stay
+  // relative to its start
+  auto addChunk = [&](uint32_t beginOffset, uint32_t endOffset) {
+    ParsedFile *chunk = createParsedFile();
+    file.items.emplace_back();
+    file.items.back().included = chunk;
+    pool.async([this, &pool, chunk, &buffer, bufferStart, beginOffset,
+                endOffset] {
+      parseRangeTask(pool, *chunk, buffer, bufferStart, beginOffset,
+                     endOffset);
+    });
+  };
+  PhaseTimer timer(context.getTimeReport(), TimeReport::Prescan,
+                   buffer.getBufferIdentifier());
+  Lexer scanner(buffer, context.getIdentifierInterner(), bufferStart);
+  uint32_t chunkBegin = 0;
+  uint32_t formBegin, formEnd;
+  while (scanner.scanTopLevelForm(formBegin, formEnd)) {
+    if (formEnd - chunkBegin >= chunkSize) {
+      addChunk(chunkBegin, formEnd);
+      chunkBegin = formEnd;
+    }
+  }
+  if (chunkBegin < size) {
+    addChunk(chunkBegin, size);
+  }
+}
+
+void CSTParser::parseRangeTask(ThreadPool &pool, ParsedFile &file,
+                               const llvm::MemoryBuffer &buffer,
+                               SourceLocation bufferStart,
+                               uint32_t beginOffset, uint32_t endOffset) {
+  FormParser parser(buffer, context.getIdentifierInterner(),
+                    context.getStringPool(), bufferStart, beginOffset,
+                    endOffset, context.createAllocator(), uniquer.get());
+  pretokenize(parser, false);
+  while (!parser.peek().isEOS()) {
+    ExpressionCST *form = parseForm(parser);
+    llvm::StringRef includePath = getIncludePath(form);
+    if (includePath.empty()) {
+      file.items.emplace_back();
+      file.items.back().form = form;
+      continue;
+    }
+    ParsedFile *included = createParsedFile();
+    file.items.emplace_back();
+    file.items.back().included = included;
+    pool.async([this, &pool, included, path = includePath.str()] {
+      includeFileTask(pool, *included, path);
+    });
+  }
+}
+
+void CSTParser::includeFileTask(ThreadPool &pool, ParsedFile &file,
+                                std::string path) {
+  if (context.getOption().shareIncludes) {
+    if (!includeCachedFile(&pool, file, path)) {
+      // TODO: diag
+    }
+    return;
+  }
+  auto result = context.openIncludeFile(path);
+  if (!result) {
+    // TODO: diag
+  }
+  // temporarily, make some noise
+  assert(result);
+  const llvm::MemoryBuffer &buffer = **result;
+  unsigned fileID;
+  {
+    std::lock_guard<std::mutex> lock(srcMgrMutex);
+    fileID = srcMgr.AddNewSourceBuffer(std::move(*result), llvm::SMLoc());
+  }
+  parseFileTask(pool, file, buffer, fileID);
+}
+
+void CSTParser::prefetch(std::string path) {
+  {
+    std::lock_guard<std::mutex> lock(prefetchMutex);
+    if (!prefetches.try_emplace(path).second) {
+      return;
+    }
+  }
+  prefetchPool->async([this, path] {
+    auto result = context.openIncludeFile(path);
+    std::unique_ptr<llvm::MemoryBuffer> buffer;
+    if (result) {
+      buffer = std::move(*result);
+    }
+    const llvm::MemoryBuffer *bufferPtr = buffer.get();
+    {
+      std::lock_guard<std::mutex> lock(prefetchMutex);
+      Prefetch &entry = prefetches[path];
+      entry.buffer = std::move(buffer);
+      entry.done = true;
+    }
+    prefetchDone.notify_all();
+    if (bufferPtr) {
+      prefetchIncludes(*bufferPtr);
+    }
+  });
+}
+
+void CSTParser::prefetchIncludes(const llvm::MemoryBuffer &buffer) {
+  PhaseTimer timer(context.getTimeReport(), TimeReport::Prescan,
+                   buffer.getBufferIdentifier());
+  IdentifierInterner &ii = context.getIdentifierInterner();
+  Lexer scanner(buffer, ii, SourceLocation());
+  uint32_t begin, end;
+  while (scanner.scanTopLevelForm(begin, end)) {
+    // only look at the first tokens of each form
+    Lexer lexer(buffer, ii, SourceLocation(), begin, end);
+    Token path;
+    if (lexer.lex().getKind() == TokenKind::OpenParen) {
+      Token lead = lexer.lex();
+      if (lead.isIdentifier() &&
+          lead.getID() == getKeywordID(RTLCode::INCLUDE)) {
+        path = lexer.lex();
+      }
+    }
+    // the parse lexes the form again
+    NumPrefetchTokens += lexer.discardTokenCounts();
+    if (path.getKind() == TokenKind::String) {
+      prefetch(StringPool::unescape(lexer.getString(path)));
+    }
+  }
+}
+
+const llvm::MemoryBuffer *CSTParser::getPrefetched(llvm::StringRef path) {
+  std::unique_lock<std::mutex> lock(prefetchMutex);
+  auto iter = prefetches.find(path);
+  if (iter == prefetches.end()) {
     return nullptr;
   }
-  ExpressionCST *result = parseRawExpressionCST();
-  if (result->getLeadID() == ID_include) {
-    auto sub = result->getSubforms();
-    if (sub.size() != 2 || sub[1]->getKind() != CST_Kind::String) {
+  // entries are never moved
+  Prefetch &entry = iter->second;
+  prefetchDone.wait(lock, [&] { return entry.done; });
+  return entry.buffer.get();
+}
+
+void CSTParser::parseCachedFile(IncludeCache::Entry &entry) {
+  const llvm::MemoryBuffer &buffer = *entry.buffer;
+  entry.start = context.getLocationSpace().allocate(buffer.getBufferSize());
+  // the forms outlive this parser, and may not share nodes with those of
+  // files other parsers don't include
+  FormParser parser(buffer, context.getIdentifierInterner(),
+                    context.getStringPool(), entry.start,
+                    context.createAllocator());
+  pretokenize(parser, false);
+  while (!parser.peek().isEOS()) {
+    ExpressionCST *form = parseForm(parser);
+    llvm::StringRef includePath = getIncludePath(form);
+    entry.items.emplace_back();
+    if (includePath.empty()) {
+      entry.items.back().form = form;
+    } else {
+      entry.items.back().includePath = includePath.str();
+    }
+  }
+}
+
+bool CSTParser::includeCachedFile(ThreadPool *pool, ParsedFile &file,
+                                  llvm::StringRef path) {
+  const IncludeCache::Entry *entry = context.getIncludeCache().get(
+      path, [this](IncludeCache::Entry &entry) { parseCachedFile(entry); });
+  if (!entry) {
+    return false;
+  }
+  unsigned fileID;
+  {
+    std::lock_guard<std::mutex> lock(srcMgrMutex);
+    unsigned &cachedFileID = cachedFileIDs[entry];
+    if (!cachedFileID) {
+      // the entry keeps the buffer
+      cachedFileID = srcMgr.AddNewSourceBuffer(
+          llvm::MemoryBuffer::getMemBuffer(entry->buffer->getMemBufferRef(),
+                                           false),
+          llvm::SMLoc());
+      locTable.addBufferAt(entry->start, *entry->buffer, cachedFileID);
+    }
+    fileID = cachedFileID;
+  }
+  file.path = entry->path;
+  file.hash = entry->hash;
+  file.fileID = fileID;
+  for (const auto &item : entry->items) {
+    file.items.emplace_back();
+    if (item.form) {
+      file.items.back().form = item.form;
+      continue;
+    }
+    ParsedFile *included = createParsedFile();
+    file.items.back().included = included;
+    if (pool) {
+      pool->async([this, pool, included, includePath = item.includePath] {
+        includeFileTask(*pool, *included, includePath);
+      });
+    } else if (!includeCachedFile(nullptr, *included, item.includePath)) {
       // TODO: diag
+      file.items.pop_back();
+    }
+  }
+  return true;
+}
+
+void CSTParser::parseInParallel() {
+  mainFile = createParsedFile();
+  {
+    ThreadPool pool(context.getOption().numThreads);
+    pool.async([this, &pool] {
+      parseFileTask(pool, *mainFile, *mainBuffer, 1);
+    });
+    pool.wait();
+  }
+  mainFile->splice(parsedForms);
+  allParsed = true;
+}
+
+void CSTParser::writeCache() {
+  if (cachePath.empty() || cache || cacheWritten) {
+    return;
+  }
+  cacheWritten = true;
+  PhaseTimer timer(context.getTimeReport(), TimeReport::Cache);
+  if (!CSTCache::write(cachePath, parsedForms, context, srcMgr, locTable,
+                       index.get())) {
+    // TODO: diag, not fatal
+  }
+}
+
+ExpressionCST *CSTParser::parseTopCST() {
+  ExpressionCST *result = nextTopCST();
+  // forms handed out again by reparseChangedFiles() are indexed already
+  // unless the index was cleared
+  if (result && index && numFormsOut++ == index->getNumForms()) {
+    index->add(result);
+  }
+  return result;
+}
+
+ExpressionCST *CSTParser::nextTopCST() {
+  if (allParsed || context.getOption().numThreads > 1) {
+    if (!allParsed) {
+      parseInParallel();
     }
-    llvm::StringRef includePath = static_cast<StringCST *>(sub[1])->getStr();
+    if (nextParsedForm == parsedForms.size()) {
+      writeCache();
+      return nullptr;
+    }
+    return parsedForms[nextParsedForm++];
+  }
+again:
+  if (nextPendingForm < pendingForms.size()) {
+    return pendingForms[nextPendingForm++];
+  }
+  skipEmptyParsers();
+  if (parserStack.empty()) {
+    mainFile->splice(parsedForms);
+    nextParsedForm = parsedForms.size();
+    allParsed = true;
+    writeCache();
+    return nullptr;
+  }
+  ExpressionCST *result = parseForm(topParser());
+  llvm::StringRef includePath = getIncludePath(result);
+  if (!includePath.empty()) {
     includeFile(includePath);
     goto again;
   }
+  fileStack.back()->items.emplace_back();
+  fileStack.back()->items.back().form = result;
   return result;
 }
 
+struct CSTParser::ReparseState {
+  // the new contents of the files that changed
+  llvm::StringMap<std::unique_ptr<llvm::MemoryBuffer>> changed;
+  // a node of the old graph for each unchanged file
+  llvm::StringMap<ParsedFile *> unchanged;
+  // the files parsed again, by path
+  llvm::StringMap<ParsedFile *> reparsed;
+  // the node replacing an old one
+  llvm::DenseMap<ParsedFile *, ParsedFile *> updated;
+  unsigned numReparsed = 0;
+};
+
+CSTParser::ParsedFile *CSTParser::updateFile(ReparseState &state,
+                                             ParsedFile *file) {
+  auto iter = state.updated.find(file);
+  if (iter != state.updated.end()) {
+    return iter->second;
+  }
+  if (!file->isChunk()) {
+    auto changedIter = state.changed.find(file->path);
+    if (changedIter != state.changed.end()) {
+      ParsedFile *result = state.reparsed.lookup(file->path);
+      if (!result) {
+        result = reparseFile(state, std::move(changedIter->second));
+      }
+      state.updated[file] = result;
+      return result;
+    }
+  }
+  // unchanged, only what it includes may be new
+  state.updated[file] = file;
+  for (auto &item : file->items) {
+    if (item.included) {
+      item.included = updateFile(state, item.included);
+    }
+  }
+  return file;
+}
+
+CSTParser::ParsedFile *
+CSTParser::reparseFile(ReparseState &state,
+                       std::unique_ptr<llvm::MemoryBuffer> buffer) {
+  ParsedFile *file = createParsedFile();
+  const llvm::MemoryBuffer &bufferRef = *buffer;
+  unsigned fileID = srcMgr.AddNewSourceBuffer(std::move(buffer), llvm::SMLoc());
+  initParsedFile(*file, bufferRef, fileID);
+  state.reparsed[file->path] = file;
+  ++state.numReparsed;
+  FormParser parser(bufferRef, context.getIdentifierInterner(),
+                    context.getStringPool(),
+                    locTable.addBuffer(bufferRef, fileID),
+                    context.getAllocator(), uniquer.get());
+  while (!parser.peek().isEOS()) {
+    ExpressionCST *form = parseForm(parser);
+    llvm::StringRef includePath = getIncludePath(form);
+    file->items.emplace_back();
+    if (includePath.empty()) {
+      file->items.back().form = form;
+      continue;
+    }
+    auto result = context.openIncludeFile(includePath);
+    if (!result) {
+      // TODO: diag
+      file->items.pop_back();
+      continue;
+    }
+    llvm::StringRef path = (*result)->getBufferIdentifier();
+    ParsedFile *included = state.unchanged.lookup(path);
+    if (included) {
+      included = updateFile(state, included);
+    } else {
+      included = state.reparsed.lookup(path);
+    }
+    if (!included) {
+      included = reparseFile(state, std::move(*result));
+    }
+    file->items.back().included = included;
+  }
+  return file;
+}
+
+unsigned CSTParser::reparseChangedFiles() {
+  while (parseTopCST()) {
+  }
+  ReparseState state;
+  if (!mainFile) {
+    // loaded from the cache, there is no graph to go by
+    auto result = context.readFile(context.getOption().mainInputFile);
+    if (!result) {
+      // TODO: diag
+      return 0;
+    }
+    mainFile = reparseFile(state, std::move(*result));
+  } else {
+    // read every file of the graph once
+    std::vector<ParsedFile *> worklist{mainFile};
+    llvm::DenseSet<ParsedFile *> visited;
+    while (!worklist.empty()) {
+      ParsedFile *file = worklist.back();
+      worklist.pop_back();
+      if (!visited.insert(file).second) {
+        continue;
+      }
+      for (const auto &item : file->items) {
+        if (item.included) {
+          worklist.push_back(item.included);
+        }
+      }
+      if (file->isChunk() || state.unchanged.count(file->path) ||
+          state.changed.count(file->path)) {
+        continue;
+      }
+      auto result = context.readFile(file->path);
+      if (!result) {
+        // TODO: diag, gone; keep its forms for now
+        state.unchanged[file->path] = file;
+      } else if (llvm::xxHash64((*result)->getBuffer()) == file->hash) {
+        state.unchanged[file->path] = file;
+      } else {
+        state.changed[file->path] = std::move(*result);
+      }
+    }
+    if (state.changed.empty()) {
+      nextParsedForm = 0;
+      numFormsOut = 0;
+      return 0;
+    }
+    mainFile = updateFile(state, mainFile);
+  }
+  parsedForms.clear();
+  mainFile->splice(parsedForms);
+  nextParsedForm = 0;
+  allParsed = true;
+  if (index) {
+    index->clear();
+  }
+  numFormsOut = 0;
+  return state.numReparsed;
+}
+
 } // namespace grp
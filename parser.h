@@ -1,18 +1,72 @@
 #pragma once
 
 #include "cst.h"
+#include "cst_cache.h"
+#include "cst_uniquer.h"
+#include "definition_index.h"
+#include "include_cache.h"
 #include "lexer.h"
+#include "stats.h"
+#include "string_pool.h"
+#include "thread_pool.h"
 
+#include "llvm/ADT/DenseMap.h"
 #include "llvm/Support/Allocator.h"
 #include "llvm/Support/VirtualFileSystem.h"
 
+#include <condition_variable>
+#include <mutex>
+#include <string>
 #include <vector>
 
 namespace grp {
 
 struct ParserOption {
+  // how tokens get from the lexer to the parser
+  enum class TokenMode {
+    // lexed on demand, one at a time
+    Live,
+    // a whole file (or chunk) is lexed into a TokenStream before it is parsed
+    Pretokenized,
+    // like Pretokenized, but the lexing runs on a thread of its own, a few
+    // blocks ahead of the parser; same as Pretokenized when parsing in
+    // parallel, the pool keeps the cores busy already
+    Pipelined,
+  };
   std::string mainInputFile;
   std::vector<std::string> includePaths;
+  // parse included files on this many threads, 1 parses them sequentially
+  unsigned numThreads = 1;
+  // parse forms by recursive descent rather than with FormParser::parseForm,
+  // e.g. to compare the two
+  bool recursiveParser = false;
+  // when parsing in parallel, files bigger than this are split at top-level
+  // form boundaries into chunks of about this size, parsed in parallel too;
+  // 0 keeps files whole
+  uint32_t chunkSize = 256 * 1024;
+  TokenMode tokenMode = TokenMode::Live;
+  // share structurally identical subtrees (not top-level forms) between all
+  // their copies, see CSTUniquer
+  bool hashConsing = false;
+  // if not empty, the parse result of the whole include tree is saved in this
+  // directory, and loaded instead of parsing while the files are unchanged,
+  // see CSTCache
+  std::string cacheDir;
+  // keep the included files, parsed, in the IncludeCache of the context:
+  // including a file again, from this or another CSTParser of the context,
+  // neither reads nor parses it while it is unchanged. Such files are neither
+  // hash-consed nor split into chunks.
+  bool shareIncludes = false;
+  // when parsing sequentially (and not sharing includes), read the included
+  // files ahead on this many threads: the files are scanned for includes as
+  // soon as they are read, so the buffers are usually there by the time the
+  // parser gets to the includes; 0 reads them when included
+  unsigned prefetchThreads = 0;
+  // time the phases of the parse into the TimeReport of the context
+  bool timeReport = false;
+  // index the forms as parseTopCST hands them out, see DefinitionIndex; the
+  // index is saved in the CSTCache along with the forms
+  bool definitionIndex = false;
   static ParserOption createDefaultOption(const std::string mainInputFile);
 };
 
@@ -20,45 +74,288 @@ class ParserContext {
   ParserOption option;
   std::unique_ptr<llvm::vfs::FileSystem> fs;
   IdentifierInterner ii;
+  StringPool sp;
   llvm::BumpPtrAllocator alloc;
+  std::mutex allocatorsMutex;
+  std::vector<std::unique_ptr<llvm::BumpPtrAllocator>> allocators;
+  // shared by the SourceLocationTables of all the CSTParsers
+  SourceLocationSpace locSpace;
+  IncludeCache includeCache;
+  // with ParserOption::timeReport
+  std::unique_ptr<TimeReport> timeReport;
 
 public:
   ParserContext(const ParserOption &option);
+  ~ParserContext();
   const ParserOption &getOption() const { return option; }
   llvm::vfs::FileSystem &getFS() const { return *fs.get(); }
   IdentifierInterner &getIdentifierInterner() { return ii; }
+  StringPool &getStringPool() { return sp; }
   llvm::BumpPtrAllocator &getAllocator() { return alloc; }
+  SourceLocationSpace &getLocationSpace() { return locSpace; }
+  // see ParserOption::shareIncludes
+  IncludeCache &getIncludeCache() { return includeCache; }
+  // an arena of its own, e.g. for a thread parsing a file, which lives as
+  // long as the context; thread-safe
+  llvm::BumpPtrAllocator &createAllocator();
+  // bytes taken by all the arenas of the context so far
+  size_t getBytesAllocated();
+  // null unless ParserOption::timeReport
+  TimeReport *getTimeReport() { return timeReport.get(); }
+  // read a file of the include tree, all reads go through here to be counted
+  // and timed; thread-safe
+  llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>>
+  readFile(const llvm::Twine &path);
+  // where an included file is: `path` as is, or in the first include path
+  // that has it, the same search order as SourceMgr::AddIncludeFile; empty
+  // if not found
+  std::string resolveIncludePath(llvm::StringRef path);
+  // read an included file, the buffer is named after the path it was found
+  // at
+  llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>>
+  openIncludeFile(llvm::StringRef path);
 };
 
-class CSTParser {
-  ParserContext &context;
-  llvm::SourceMgr srcMgr;
-  // note: SourceMgr has a stack of included file, we keep the corresponding
-  // Lexers
-  std::vector<Lexer> lexerStack;
-  IDTy ID_include;
-  Lexer &topLexer() { return lexerStack.back(); }
-  void skipEmptyLexers();
+// parses the forms of a single buffer, CST nodes go to `alloc`
+class FormParser {
+  Lexer lexer;
+  StringPool *sp;
+  llvm::BumpPtrAllocator *alloc;
+  // null unless hash-consing
+  CSTUniquer *uniquer;
+  // children of the expressions/vectors being parsed, shared by all nesting
+  // levels and copied into the arena when a node is finished
+  std::vector<CST *> scratch;
+  // an expression or vector still open in parseForm()
+  struct Frame {
+    bool isVector;
+    // no subform yet, the next one may be followed by ':' and a mode
+    bool first;
+    SourceLocation loc;
+    size_t scratchStart;
+    IDTy machineMode;
+  };
+  // reused across forms, like scratch
+  std::vector<Frame> frames;
+  // nodes created by kind, for -stats
+  StatCounters<CST_Kind, NumCSTKinds> nodeCounts;
+  // the canonical node for `key` when hash-consing, a fresh one otherwise
+  template <typename CreateFn>
+  CST *getNode(const CSTKey &key, CreateFn create) {
+    auto countedCreate = [&] {
+      nodeCounts.count(key.kind);
+      return create();
+    };
+    return uniquer ? uniquer->getOrCreate(key, countedCreate)
+                   : countedCreate();
+  }
+  CST *createLeaf(const Token &tok);
+  // top-level forms are never shared, they keep their own location
+  ExpressionCST *createExpression(SourceLocation loc, IDTy machineMode,
+                                  llvm::ArrayRef<CST *> subforms,
+                                  bool topLevel);
+  VectorCST *createVector(SourceLocation loc, llvm::ArrayRef<CST *> members);
+  CST *finishFrame(const Frame &frame);
+  ExpressionCST *parseExpression(bool topLevel);
+
+public:
+  FormParser(const llvm::MemoryBuffer &buffer, IdentifierInterner &ii,
+             StringPool &sp, SourceLocation bufferStart,
+             llvm::BumpPtrAllocator &alloc, CSTUniquer *uniquer = nullptr);
+  // only parse the forms in [beginOffset, endOffset) of the buffer
+  FormParser(const llvm::MemoryBuffer &buffer, IdentifierInterner &ii,
+             StringPool &sp, SourceLocation bufferStart,
+             uint32_t beginOffset, uint32_t endOffset,
+             llvm::BumpPtrAllocator &alloc, CSTUniquer *uniquer = nullptr);
+  Lexer &getLexer() { return lexer; }
+  Token peek() { return lexer.peek(); }
   Token expect(TokenKind kind) {
-    Token result = topLexer().lex();
+    Token result = lexer.lex();
     if (result.getKind() != kind) {
       // TODO: diag
     }
     return result;
   }
-  void includeFile(llvm::StringRef path);
-
-public:
-  CSTParser(ParserContext &context);
+  // parse a whole expression without recursion, with an explicit stack of
+  // open expressions/vectors; same result as parseRawExpressionCST()
+  ExpressionCST *parseForm();
+  // recursive descent
   CST *parseSubCST();
-  // parse an expression without handling of include
-  ExpressionCST *parseRawExpressionCST();
+  // parse a top-level expression
+  ExpressionCST *parseRawExpressionCST() { return parseExpression(true); }
   IdentifierCST *parseIdentifierCST();
   StringCST *parseStringCST();
   CodeStringCST *parseCodeStringCST();
   IntCST *parseIntCST();
   VectorCST *parseVectorCST();
-  // parse a top-level CST(which must be an expression), include's are handled
+};
+
+class CSTParser {
+public:
+  // A file of the include graph, or a chunk of one parsed in parallel: its
+  // top-level forms and the files it includes (or its chunks), in source
+  // order. Owned by the CSTParser.
+  struct ParsedFile {
+    // as opened, empty for a chunk
+    std::string path;
+    // xxHash64 of the contents
+    uint64_t hash = 0;
+    unsigned fileID = 0;
+    struct Item {
+      ExpressionCST *form = nullptr;
+      ParsedFile *included = nullptr;
+    };
+    std::vector<Item> items;
+    bool isChunk() const { return path.empty(); }
+    void splice(std::vector<ExpressionCST *> &forms) const;
+  };
+
+private:
+  ParserContext &context;
+  llvm::SourceMgr srcMgr;
+  // only taken when parsing in parallel
+  std::mutex srcMgrMutex;
+  SourceLocationTable locTable;
+  // with ParserOption::hashConsing
+  std::unique_ptr<CSTUniquer> uniquer;
+  // with ParserOption::cacheDir
+  std::string cachePath;
+  std::unique_ptr<CSTCache> cache;
+  bool cacheWritten = false;
+  void writeCache();
+  // note: SourceMgr has a stack of included file, we keep the corresponding
+  // parsers
+  std::vector<FormParser> parserStack;
+  FormParser &topParser() { return parserStack.back(); }
+  ExpressionCST *parseForm(FormParser &parser) {
+    PhaseTimer timer(context.getTimeReport(), TimeReport::Parse,
+                     parser.getLexer().getBuffer().getBufferIdentifier());
+    return context.getOption().recursiveParser
+               ? parser.parseRawExpressionCST()
+               : parser.parseForm();
+  }
+  // unless ParserOption::tokenMode is Live, lex the rest of the range of
+  // `parser` ahead of time
+  void pretokenize(FormParser &parser, bool async);
+  // the file each parser of parserStack records its forms into
+  std::vector<ParsedFile *> fileStack;
+  void pushParser(const llvm::MemoryBuffer &buffer, unsigned fileID);
+  void skipEmptyParsers();
+  void includeFile(llvm::StringRef path);
+
+  // the include graph, its root is null if the forms came from the cache
+  ParsedFile *mainFile = nullptr;
+  std::mutex parsedFilesMutex;
+  std::vector<std::unique_ptr<ParsedFile>> parsedFiles;
+  // thread-safe
+  ParsedFile *createParsedFile();
+  void initParsedFile(ParsedFile &file, const llvm::MemoryBuffer &buffer,
+                      unsigned fileID);
+
+  // with ParserOption::shareIncludes
+  // the file ID of each entry of the IncludeCache used, guarded by
+  // srcMgrMutex
+  llvm::DenseMap<const IncludeCache::Entry *, unsigned> cachedFileIDs;
+  // sequential mode: the forms of the included file still to be handed out
+  std::vector<ExpressionCST *> pendingForms;
+  size_t nextPendingForm = 0;
+  void parseCachedFile(IncludeCache::Entry &entry);
+  // fill `file` with the forms of the file included as `path`, from the
+  // cache; the files it includes are handled by tasks of `pool`, or right
+  // away without a pool. Return false if it can't be read.
+  bool includeCachedFile(ThreadPool *pool, ParsedFile &file,
+                         llvm::StringRef path);
+
+  // parallel mode: every file (or chunk of a big one) is parsed by a task of
+  // its own into a ParsedFile, the forms are spliced into parsedForms in
+  // source order
+  const llvm::MemoryBuffer *mainBuffer = nullptr;
+  // all the forms are in parsedForms already: parsed in parallel, loaded
+  // from the cache or parsed to the end
+  bool allParsed = false;
+  std::vector<ExpressionCST *> parsedForms;
+  size_t nextParsedForm = 0;
+  void parseInParallel();
+  void parseFileTask(ThreadPool &pool, ParsedFile &file,
+                     const llvm::MemoryBuffer &buffer, unsigned fileID);
+  void parseRangeTask(ThreadPool &pool, ParsedFile &file,
+                      const llvm::MemoryBuffer &buffer,
+                      SourceLocation bufferStart, uint32_t beginOffset,
+                      uint32_t endOffset);
+  void includeFileTask(ThreadPool &pool, ParsedFile &file, std::string path);
+
+  // incremental reparsing
+  struct ReparseState;
+  ParsedFile *updateFile(ReparseState &state, ParsedFile *file);
+  ParsedFile *reparseFile(ReparseState &state,
+                          std::unique_ptr<llvm::MemoryBuffer> buffer);
+
+  // with ParserOption::definitionIndex
+  std::unique_ptr<DefinitionIndex> index;
+  // forms handed out by parseTopCST, since the start or the last
+  // reparseChangedFiles()
+  size_t numFormsOut = 0;
+  ExpressionCST *nextTopCST();
+
+  // with ParserOption::prefetchThreads
+  struct Prefetch {
+    bool done = false;
+    // null if it can't be read
+    std::unique_ptr<llvm::MemoryBuffer> buffer;
+  };
+  // by path as included, guarded by prefetchMutex
+  llvm::StringMap<Prefetch> prefetches;
+  std::mutex prefetchMutex;
+  std::condition_variable prefetchDone;
+  // read the file included as `path` in the background, unless done already
+  void prefetch(std::string path);
+  // prefetch the files `buffer` includes
+  void prefetchIncludes(const llvm::MemoryBuffer &buffer);
+  // the buffer of the file included as `path`, waiting for it if it's on its
+  // way; null if it wasn't prefetched or can't be read
+  const llvm::MemoryBuffer *getPrefetched(llvm::StringRef path);
+  // last, destroyed first: its tasks use the members above
+  std::unique_ptr<ThreadPool> prefetchPool;
+
+public:
+  CSTParser(ParserContext &context);
+  CST *parseSubCST() { return topParser().parseSubCST(); }
+  // parse an expression without handling of include
+  ExpressionCST *parseRawExpressionCST() {
+    return topParser().parseRawExpressionCST();
+  }
+  IdentifierCST *parseIdentifierCST() {
+    return topParser().parseIdentifierCST();
+  }
+  StringCST *parseStringCST() { return topParser().parseStringCST(); }
+  CodeStringCST *parseCodeStringCST() {
+    return topParser().parseCodeStringCST();
+  }
+  IntCST *parseIntCST() { return topParser().parseIntCST(); }
+  VectorCST *parseVectorCST() { return topParser().parseVectorCST(); }
+  // parse a top-level CST(which must be an expression), include's are handled;
+  // with ParserOption::numThreads > 1 the whole include tree is parsed on
+  // the first call, the forms come out in the same order regardless. With
+  // ParserOption::cacheDir, the cache is written when the last form is out.
   ExpressionCST *parseTopCST();
+  // decode a location of a CST produced by this parser
+  LineColumn getLineColumn(SourceLocation loc) const;
+  // the forms come from the cache, see ParserOption::cacheDir
+  bool isFromCache() const { return cache && !mainFile; }
+  // Bring the forms up to date with the files: only the files of the include
+  // graph whose contents changed (and the files they include for the first
+  // time) are parsed again, the forms of the other files are kept. Forms not
+  // out yet are parsed first; after that, parseTopCST hands all the forms
+  // out again from the first one. The cache isn't updated. Return the number
+  // of files parsed again.
+  unsigned reparseChangedFiles();
+  // the root of the include graph once all the forms are out, null if they
+  // came from the cache
+  const ParsedFile *getMainFile() const { return mainFile; }
+  // null unless ParserOption::hashConsing
+  const CSTUniquer *getUniquer() const { return uniquer.get(); }
+  // the forms handed out so far, all of them if they came from a cache
+  // saved with an index; null unless ParserOption::definitionIndex
+  const DefinitionIndex *getDefinitionIndex() const { return index.get(); }
 };
 } // namespace grp
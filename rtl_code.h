@@ -0,0 +1,64 @@
+#pragma once
+
+#include <cstdint>
+
+namespace grp {
+
+// rtx classes, as in GCC's rtl.h
+enum class RTXClass : uint8_t {
+  RTX_COMPARE,
+  RTX_COMM_COMPARE,
+  RTX_BIN_ARITH,
+  RTX_COMM_ARITH,
+  RTX_UNARY,
+  RTX_EXTRA,
+  RTX_MATCH,
+  RTX_INSN,
+  RTX_OBJ,
+  RTX_CONST_OBJ,
+  RTX_TERNARY,
+  RTX_BITFIELD_OPS,
+  RTX_AUTOINC,
+};
+
+enum class RTLCode : uint16_t {
+#define DEF_RTL_EXPR(ENUM, NAME, FORMAT, CLASS) ENUM,
+#include "rtl.def"
+};
+
+inline constexpr unsigned NumRTLCodes = 0
+#define DEF_RTL_EXPR(ENUM, NAME, FORMAT, CLASS) +1
+#include "rtl.def"
+    ;
+
+namespace detail {
+inline constexpr const char *rtlCodeNames[] = {
+#define DEF_RTL_EXPR(ENUM, NAME, FORMAT, CLASS) NAME,
+#include "rtl.def"
+};
+
+inline constexpr const char *rtlCodeFormats[] = {
+#define DEF_RTL_EXPR(ENUM, NAME, FORMAT, CLASS) FORMAT,
+#include "rtl.def"
+};
+
+inline constexpr RTXClass rtxClasses[] = {
+#define DEF_RTL_EXPR(ENUM, NAME, FORMAT, CLASS) RTXClass::CLASS,
+#include "rtl.def"
+};
+} // namespace detail
+
+inline constexpr const char *getRTLCodeName(RTLCode code) {
+  return detail::rtlCodeNames[static_cast<unsigned>(code)];
+}
+
+// operand format string, see GCC's rtl.def for the meaning of the letters
+inline constexpr const char *getRTLCodeFormat(RTLCode code) {
+  return detail::rtlCodeFormats[static_cast<unsigned>(code)];
+}
+
+inline constexpr RTXClass getRTXClass(RTLCode code) {
+  return detail::rtxClasses[static_cast<unsigned>(code)];
+}
+
+} // namespace grp
@@ -0,0 +1,344 @@
+#include "simd_scan.h"
+#include "char_class.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define GRP_SIMD_X86 1
+#include <immintrin.h>
+#endif
+
+namespace grp {
+namespace simd {
+namespace {
+
+const char *skipWhiteSpaceRunScalar(const char *pos, const char *end) {
+  while (pos < end && isWhileSpace(*pos)) {
+    ++pos;
+  }
+  return pos;
+}
+
+const char *skipIdentifierRunScalar(const char *pos, const char *end) {
+  while (pos < end && canContIdentifier(*pos)) {
+    ++pos;
+  }
+  return pos;
+}
+
+inline bool isCodeStructureChar(char c) {
+  switch (c) {
+  case '{':
+  case '}':
+  case '"':
+  case '\'':
+  case '/':
+  case '*':
+  case '\\':
+  case '\n':
+    return true;
+  default:
+    return false;
+  }
+}
+
+const char *skipCodeRunScalar(const char *pos, const char *end) {
+  while (pos < end && !isCodeStructureChar(*pos)) {
+    ++pos;
+  }
+  return pos;
+}
+
+inline bool isFormStructureChar(char c) {
+  switch (c) {
+  case '(':
+  case ')':
+  case '"':
+  case '{':
+  case ';':
+  case '/':
+    return true;
+  default:
+    return false;
+  }
+}
+
+const char *skipFormRunScalar(const char *pos, const char *end) {
+  while (pos < end && !isFormStructureChar(*pos)) {
+    ++pos;
+  }
+  return pos;
+}
+
+void collectNewLinesScalar(const char *begin, const char *end,
+                          std::vector<uint32_t> &offsets) {
+  for (const char *pos = begin; pos < end; ++pos) {
+    if (*pos == '\n') {
+      offsets.push_back(pos - begin);
+    }
+  }
+}
+
+const ScanFunctions scalarFunctions = {
+    skipWhiteSpaceRunScalar,
+    skipIdentifierRunScalar,
+    skipCodeRunScalar,
+    skipFormRunScalar,
+    collectNewLinesScalar,
+};
+
+#ifdef GRP_SIMD_X86
+__attribute__((target("sse2"))) const char *
+skipWhiteSpaceRunSSE2(const char *pos, const char *end) {
+  const __m128i space = _mm_set1_epi8(' ');
+  const __m128i tab = _mm_set1_epi8('\t');
+  const __m128i range = _mm_set1_epi8('\r' - '\t');
+  while (end - pos >= 16) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pos));
+    // '\t' ... '\r' are contiguous, check them with one unsigned compare
+    __m128i shifted = _mm_sub_epi8(v, tab);
+    __m128i isControlSpace =
+        _mm_cmpeq_epi8(_mm_min_epu8(shifted, range), shifted);
+    __m128i isSpace =
+        _mm_or_si128(isControlSpace, _mm_cmpeq_epi8(v, space));
+    uint32_t spaceMask = _mm_movemask_epi8(isSpace);
+    if (spaceMask != 0xffff) {
+      return pos + __builtin_ctz(~spaceMask);
+    }
+    pos += 16;
+  }
+  return skipWhiteSpaceRunScalar(pos, end);
+}
+
+// lanes of v holding a character in [lo, lo + n]
+__attribute__((target("sse2"))) inline __m128i inRangeSSE2(__m128i v, char lo,
+                                                          char n) {
+  __m128i shifted = _mm_sub_epi8(v, _mm_set1_epi8(lo));
+  return _mm_cmpeq_epi8(_mm_min_epu8(shifted, _mm_set1_epi8(n)), shifted);
+}
+
+__attribute__((target("sse2"))) inline __m128i
+isIdentifierContSSE2(__m128i v) {
+  // lower-casing only affects letters among the characters we accept
+  __m128i alpha = inRangeSSE2(_mm_or_si128(v, _mm_set1_epi8(0x20)), 'a', 25);
+  __m128i digit = inRangeSSE2(v, '0', 9);
+  __m128i result = _mm_or_si128(alpha, digit);
+  for (char c : {'_', '?', '<', '>', '$', '*'}) {
+    result = _mm_or_si128(result, _mm_cmpeq_epi8(v, _mm_set1_epi8(c)));
+  }
+  return result;
+}
+
+__attribute__((target("sse2"))) const char *
+skipIdentifierRunSSE2(const char *pos, const char *end) {
+  while (end - pos >= 16) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pos));
+    uint32_t mask = _mm_movemask_epi8(isIdentifierContSSE2(v));
+    if (mask != 0xffff) {
+      return pos + __builtin_ctz(~mask);
+    }
+    pos += 16;
+  }
+  return skipIdentifierRunScalar(pos, end);
+}
+
+// the first of `Cs...` in [pos, end), the tail shorter than a register is
+// left to `scalar`
+template <const char *(*scalar)(const char *, const char *), char... Cs>
+__attribute__((target("sse2"))) const char *findAnyOfSSE2(const char *pos,
+                                                          const char *end) {
+  while (end - pos >= 16) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pos));
+    __m128i hit = _mm_setzero_si128();
+    for (char c : {Cs...}) {
+      hit = _mm_or_si128(hit, _mm_cmpeq_epi8(v, _mm_set1_epi8(c)));
+    }
+    uint32_t mask = _mm_movemask_epi8(hit);
+    if (mask) {
+      return pos + __builtin_ctz(mask);
+    }
+    pos += 16;
+  }
+  return scalar(pos, end);
+}
+
+__attribute__((target("sse2"))) const char *
+skipCodeRunSSE2(const char *pos, const char *end) {
+  return findAnyOfSSE2<skipCodeRunScalar, '{', '}', '"', '\'', '/', '*', '\\',
+                       '\n'>(pos, end);
+}
+
+__attribute__((target("sse2"))) const char *
+skipFormRunSSE2(const char *pos, const char *end) {
+  return findAnyOfSSE2<skipFormRunScalar, '(', ')', '"', '{', ';', '/'>(pos,
+                                                                       end);
+}
+
+__attribute__((target("sse2"))) void
+collectNewLinesSSE2(const char *begin, const char *end,
+                    std::vector<uint32_t> &offsets) {
+  const __m128i newLine = _mm_set1_epi8('\n');
+  const char *pos = begin;
+  for (; end - pos >= 16; pos += 16) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pos));
+    uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, newLine));
+    for (; mask; mask &= mask - 1) {
+      offsets.push_back(pos - begin + __builtin_ctz(mask));
+    }
+  }
+  for (; pos < end; ++pos) {
+    if (*pos == '\n') {
+      offsets.push_back(pos - begin);
+    }
+  }
+}
+
+const ScanFunctions sse2Functions = {
+    skipWhiteSpaceRunSSE2,
+    skipIdentifierRunSSE2,
+    skipCodeRunSSE2,
+    skipFormRunSSE2,
+    collectNewLinesSSE2,
+};
+
+__attribute__((target("avx2"))) const char *
+skipWhiteSpaceRunAVX2(const char *pos, const char *end) {
+  const __m256i space = _mm256_set1_epi8(' ');
+  const __m256i tab = _mm256_set1_epi8('\t');
+  const __m256i range = _mm256_set1_epi8('\r' - '\t');
+  while (end - pos >= 32) {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(pos));
+    __m256i shifted = _mm256_sub_epi8(v, tab);
+    __m256i isControlSpace =
+        _mm256_cmpeq_epi8(_mm256_min_epu8(shifted, range), shifted);
+    __m256i isSpace =
+        _mm256_or_si256(isControlSpace, _mm256_cmpeq_epi8(v, space));
+    uint32_t spaceMask = _mm256_movemask_epi8(isSpace);
+    if (spaceMask != 0xffffffffu) {
+      return pos + __builtin_ctz(~spaceMask);
+    }
+    pos += 32;
+  }
+  // the remaining tail is shorter than a ymm register, let SSE2 have a go
+  return skipWhiteSpaceRunSSE2(pos, end);
+}
+
+template <const char *(*sse2)(const char *, const char *), char... Cs>
+__attribute__((target("avx2"))) const char *findAnyOfAVX2(const char *pos,
+                                                          const char *end) {
+  while (end - pos >= 32) {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(pos));
+    __m256i hit = _mm256_setzero_si256();
+    for (char c : {Cs...}) {
+      hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(c)));
+    }
+    uint32_t mask = _mm256_movemask_epi8(hit);
+    if (mask) {
+      return pos + __builtin_ctz(mask);
+    }
+    pos += 32;
+  }
+  return sse2(pos, end);
+}
+
+__attribute__((target("avx2"))) const char *
+skipCodeRunAVX2(const char *pos, const char *end) {
+  return findAnyOfAVX2<skipCodeRunSSE2, '{', '}', '"', '\'', '/', '*', '\\',
+                       '\n'>(pos, end);
+}
+
+__attribute__((target("avx2"))) const char *
+skipFormRunAVX2(const char *pos, const char *end) {
+  return findAnyOfAVX2<skipFormRunSSE2, '(', ')', '"', '{', ';', '/'>(pos,
+                                                                      end);
+}
+
+__attribute__((target("avx2"))) void
+collectNewLinesAVX2(const char *begin, const char *end,
+                    std::vector<uint32_t> &offsets) {
+  const __m256i newLine = _mm256_set1_epi8('\n');
+  const char *pos = begin;
+  for (; end - pos >= 32; pos += 32) {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(pos));
+    uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, newLine));
+    for (; mask; mask &= mask - 1) {
+      offsets.push_back(pos - begin + __builtin_ctz(mask));
+    }
+  }
+  for (; pos < end; ++pos) {
+    if (*pos == '\n') {
+      offsets.push_back(pos - begin);
+    }
+  }
+}
+
+const ScanFunctions avx2Functions = {
+    skipWhiteSpaceRunAVX2,
+    // identifiers are short, a xmm register almost always covers a whole one
+    // and wider loads only cost us
+    skipIdentifierRunSSE2,
+    skipCodeRunAVX2,
+    skipFormRunAVX2,
+    collectNewLinesAVX2,
+};
+#endif
+
+ISA detectHostISA() {
+#ifdef GRP_SIMD_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return ISA::AVX2;
+  }
+  if (__builtin_cpu_supports("sse2")) {
+    return ISA::SSE2;
+  }
+#endif
+  return ISA::Scalar;
+}
+
+const ScanFunctions *getScanFunctions(ISA isa) {
+  switch (isa) {
+#ifdef GRP_SIMD_X86
+  case ISA::AVX2:
+    return &avx2Functions;
+  case ISA::SSE2:
+    return &sse2Functions;
+#endif
+  default:
+    return &scalarFunctions;
+  }
+}
+
+const ISA hostISA = detectHostISA();
+ISA activeISA = hostISA;
+
+} // namespace
+
+namespace detail {
+const ScanFunctions *activeScanFunctions = getScanFunctions(hostISA);
+} // namespace detail
+
+ISA getHostISA() { return hostISA; }
+
+ISA getActiveISA() { return activeISA; }
+
+void setActiveISA(ISA isa) {
+  if (static_cast<int>(isa) > static_cast<int>(hostISA)) {
+    isa = hostISA;
+  }
+  activeISA = isa;
+  detail::activeScanFunctions = getScanFunctions(isa);
+}
+
+const char *getISAName(ISA isa) {
+  switch (isa) {
+  case ISA::Scalar:
+    return "scalar";
+  case ISA::SSE2:
+    return "sse2";
+  case ISA::AVX2:
+    return "avx2";
+  }
+  return "unknown";
+}
+
+} // namespace simd
+} // namespace grp
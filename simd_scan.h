@@ -0,0 +1,79 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+namespace grp {
+namespace simd {
+
+// instruction sets the scanners know how to use, ordered by preference
+enum class ISA {
+  Scalar,
+  SSE2,
+  AVX2,
+};
+
+// the best instruction set supported by the host cpu
+ISA getHostISA();
+// the instruction set the scanners currently dispatch to, defaults to
+// getHostISA()
+ISA getActiveISA();
+// force the scanners onto a specific instruction set, e.g. to compare against
+// the scalar path in benchmarks; falls back to the host ISA if `isa` is not
+// supported
+void setActiveISA(ISA isa);
+const char *getISAName(ISA isa);
+
+struct ScanFunctions {
+  const char *(*skipWhiteSpaceRun)(const char *pos, const char *end);
+  const char *(*skipIdentifierRun)(const char *pos, const char *end);
+  const char *(*skipCodeRun)(const char *pos, const char *end);
+  const char *(*skipFormRun)(const char *pos, const char *end);
+  void (*collectNewLines)(const char *begin, const char *end,
+                          std::vector<uint32_t> &offsets);
+};
+
+namespace detail {
+// selected once at startup, then only changed by setActiveISA
+extern const ScanFunctions *activeScanFunctions;
+} // namespace detail
+
+inline const ScanFunctions &getActiveScanFunctions() {
+  return *detail::activeScanFunctions;
+}
+
+// skip a run of white spaces in [pos, end), return the first non-space
+// character (or end)
+inline const char *skipWhiteSpaceRun(const char *pos, const char *end) {
+  return getActiveScanFunctions().skipWhiteSpaceRun(pos, end);
+}
+
+// skip characters that can continue an identifier in [pos, end), return the
+// first one that can't (or end)
+inline const char *skipIdentifierRun(const char *pos, const char *end) {
+  return getActiveScanFunctions().skipIdentifierRun(pos, end);
+}
+
+// skip characters that don't affect the structure of a C code block in
+// [pos, end), i.e. everything except '{', '}', '"', '\'', '/', '*', '\\' and
+// '\n'; return the first one that does (or end)
+inline const char *skipCodeRun(const char *pos, const char *end) {
+  return getActiveScanFunctions().skipCodeRun(pos, end);
+}
+
+// skip characters that don't affect the nesting of top-level forms in
+// [pos, end), i.e. everything except '(', ')', '"', '{', ';' and '/'; return
+// the first one that does (or end)
+inline const char *skipFormRun(const char *pos, const char *end) {
+  return getActiveScanFunctions().skipFormRun(pos, end);
+}
+
+// append the offsets (relative to begin) of all '\n's in [begin, end) to
+// `offsets`, in increasing order
+inline void collectNewLines(const char *begin, const char *end,
+                            std::vector<uint32_t> &offsets) {
+  getActiveScanFunctions().collectNewLines(begin, end, offsets);
+}
+
+} // namespace simd
+} // namespace grp
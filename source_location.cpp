@@ -0,0 +1,127 @@
+#include "source_location.h"
+#include "simd_scan.h"
+
+#include <algorithm>
+
+namespace grp {
+
+SourceLocation SourceLocationSpace::allocate(uint32_t size) {
+  std::lock_guard<std::mutex> lock(mutex);
+  SourceLocation result = SourceLocation::getFromRawEncoding(nextStart);
+  // one past the end is a valid location too (e.g. of the end of stream)
+  uint64_t end = static_cast<uint64_t>(nextStart) + size + 1;
+  assert(end <= UINT32_MAX && "source location space exhausted");
+  nextStart = end;
+  return result;
+}
+
+void SourceLocationSpace::reserve(SourceLocation start, uint32_t size) {
+  std::lock_guard<std::mutex> lock(mutex);
+  uint64_t end = static_cast<uint64_t>(start.getRawEncoding()) + size + 1;
+  assert(end <= UINT32_MAX && "source location space exhausted");
+  nextStart = std::max<uint64_t>(nextStart, end);
+}
+
+void SourceLocationTable::addEntry(std::unique_ptr<BufferEntry> entry) {
+  std::lock_guard<std::mutex> lock(mutex);
+  // mostly appended, unless the range was handed out to another table first
+  auto iter = std::upper_bound(
+      entries.begin(), entries.end(), entry->start.getRawEncoding(),
+      [](uint32_t raw, const std::unique_ptr<BufferEntry> &entry) {
+        return raw < entry->start.getRawEncoding();
+      });
+  entries.insert(iter, std::move(entry));
+}
+
+SourceLocation SourceLocationTable::addBuffer(const llvm::MemoryBuffer &buffer,
+                                              unsigned fileID) {
+  SourceLocation start = space.allocate(buffer.getBufferSize());
+  addBufferAt(start, buffer, fileID);
+  return start;
+}
+
+void SourceLocationTable::addBufferAt(SourceLocation start,
+                                      const llvm::MemoryBuffer &buffer,
+                                      unsigned fileID) {
+  auto entry = std::make_unique<BufferEntry>();
+  entry->start = start;
+  entry->size = buffer.getBufferSize();
+  entry->buffer = &buffer;
+  entry->fileID = fileID;
+  addEntry(std::move(entry));
+}
+
+void SourceLocationTable::addIndexedBuffer(
+    SourceLocation start, uint32_t size, unsigned fileID,
+    llvm::ArrayRef<uint32_t> newLineOffsets) {
+  space.reserve(start, size);
+  auto entry = std::make_unique<BufferEntry>();
+  entry->start = start;
+  entry->size = size;
+  entry->buffer = nullptr;
+  entry->fileID = fileID;
+  entry->hasNewLineIndex = true;
+  entry->newLineOffsets = newLineOffsets;
+  addEntry(std::move(entry));
+}
+
+SourceLocationTable::BufferEntry *
+SourceLocationTable::findEntry(SourceLocation loc) const {
+  auto iter = std::upper_bound(
+      entries.begin(), entries.end(), loc.getRawEncoding(),
+      [](uint32_t raw, const std::unique_ptr<BufferEntry> &entry) {
+        return raw < entry->start.getRawEncoding();
+      });
+  if (iter == entries.begin()) {
+    return nullptr;
+  }
+  return std::prev(iter)->get();
+}
+
+void SourceLocationTable::buildNewLineIndex(BufferEntry &entry) {
+  const llvm::MemoryBuffer &buffer = *entry.buffer;
+  simd::collectNewLines(buffer.getBufferStart(), buffer.getBufferEnd(),
+                        entry.newLineStorage);
+  entry.newLineOffsets = entry.newLineStorage;
+  entry.hasNewLineIndex = true;
+}
+
+LineColumn SourceLocationTable::getLineColumn(SourceLocation loc) const {
+  LineColumn result;
+  if (!loc.isValid()) {
+    return result;
+  }
+  std::lock_guard<std::mutex> lock(mutex);
+  BufferEntry *entry = findEntry(loc);
+  if (!entry) {
+    return result;
+  }
+  if (!entry->hasNewLineIndex) {
+    buildNewLineIndex(*entry);
+  }
+  uint32_t offset = loc.getRawEncoding() - entry->start.getRawEncoding();
+  const auto &newLines = entry->newLineOffsets;
+  // number of lines ended before offset
+  auto iter = std::lower_bound(newLines.begin(), newLines.end(), offset);
+  uint32_t lineIndex = iter - newLines.begin();
+  uint32_t lineStart = lineIndex ? newLines[lineIndex - 1] + 1 : 0;
+  result.fileID = entry->fileID;
+  result.line = lineIndex + 1;
+  result.column = offset - lineStart + 1;
+  return result;
+}
+
+void SourceLocationTable::forEachBuffer(
+    llvm::function_ref<void(SourceLocation, uint32_t, unsigned,
+                            llvm::ArrayRef<uint32_t>)>
+        fn) {
+  std::lock_guard<std::mutex> lock(mutex);
+  for (auto &entry : entries) {
+    if (!entry->hasNewLineIndex) {
+      buildNewLineIndex(*entry);
+    }
+    fn(entry->start, entry->size, entry->fileID, entry->newLineOffsets);
+  }
+}
+
+} // namespace grp
@@ -0,0 +1,112 @@
+#pragma once
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace grp {
+
+// A position in one of the buffers known to a SourceLocationTable, encoded in
+// 32 bits: every buffer is assigned a contiguous range of the location space,
+// a location is the start of that range plus a byte offset. Line and column
+// are only decoded on demand, see SourceLocationTable::getLineColumn.
+class SourceLocation {
+  // 0 means invalid value
+  uint32_t rawEncoding;
+
+public:
+  SourceLocation() : rawEncoding(0) {}
+  static SourceLocation getFromRawEncoding(uint32_t rawEncoding) {
+    SourceLocation result;
+    result.rawEncoding = rawEncoding;
+    return result;
+  }
+  uint32_t getRawEncoding() const { return rawEncoding; }
+  bool isValid() const { return rawEncoding != 0; }
+  SourceLocation getLocWithOffset(uint32_t offset) const {
+    return getFromRawEncoding(rawEncoding + offset);
+  }
+  bool operator==(SourceLocation other) const {
+    return rawEncoding == other.rawEncoding;
+  }
+  bool operator!=(SourceLocation other) const {
+    return rawEncoding != other.rawEncoding;
+  }
+};
+
+// the decoded form of a SourceLocation
+struct LineColumn {
+  // as known to llvm::SourceMgr, 0 means invalid value
+  unsigned fileID = 0;
+  // line count and columnt count starts with 1
+  // 0 means invalid value
+  uint32_t line = 0;
+  uint32_t column = 0;
+};
+
+// hands out the ranges of the location space to the tables sharing it, e.g.
+// all those of a ParserContext, so that a location means the same buffer in
+// each of them; thread-safe
+class SourceLocationSpace {
+  std::mutex mutex;
+  // 0 is reserved for the invalid location
+  uint32_t nextStart = 1;
+
+public:
+  // the start of a new range for a buffer of `size` bytes
+  SourceLocation allocate(uint32_t size);
+  // never hand out the range of a buffer of `size` bytes at `start`
+  void reserve(SourceLocation start, uint32_t size);
+};
+
+// thread-safe, buffers may be added while other threads decode locations
+class SourceLocationTable {
+  struct BufferEntry {
+    SourceLocation start;
+    uint32_t size;
+    // null if the buffer came with its newline index, see addIndexedBuffer
+    const llvm::MemoryBuffer *buffer;
+    unsigned fileID;
+    // offsets of all '\n's in the buffer, built on first use
+    bool hasNewLineIndex = false;
+    llvm::ArrayRef<uint32_t> newLineOffsets;
+    std::vector<uint32_t> newLineStorage;
+  };
+  SourceLocationSpace &space;
+  // sorted by start
+  std::vector<std::unique_ptr<BufferEntry>> entries;
+  // guards entries, locations are only decoded for diagnostics
+  mutable std::mutex mutex;
+  void addEntry(std::unique_ptr<BufferEntry> entry);
+  BufferEntry *findEntry(SourceLocation loc) const;
+  static void buildNewLineIndex(BufferEntry &entry);
+
+public:
+  explicit SourceLocationTable(SourceLocationSpace &space) : space(space) {}
+  // assign a new range of the location space to `buffer`, return the
+  // location of its first character
+  SourceLocation addBuffer(const llvm::MemoryBuffer &buffer, unsigned fileID);
+  // add `buffer` with the range starting at `start` it was given before,
+  // e.g. by another table sharing the space
+  void addBufferAt(SourceLocation start, const llvm::MemoryBuffer &buffer,
+                   unsigned fileID);
+  // same as addBufferAt, for a buffer that is no longer around but whose
+  // newline offsets are known; `newLineOffsets` must outlive the table. The
+  // range is reserved in the space.
+  void addIndexedBuffer(SourceLocation start, uint32_t size, unsigned fileID,
+                        llvm::ArrayRef<uint32_t> newLineOffsets);
+  LineColumn getLineColumn(SourceLocation loc) const;
+  // call `fn(start, size, fileID, newLineOffsets)` for every buffer in
+  // location order, e.g. to save the table
+  void forEachBuffer(
+      llvm::function_ref<void(SourceLocation, uint32_t, unsigned,
+                              llvm::ArrayRef<uint32_t>)>
+          fn);
+};
+
+} // namespace grp
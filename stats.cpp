@@ -0,0 +1,121 @@
+#include "stats.h"
+
+#include "llvm/Support/Format.h"
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+namespace grp {
+
+namespace {
+const char *const phaseNames[] = {"read",  "include resolution", "prescan",
+                                  "lex",   "parse",              "cache"};
+static_assert(sizeof(phaseNames) / sizeof(phaseNames[0]) ==
+                  TimeReport::NumPhases,
+              "phaseNames must cover every phase");
+
+// the phases timed for each file
+bool isPerFile(unsigned phase) {
+  return phase != TimeReport::IncludeResolution && phase != TimeReport::Cache;
+}
+
+double getSeconds(TimeReport::Duration duration) {
+  return std::chrono::duration<double>(duration).count();
+}
+
+TimeReport::Duration getTotal(const TimeReport::Durations &durations) {
+  TimeReport::Duration result{};
+  for (auto duration : durations) {
+    result += duration;
+  }
+  return result;
+}
+} // namespace
+
+void TimeReport::add(Phase phase, llvm::StringRef file, Duration duration) {
+  std::lock_guard<std::mutex> lock(mutex);
+  phases[phase] += duration;
+  if (!file.empty()) {
+    files[file][phase] += duration;
+  }
+}
+
+void TimeReport::print(llvm::raw_ostream &os) {
+  std::lock_guard<std::mutex> lock(mutex);
+  double total = getSeconds(getTotal(phases));
+  auto percent = [&](Duration duration) {
+    return total ? getSeconds(duration) * 100 / total : 0;
+  };
+  os << "===" << std::string(73, '-') << "===\n"
+     << std::string(30, ' ') << "grp time report\n"
+     << "===" << std::string(73, '-') << "===\n"
+     << llvm::format("  Total: %.4f seconds, summed over the threads\n\n",
+                     total)
+     << "   ---Wall Time---  --- Phase ---\n";
+  for (unsigned i = 0; i < NumPhases; ++i) {
+    os << llvm::format("   %7.4f (%5.1f%%)  %s\n", getSeconds(phases[i]),
+                       percent(phases[i]), phaseNames[i]);
+  }
+  if (files.empty()) {
+    return;
+  }
+  // the slowest files first
+  std::vector<const llvm::StringMapEntry<Durations> *> sorted;
+  for (const auto &entry : files) {
+    sorted.push_back(&entry);
+  }
+  std::sort(sorted.begin(), sorted.end(), [](auto *lhs, auto *rhs) {
+    return getTotal(lhs->second) > getTotal(rhs->second);
+  });
+  os << "\n   ---Wall Time---  ";
+  for (unsigned i = 0; i < NumPhases; ++i) {
+    if (isPerFile(i)) {
+      os << "---" << phaseNames[i] << "---  ";
+    }
+  }
+  os << "--- File ---\n";
+  for (const auto *entry : sorted) {
+    Duration fileTotal = getTotal(entry->second);
+    os << llvm::format("   %7.4f (%5.1f%%)  ", getSeconds(fileTotal),
+                       percent(fileTotal));
+    for (unsigned i = 0; i < NumPhases; ++i) {
+      if (isPerFile(i)) {
+        // right-aligned under the heading
+        unsigned width = std::strlen(phaseNames[i]) + 6;
+        os << llvm::format("%*.4f  ", width, getSeconds(entry->second[i]));
+      }
+    }
+    os << entry->first() << "\n";
+  }
+}
+
+thread_local PhaseTimer *PhaseTimer::current = nullptr;
+
+PhaseTimer::PhaseTimer(TimeReport *report, TimeReport::Phase phase,
+                       llvm::StringRef file)
+    : report(report), phase(phase), file(file) {
+  if (!report) {
+    return;
+  }
+  start = std::chrono::steady_clock::now();
+  outer = current;
+  if (outer) {
+    outer->report->add(outer->phase, outer->file, start - outer->start);
+  }
+  current = this;
+}
+
+PhaseTimer::~PhaseTimer() {
+  if (!report) {
+    return;
+  }
+  auto now = std::chrono::steady_clock::now();
+  report->add(phase, file, now - start);
+  current = outer;
+  if (outer) {
+    outer->start = now;
+  }
+}
+
+} // namespace grp
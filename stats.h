@@ -0,0 +1,123 @@
+#pragma once
+
+#include "llvm/ADT/Statistic.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <mutex>
+
+namespace grp {
+
+// Counters printed with -stats. With GRP_ENABLE_STATS they are
+// llvm::TrackingStatistics, otherwise no-ops the compiler drops, whatever
+// LLVM was built with.
+#ifdef GRP_ENABLE_STATS
+using Statistic = llvm::TrackingStatistic;
+#else
+using Statistic = llvm::NoopStatistic;
+#endif
+
+#define GRP_STATISTIC(VARNAME, DESC)                                         \
+  static grp::Statistic VARNAME = {DEBUG_TYPE, #VARNAME, DESC}
+
+// Counts by kind into plain integers, added to `stats` when destroyed: hot
+// loops (e.g. one count per token) don't touch the shared atomic counters.
+// `KindT` is an enum whose values index `stats`.
+template <typename KindT, size_t N> class StatCounters {
+#ifdef GRP_ENABLE_STATS
+  Statistic *stats;
+  std::array<unsigned, N> counts{};
+
+public:
+  explicit StatCounters(Statistic (&stats)[N]) : stats(stats) {}
+  StatCounters(StatCounters &&other)
+      : stats(other.stats), counts(other.counts) {
+    other.counts.fill(0);
+  }
+  ~StatCounters() {
+    for (size_t i = 0; i < N; ++i) {
+      if (counts[i]) {
+        stats[i] += counts[i];
+      }
+    }
+  }
+  void count(KindT kind) { ++counts[static_cast<size_t>(kind)]; }
+  // drop the counts so far, return their sum
+  unsigned discard() {
+    unsigned sum = 0;
+    for (unsigned &count : counts) {
+      sum += count;
+      count = 0;
+    }
+    return sum;
+  }
+#else
+public:
+  explicit StatCounters(Statistic (&)[N]) {}
+  void count(KindT) {}
+  unsigned discard() { return 0; }
+#endif
+};
+
+// Wall time per phase of the parse and per file, printed with -time-report.
+// Thread-safe; the time of phases running in parallel adds up, so the total
+// may exceed the time the parse took.
+class TimeReport {
+public:
+  enum Phase {
+    // reading files
+    Read,
+    // finding included files in the include paths
+    IncludeResolution,
+    // finding top-level forms without lexing, to split files into chunks or
+    // find what to prefetch
+    Prescan,
+    // lexing ahead of parsing, see ParserOption::TokenMode; live lexing is
+    // part of Parse
+    Lex,
+    // building the CST
+    Parse,
+    // loading and writing the CSTCache
+    Cache,
+    NumPhases,
+  };
+  using Duration = std::chrono::steady_clock::duration;
+  using Durations = std::array<Duration, NumPhases>;
+
+private:
+  std::mutex mutex;
+  Durations phases{};
+  // by path, for the phases spent on a single file
+  llvm::StringMap<Durations> files;
+
+public:
+  // `file` may be empty
+  void add(Phase phase, llvm::StringRef file, Duration duration);
+  void print(llvm::raw_ostream &os);
+};
+
+// Times a phase of the parse into `report` for its lifetime, unless
+// `report` is null. Timers nest per thread: while an inner one runs, the
+// outer one is paused, so the time of each phase excludes the others.
+class PhaseTimer {
+  TimeReport *report;
+  TimeReport::Phase phase;
+  llvm::StringRef file;
+  PhaseTimer *outer;
+  std::chrono::steady_clock::time_point start;
+  // the innermost timer running on this thread
+  static thread_local PhaseTimer *current;
+
+public:
+  PhaseTimer(TimeReport *report, TimeReport::Phase phase,
+             llvm::StringRef file = llvm::StringRef());
+  ~PhaseTimer();
+  PhaseTimer(const PhaseTimer &) = delete;
+  PhaseTimer &operator=(const PhaseTimer &) = delete;
+};
+
+} // namespace grp
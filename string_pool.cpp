@@ -0,0 +1,69 @@
+#include "string_pool.h"
+
+namespace grp {
+
+std::string StringPool::unescape(llvm::StringRef literal) {
+  std::string result;
+  result.reserve(literal.size());
+  for (size_t i = 0; i < literal.size(); ++i) {
+    char c = literal[i];
+    if (c != '\\' || i + 1 == literal.size()) {
+      result.push_back(c);
+      continue;
+    }
+    c = literal[++i];
+    switch (c) {
+    // backslash-newline is replaced by nothing, as in C
+    case '\n':
+      continue;
+    case '\\':
+    case '"':
+    case '\'':
+      break;
+    // standard C escapes are passed through, the string usually ends up in
+    // C code
+    case 'a':
+    case 'b':
+    case 'f':
+    case 'n':
+    case 'r':
+    case 't':
+    case 'v':
+    case '0':
+    case '1':
+    case '2':
+    case '3':
+    case '4':
+    case '5':
+    case '6':
+    case '7':
+    case 'x':
+      result.push_back('\\');
+      break;
+    // newline and tab in a C string, for output templates
+    case ';':
+      result += "\\n\\t";
+      continue;
+    default:
+      // TODO: diag, unrecognized escape
+      result.push_back('\\');
+      break;
+    }
+    result.push_back(c);
+  }
+  return result;
+}
+
+StringPool::IDTy StringPool::getLiteral(llvm::StringRef literal) {
+  if (literal.find('\\') == llvm::StringRef::npos) {
+    return strings.get(literal);
+  }
+  std::lock_guard<std::mutex> lock(escapedMutex);
+  auto inserted = escaped.try_emplace(literal, InvalidID);
+  if (inserted.second) {
+    inserted.first->second = strings.get(unescape(literal));
+  }
+  return inserted.first->second;
+}
+
+} // namespace grp
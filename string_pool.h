@@ -0,0 +1,44 @@
+#pragma once
+
+#include "identifier_interner.h"
+
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+
+#include <mutex>
+#include <string>
+
+namespace grp {
+
+// Interns the contents of string literals, e.g. predicate names and
+// constraints, so that they can be compared and hashed by ID. Like
+// IdentifierInterner, strings are copied into the pool and it is thread-safe.
+//
+// Literals are interned after escape processing; the few that have escapes
+// are only processed the first time they are seen.
+class StringPool {
+public:
+  using IDTy = grp::IDTy;
+  enum : uint64_t { InvalidID = IdentifierInterner::InvalidID };
+
+private:
+  IdentifierInterner strings{/*withKeywords=*/false};
+  // literal as written -> ID of its contents, for literals with escapes
+  std::mutex escapedMutex;
+  llvm::StringMap<IDTy> escaped;
+
+public:
+  // intern the characters between the quotes of a string literal
+  IDTy getLiteral(llvm::StringRef literal);
+  // intern `str` as is
+  IDTy get(llvm::StringRef str) { return strings.get(str); }
+  // the ID of `str` if it has been interned, InvalidID otherwise
+  IDTy lookup(llvm::StringRef str) const { return strings.lookup(str); }
+  // the string `id` stands for, `id` must come from this pool
+  llvm::StringRef getString(IDTy id) const { return strings.getName(id); }
+  size_t getNumStrings() const { return strings.getNumIdentifiers(); }
+  // process the escapes of a string literal the way GCC's md reader does
+  static std::string unescape(llvm::StringRef literal);
+};
+
+} // namespace grp
@@ -0,0 +1,113 @@
+#include "thread_pool.h"
+
+#include <cassert>
+
+namespace grp {
+namespace {
+// the pool the current thread works for, and its index there
+thread_local const ThreadPool *currentPool = nullptr;
+thread_local unsigned currentWorker = 0;
+} // namespace
+
+ThreadPool::ThreadPool(unsigned numThreads) {
+  if (numThreads == 0) {
+    numThreads = 1;
+  }
+  for (unsigned i = 0; i < numThreads; ++i) {
+    workers.push_back(std::make_unique<Worker>());
+  }
+  for (unsigned i = 0; i < numThreads; ++i) {
+    threads.emplace_back([this, i] { runWorker(i); });
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  wait();
+  {
+    std::lock_guard<std::mutex> lock(stateMutex);
+    stopping = true;
+  }
+  workAvailable.notify_all();
+  for (auto &thread : threads) {
+    thread.join();
+  }
+}
+
+void ThreadPool::async(Task task) {
+  unsigned target;
+  {
+    // count the task before it becomes visible, so that a thief never sees
+    // the counters go below zero
+    std::lock_guard<std::mutex> lock(stateMutex);
+    target = currentPool == this ? currentWorker
+                                 : nextWorker++ % workers.size();
+    ++numQueued;
+    ++numPending;
+  }
+  {
+    std::lock_guard<std::mutex> lock(workers[target]->mutex);
+    workers[target]->tasks.push_back(std::move(task));
+  }
+  workAvailable.notify_one();
+}
+
+void ThreadPool::wait() {
+  assert(currentPool != this && "waiting from a task would dead-lock");
+  std::unique_lock<std::mutex> lock(stateMutex);
+  allDone.wait(lock, [this] { return numPending == 0; });
+}
+
+bool ThreadPool::popTask(unsigned self, Task &task) {
+  Worker &worker = *workers[self];
+  std::lock_guard<std::mutex> lock(worker.mutex);
+  if (worker.tasks.empty()) {
+    return false;
+  }
+  task = std::move(worker.tasks.back());
+  worker.tasks.pop_back();
+  return true;
+}
+
+bool ThreadPool::stealTask(unsigned self, Task &task) {
+  for (unsigned i = 1; i < workers.size(); ++i) {
+    Worker &victim = *workers[(self + i) % workers.size()];
+    std::lock_guard<std::mutex> lock(victim.mutex);
+    if (!victim.tasks.empty()) {
+      task = std::move(victim.tasks.front());
+      victim.tasks.pop_front();
+      return true;
+    }
+  }
+  return false;
+}
+
+void ThreadPool::runWorker(unsigned self) {
+  currentPool = this;
+  currentWorker = self;
+  while (true) {
+    Task task;
+    if (popTask(self, task) || stealTask(self, task)) {
+      {
+        std::lock_guard<std::mutex> lock(stateMutex);
+        --numQueued;
+      }
+      task();
+      bool done;
+      {
+        std::lock_guard<std::mutex> lock(stateMutex);
+        done = --numPending == 0;
+      }
+      if (done) {
+        allDone.notify_all();
+      }
+      continue;
+    }
+    std::unique_lock<std::mutex> lock(stateMutex);
+    workAvailable.wait(lock, [this] { return stopping || numQueued != 0; });
+    if (stopping && numQueued == 0) {
+      return;
+    }
+  }
+}
+
+} // namespace grp
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace grp {
+
+// A fixed set of worker threads with a deque of tasks each. A task spawned by
+// a worker goes to the back of that worker's deque, which the worker pops
+// from (depth first, the data it just produced is still in cache); idle
+// workers steal from the front of the others' deques. Tasks spawned from
+// outside the pool are dealt out round-robin.
+class ThreadPool {
+public:
+  using Task = std::function<void()>;
+
+private:
+  struct alignas(64) Worker {
+    std::mutex mutex;
+    std::deque<Task> tasks;
+  };
+  std::vector<std::unique_ptr<Worker>> workers;
+  std::vector<std::thread> threads;
+
+  std::mutex stateMutex;
+  std::condition_variable workAvailable;
+  std::condition_variable allDone;
+  // tasks sitting in some deque
+  size_t numQueued = 0;
+  // tasks submitted but not finished yet
+  size_t numPending = 0;
+  bool stopping = false;
+  unsigned nextWorker = 0;
+
+  bool popTask(unsigned self, Task &task);
+  bool stealTask(unsigned self, Task &task);
+  void runWorker(unsigned self);
+
+public:
+  explicit ThreadPool(unsigned numThreads);
+  // waits for the tasks still pending
+  ~ThreadPool();
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  unsigned getNumThreads() const { return threads.size(); }
+  // run `task` on one of the workers, may be called from tasks
+  void async(Task task);
+  // block until all tasks, including the ones spawned by tasks, have run;
+  // must not be called from a task
+  void wait();
+};
+
+} // namespace grp
@@ -0,0 +1,96 @@
+#pragma once
+
+#include "keywords.h"
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+namespace grp {
+
+enum class TokenKind : uint8_t {
+  Invalid,
+  Identifier,
+  String,
+  CodeString,
+  Number,
+  OpenParen,
+  CloseParen,
+  OpenBracket,
+  CloseBracket,
+  Colon,
+  EndOfStream
+};
+constexpr size_t NumTokenKinds =
+    static_cast<size_t>(TokenKind::EndOfStream) + 1;
+
+// Tokens are passed around by value, so keep them small and trivially
+// copyable: the payload refers back into the buffer being lexed, and numbers
+// are only materialized when asked for, see Lexer::getString/getNumber
+class Token {
+  TokenKind kind;
+  // only for numbers: whether the literal is preceded by a '-'
+  bool negative;
+  // offset of the first character of the token in the buffer
+  uint32_t offset;
+  union {
+    IDTy id;
+    // characters of a string/number in the buffer, without quotes/braces/sign
+    struct {
+      uint32_t start;
+      uint32_t length;
+    } range;
+  };
+
+  Token(TokenKind kind, uint32_t offset)
+      : kind(kind), negative(false), offset(offset), id(0) {}
+  friend class TokenStream;
+
+public:
+  Token() : kind(TokenKind::Invalid), negative(false), offset(0), id(0) {}
+  TokenKind getKind() const { return kind; }
+  bool isValid() const { return kind != TokenKind::Invalid; }
+  bool isAnyString() const {
+    return kind == TokenKind::String || kind == TokenKind::CodeString;
+  }
+  bool isPlainString() const { return kind == TokenKind::String; }
+  bool isCodeString() const { return kind == TokenKind::CodeString; }
+  bool isIdentifier() const { return kind == TokenKind::Identifier; }
+  bool isNumber() const { return kind == TokenKind::Number; }
+  bool isEOS() const { return kind == TokenKind::EndOfStream; }
+  IDTy getID() const {
+    assert(kind == TokenKind::Identifier);
+    return id;
+  }
+  uint32_t getOffset() const { return offset; }
+  bool isNegative() const {
+    assert(kind == TokenKind::Number);
+    return negative;
+  }
+  uint32_t getRangeStart() const {
+    assert(kind == TokenKind::String || kind == TokenKind::CodeString ||
+           kind == TokenKind::Number);
+    return range.start;
+  }
+  uint32_t getRangeLength() const {
+    assert(kind == TokenKind::String || kind == TokenKind::CodeString ||
+           kind == TokenKind::Number);
+    return range.length;
+  }
+  static Token createEOF(uint32_t offset);
+  static Token createInvalid(uint32_t offset);
+  static Token createIdentifier(IDTy ID, uint32_t offset);
+  static Token createString(uint32_t start, uint32_t length, uint32_t offset);
+  static Token createCodeString(uint32_t start, uint32_t length,
+                                uint32_t offset);
+  static Token createNumber(uint32_t start, uint32_t length, uint32_t offset,
+                            bool negative);
+  static Token createDelimiter(TokenKind kind, uint32_t offset);
+};
+
+static_assert(sizeof(Token) <= 16, "Token is copied around by value");
+static_assert(std::is_trivially_copyable<Token>::value,
+              "Token is copied around by value");
+
+} // namespace grp
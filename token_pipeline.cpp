@@ -0,0 +1,88 @@
+#include "token_pipeline.h"
+
+#include <limits>
+
+namespace grp {
+
+TokenPipeline::TokenPipeline(const llvm::MemoryBuffer &buffer,
+                             IdentifierInterner &ii,
+                             SourceLocation bufferStart, uint32_t beginOffset,
+                             uint32_t endOffset, bool async, size_t blockSize)
+    : lexer(buffer, ii, bufferStart, beginOffset, endOffset),
+      blockSize(blockSize) {
+  if (async) {
+    producer = std::thread([this] { produce(); });
+    return;
+  }
+  auto block = std::make_unique<TokenStream>();
+  // roughly one token per 6 bytes in real .md files
+  block->reserve((endOffset - beginOffset) / 6 + 1);
+  lexBlock(*block, std::numeric_limits<size_t>::max());
+  blocks.push_back(std::move(block));
+}
+
+TokenPipeline::~TokenPipeline() {
+  if (producer.joinable()) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    blockTaken.notify_one();
+    producer.join();
+  }
+}
+
+bool TokenPipeline::lexBlock(TokenStream &block, size_t minSize) {
+  while (true) {
+    Token tok = lexer.lex();
+    block.push_back(tok);
+    switch (tok.getKind()) {
+    case TokenKind::EndOfStream:
+      return false;
+    case TokenKind::OpenParen:
+    case TokenKind::OpenBracket:
+      ++depth;
+      break;
+    case TokenKind::CloseParen:
+    case TokenKind::CloseBracket:
+      --depth;
+      break;
+    default:
+      break;
+    }
+    if (depth <= 0 && block.size() >= minSize) {
+      return true;
+    }
+  }
+}
+
+void TokenPipeline::produce() {
+  bool more = true;
+  while (more) {
+    auto block = std::make_unique<TokenStream>();
+    block->reserve(blockSize + blockSize / 4);
+    more = lexBlock(*block, blockSize);
+    std::unique_lock<std::mutex> lock(mutex);
+    blockTaken.wait(lock, [this] {
+      return stopping || blocks.size() < MaxQueuedBlocks;
+    });
+    if (stopping) {
+      return;
+    }
+    blocks.push_back(std::move(block));
+    lock.unlock();
+    blockReady.notify_one();
+  }
+}
+
+std::unique_ptr<TokenStream> TokenPipeline::next() {
+  std::unique_lock<std::mutex> lock(mutex);
+  blockReady.wait(lock, [this] { return !blocks.empty(); });
+  auto block = std::move(blocks.front());
+  blocks.pop_front();
+  lock.unlock();
+  blockTaken.notify_one();
+  return block;
+}
+
+} // namespace grp
@@ -0,0 +1,52 @@
+#pragma once
+
+#include "lexer.h"
+#include "token_stream.h"
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace grp {
+
+// Lexes a buffer (or a range of it) ahead of the parser into TokenStream
+// blocks, see Lexer::pretokenize. Blocks are only cut between top-level forms
+// once they hold `blockSize` tokens; the last one ends with the end of stream.
+//
+// In async mode a thread of its own does the lexing, a few blocks ahead of the
+// consumer, so that lexing block N+1 overlaps with parsing block N. Otherwise
+// everything is lexed by the constructor, into a single block.
+class TokenPipeline {
+  Lexer lexer;
+  size_t blockSize;
+  // nesting level of parentheses/brackets at the end of the last block
+  int depth = 0;
+
+  std::thread producer;
+  std::mutex mutex;
+  std::condition_variable blockReady;
+  std::condition_variable blockTaken;
+  std::deque<std::unique_ptr<TokenStream>> blocks;
+  bool stopping = false;
+
+  static constexpr size_t MaxQueuedBlocks = 8;
+
+  // return false once the end of stream is in `block`
+  bool lexBlock(TokenStream &block, size_t minSize);
+  void produce();
+
+public:
+  TokenPipeline(const llvm::MemoryBuffer &buffer, IdentifierInterner &ii,
+                SourceLocation bufferStart, uint32_t beginOffset,
+                uint32_t endOffset, bool async, size_t blockSize = 4096);
+  ~TokenPipeline();
+  TokenPipeline(const TokenPipeline &) = delete;
+  TokenPipeline &operator=(const TokenPipeline &) = delete;
+  // the next block, waits for the producer if needed; must not be called
+  // after the block with the end of stream
+  std::unique_ptr<TokenStream> next();
+};
+
+} // namespace grp
@@ -0,0 +1,78 @@
+#pragma once
+
+#include "token.h"
+
+#include <cstdint>
+#include <vector>
+
+namespace grp {
+
+// The tokens of a buffer (or a range of it) lexed ahead of time, kept as
+// parallel arrays: kinds alone are enough to decide most of the parser's
+// branches, and the offsets/payloads are only touched for the tokens that
+// make it into a CST.
+class TokenStream {
+  std::vector<TokenKind> kinds;
+  std::vector<uint32_t> offsets;
+  // identifiers: the ID; strings and numbers: start | length << 32, with the
+  // top bit of the length holding the sign of a number
+  std::vector<uint64_t> payloads;
+
+  static constexpr uint64_t NegativeBit = uint64_t(1) << 63;
+
+public:
+  size_t size() const { return kinds.size(); }
+  bool empty() const { return kinds.empty(); }
+  void reserve(size_t size) {
+    kinds.reserve(size);
+    offsets.reserve(size);
+    payloads.reserve(size);
+  }
+  void clear() {
+    kinds.clear();
+    offsets.clear();
+    payloads.clear();
+  }
+  TokenKind getKind(size_t index) const { return kinds[index]; }
+  void push_back(const Token &tok) {
+    kinds.push_back(tok.kind);
+    offsets.push_back(tok.offset);
+    uint64_t payload;
+    switch (tok.kind) {
+    case TokenKind::Identifier:
+      payload = tok.id;
+      break;
+    case TokenKind::String:
+    case TokenKind::CodeString:
+    case TokenKind::Number:
+      assert(tok.range.length < (uint32_t(1) << 31));
+      payload = tok.range.start | uint64_t(tok.range.length) << 32 |
+                (tok.negative ? NegativeBit : 0);
+      break;
+    default:
+      payload = 0;
+    }
+    payloads.push_back(payload);
+  }
+  Token operator[](size_t index) const {
+    Token result(kinds[index], offsets[index]);
+    uint64_t payload = payloads[index];
+    switch (result.kind) {
+    case TokenKind::Identifier:
+      result.id = payload;
+      break;
+    case TokenKind::String:
+    case TokenKind::CodeString:
+    case TokenKind::Number:
+      result.range.start = static_cast<uint32_t>(payload);
+      result.range.length = static_cast<uint32_t>(payload >> 32) & ~(1u << 31);
+      result.negative = payload & NegativeBit;
+      break;
+    default:
+      break;
+    }
+    return result;
+  }
+};
+
+} // namespace grp